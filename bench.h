@@ -0,0 +1,423 @@
+// *************************************************************************
+// A B O U T   T H I S   W O R K  -   S H E L L S P A W N
+// *************************************************************************
+// Work Name   : ShellSpawn
+// Description : This provides a simple interface to spawn a process
+//             : with redirected input and output
+// Copyright   : Copyright (C) 2008,2021 Adrian Sutherland
+// *************************************************************************
+// A B O U T   T H I S   F I L E
+// *************************************************************************
+// File Name   : bench.h
+// Description : Helpers shared by the shellspawn benchmarks
+// *************************************************************************
+// L I C E N S E
+// *************************************************************************
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of version 3 of the GNU General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//
+// For the avoidance of doubt:
+// - Version 3 of the license (i.e. not earlier nor later versions) apply.
+// - a copy of the license text should be in the "license" directory of the
+//   source distribution.
+// - Requests for use under other licenses will be treated sympathetically,
+//   please see contact details.
+// *************************************************************************
+// C O N T A C T   D E T A I L S
+// *************************************************************************
+// E-mail      : adrian@sutherlandonline.org
+// *************************************************************************
+
+#ifndef bench_h
+#define bench_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/utsname.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+// Monotonic time in ns
+static unsigned long long BenchNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+// A set of measurements (e.g. latencies in ns)
+typedef struct benchsamples {
+    unsigned long long *values;
+    size_t count;
+    size_t size;
+} BENCHSAMPLES;
+
+static void BenchAddSample(BENCHSAMPLES *samples, unsigned long long value) {
+    if (samples->count == samples->size) {
+        samples->size = samples->size ? samples->size * 2 : 1024;
+        samples->values = realloc(samples->values, sizeof(unsigned long long) * samples->size);
+    }
+    samples->values[samples->count++] = value;
+}
+
+static void BenchFreeSamples(BENCHSAMPLES *samples) {
+    if (samples->values) free(samples->values);
+    samples->values = 0;
+    samples->count = 0;
+    samples->size = 0;
+}
+
+static int BenchCompare(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Percentile (0-100) of the samples - nearest rank. Sorts the samples
+static unsigned long long BenchPercentile(BENCHSAMPLES *samples, double percentile) {
+    size_t rank;
+
+    if (!samples->count) return 0;
+    qsort(samples->values, samples->count, sizeof(unsigned long long), BenchCompare);
+    rank = (size_t)(percentile / 100.0 * (double)samples->count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > samples->count) rank = samples->count;
+    return samples->values[rank - 1];
+}
+
+static double BenchMean(BENCHSAMPLES *samples) {
+    double total = 0;
+    size_t i;
+
+    if (!samples->count) return 0;
+    for (i = 0; i < samples->count; i++) total += (double)samples->values[i];
+    return total / (double)samples->count;
+}
+
+// Summary of a set of latency samples (ns)
+typedef struct benchlatency {
+    size_t count;
+    double mean;
+    double stddev;
+    unsigned long long p50, p99, p999, max;
+} BENCHLATENCY;
+
+static void BenchSummarise(BENCHSAMPLES *samples, BENCHLATENCY *latency) {
+    double total = 0;
+    size_t i;
+
+    memset(latency, 0, sizeof(BENCHLATENCY));
+    if (!samples->count) return;
+    latency->count = samples->count;
+    latency->mean = BenchMean(samples);
+    for (i = 0; i < samples->count; i++)
+        total += ((double)samples->values[i] - latency->mean) * ((double)samples->values[i] - latency->mean);
+    if (samples->count > 1) latency->stddev = sqrt(total / (double)(samples->count - 1));
+    latency->p50 = BenchPercentile(samples, 50);
+    latency->p99 = BenchPercentile(samples, 99);
+    latency->p999 = BenchPercentile(samples, 99.9);
+    latency->max = BenchPercentile(samples, 100);
+}
+
+// CPU seconds (user + system) used by this process (or its waited for
+// children with RUSAGE_CHILDREN)
+static double BenchCpuSeconds(int who) {
+    struct rusage usage;
+
+    getrusage(who, &usage);
+    return (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1e6
+           + (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1e6;
+}
+
+// Peak RSS of this process in KB
+static long BenchMaxRssKB(void) {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // Bytes on OSX
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+// Number of open file descriptors in this process (-1 if unknown)
+static int BenchFdCount(void) {
+    DIR *dir = opendir("/proc/self/fd");
+    struct dirent *entry;
+    int count = 0;
+
+    if (!dir) return -1;
+    while ((entry = readdir(dir)))
+        if (entry->d_name[0] != '.') count++;
+    closedir(dir);
+    return count - 1; // Not the one used by opendir()
+}
+
+// Reads a numeric field (e.g. "Threads:") from /proc/self/status (-1 if unknown)
+static long BenchStatusField(const char *field) {
+    FILE *status = fopen("/proc/self/status", "r");
+    char line[256];
+    size_t length = strlen(field);
+    long value = -1;
+
+    if (!status) return -1;
+    while (fgets(line, sizeof(line), status)) {
+        if (strncmp(line, field, length) == 0) {
+            value = atol(line + length);
+            break;
+        }
+    }
+    fclose(status);
+    return value;
+}
+
+// Number of threads in this process (-1 if unknown)
+static long BenchThreadCount(void) {
+    return BenchStatusField("Threads:");
+}
+
+// Resident set size of this process in KB (-1 if unknown)
+static long BenchRssKB(void) {
+    return BenchStatusField("VmRSS:");
+}
+
+// Number of zombie (exited but not waited for) children of this process
+// (-1 if unknown)
+static int BenchZombieCount(void) {
+    DIR *dir = opendir("/proc");
+    struct dirent *entry;
+    char path[64];
+    char line[512];
+    char *end;
+    char state;
+    long parent;
+    int count = 0;
+    FILE *stat;
+
+    if (!dir) return -1;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') continue;
+        snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+        if (!(stat = fopen(path, "r"))) continue;
+        // pid (comm) state ppid ... - comm can contain spaces and brackets
+        if (fgets(line, sizeof(line), stat) && (end = strrchr(line, ')')) &&
+            sscanf(end + 1, " %c %ld", &state, &parent) == 2 &&
+            state == 'Z' && parent == (long)getpid()) count++;
+        fclose(stat);
+    }
+    closedir(dir);
+    return count;
+}
+
+// Results files
+// -------------
+// All the benchmarks write the same JSON layout, which benchcompare reads:
+// {"schema": "shellspawn-bench-1", "benchmark": name, "timestamp": UTC time,
+//  "git_revision": hash, "host": {...}, "params": {...},
+//  "results": [{"name": unique within the benchmark, "params": {...},
+//               "runs": n, "failures": n,
+//               "latency_us": {"count", "mean", "stddev", "p50", "p99", "p999", "max"},
+//               "throughput": {"value", "unit"}, "cpu": {"value", "unit"},
+//               "rss_kb": n, "metrics": {...}}, ...]}
+// latency_us, throughput, cpu, rss_kb and metrics are left out when not measured
+
+#define BENCH_SCHEMA "shellspawn-bench-1"
+
+// One result
+typedef struct benchrecord {
+    char name[128];             // Baselines are matched on the name
+    char params[512];           // JSON members (see BenchJsonAdd())
+    size_t runs;
+    size_t failures;
+    BENCHLATENCY latency;       // Left out if latency.count is 0
+    double throughput;          // Higher is better - left out if 0
+    const char *throughputUnit;
+    double cpu;                 // Lower is better - left out if < 0
+    const char *cpuUnit;
+    long rssKB;                 // Peak RSS (or its growth) - left out if < 0
+    char metrics[1024];         // Other JSON members
+} BENCHRECORD;
+
+// An open results file
+typedef struct benchjson {
+    FILE *file;
+    int results;
+} BENCHJSON;
+
+static void BenchRecordInit(BENCHRECORD *record, const char *name) {
+    memset(record, 0, sizeof(BENCHRECORD));
+    snprintf(record->name, sizeof(record->name), "%s", name);
+    record->cpu = -1;
+    record->rssKB = -1;
+}
+
+// Writes text as a JSON string
+static void BenchJsonString(FILE *file, const char *text) {
+    fputc('"', file);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') fprintf(file, "\\%c", *text);
+        else if ((unsigned char)*text < 0x20) fprintf(file, "\\u%04x", (unsigned char)*text);
+        else fputc(*text, file);
+    }
+    fputc('"', file);
+}
+
+// Appends a "name": value member to the JSON members in a buffer. The value
+// is formatted with format and its arguments - a %s format is written as a
+// string, anything else as a number
+static void BenchJsonAdd(char *members, size_t size, const char *name, const char *format, ...) {
+    char value[512];
+    size_t length = strlen(members);
+    size_t i, j;
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(value, sizeof(value), format, args);
+    va_end(args);
+
+    if (length && length < size) length += (size_t)snprintf(members + length, size - length, ", ");
+    if (length >= size) return;
+    if (strcmp(format, "%s") == 0) {
+        length += (size_t)snprintf(members + length, size - length, "\"%s\": \"", name);
+        if (length >= size) return;
+        for (i = 0, j = length; value[i] && j + 3 < size; i++) {
+            if (value[i] == '"' || value[i] == '\\') members[j++] = '\\';
+            members[j++] = (unsigned char)value[i] < 0x20 ? ' ' : value[i];
+        }
+        if (j + 1 < size) members[j++] = '"';
+        members[j] = 0;
+    }
+    else snprintf(members + length, size - length, "\"%s\": %s", name, value);
+}
+
+// Reads the first line of a command's output
+static void BenchCommandOutput(const char *command, char *buffer, size_t size) {
+    FILE *pipe = popen(command, "r");
+
+    buffer[0] = 0;
+    if (!pipe) return;
+    if (fgets(buffer, (int)size, pipe)) buffer[strcspn(buffer, "\r\n")] = 0;
+    pclose(pipe);
+}
+
+// Git revision of the source tree (SHELLSPAWN_GIT_REVISION overrides it),
+// with -dirty if there are uncommitted changes
+static void BenchGitRevision(char *buffer, size_t size) {
+    char dirty[8];
+
+    if (getenv("SHELLSPAWN_GIT_REVISION")) {
+        snprintf(buffer, size, "%s", getenv("SHELLSPAWN_GIT_REVISION"));
+        return;
+    }
+    BenchCommandOutput("git rev-parse HEAD 2>/dev/null", buffer, size);
+    if (!buffer[0]) {
+        snprintf(buffer, size, "unknown");
+        return;
+    }
+    BenchCommandOutput("git diff --quiet HEAD -- 2>/dev/null || echo dirty", dirty, sizeof(dirty));
+    if (dirty[0] && strlen(buffer) + 7 < size) strcat(buffer, "-dirty");
+}
+
+// Opens a results file and writes everything up to the results. params are
+// the benchmark's JSON members (see BenchJsonAdd())
+static int BenchJsonOpen(BENCHJSON *json, const char *fileName, const char *benchmark, const char *params) {
+    struct utsname host;
+    char revision[128];
+    char timestamp[32];
+    char cpuModel[256] = "";
+    char line[256];
+    FILE *cpuInfo;
+    time_t now = time(NULL);
+
+    json->results = 0;
+    json->file = fopen(fileName, "w");
+    if (!json->file) {
+        perror("Error opening JSON file");
+        return -1;
+    }
+
+    BenchGitRevision(revision, sizeof(revision));
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    memset(&host, 0, sizeof(host));
+    uname(&host);
+    cpuInfo = fopen("/proc/cpuinfo", "r");
+    if (cpuInfo) {
+        while (fgets(line, sizeof(line), cpuInfo)) {
+            if (strncmp(line, "model name", 10) == 0 && strchr(line, ':')) {
+                snprintf(cpuModel, sizeof(cpuModel), "%s", strchr(line, ':') + 2);
+                cpuModel[strcspn(cpuModel, "\r\n")] = 0;
+                break;
+            }
+        }
+        fclose(cpuInfo);
+    }
+    else BenchCommandOutput("sysctl -n machdep.cpu.brand_string 2>/dev/null", cpuModel, sizeof(cpuModel));
+
+    fprintf(json->file, "{\n  \"schema\": \"%s\",\n  \"benchmark\": ", BENCH_SCHEMA);
+    BenchJsonString(json->file, benchmark);
+    fprintf(json->file, ",\n  \"timestamp\": \"%s\",\n  \"git_revision\": ", timestamp);
+    BenchJsonString(json->file, revision);
+    fprintf(json->file, ",\n  \"host\": {\"name\": ");
+    BenchJsonString(json->file, host.nodename);
+    fprintf(json->file, ", \"os\": ");
+    BenchJsonString(json->file, host.sysname);
+    fprintf(json->file, ", \"release\": ");
+    BenchJsonString(json->file, host.release);
+    fprintf(json->file, ", \"machine\": ");
+    BenchJsonString(json->file, host.machine);
+    fprintf(json->file, ", \"cpus\": %ld, \"cpu_model\": ", sysconf(_SC_NPROCESSORS_ONLN));
+    BenchJsonString(json->file, cpuModel);
+    fprintf(json->file, "},\n  \"params\": {%s},\n  \"results\": [", params);
+    fflush(json->file); // Not to be copied into forked children
+    return 0;
+}
+
+static void BenchJsonResult(BENCHJSON *json, const BENCHRECORD *record) {
+    FILE *file = json->file;
+
+    if (!file) return;
+    fprintf(file, "%s\n    {\"name\": ", json->results++ ? "," : "");
+    BenchJsonString(file, record->name);
+    fprintf(file, ", \"params\": {%s}, \"runs\": %lu, \"failures\": %lu", record->params,
+            (unsigned long)record->runs, (unsigned long)record->failures);
+    if (record->latency.count)
+        fprintf(file, ",\n     \"latency_us\": {\"count\": %lu, \"mean\": %.3f, \"stddev\": %.3f, "
+                      "\"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}",
+                (unsigned long)record->latency.count, record->latency.mean / 1000.0,
+                record->latency.stddev / 1000.0, record->latency.p50 / 1000.0,
+                record->latency.p99 / 1000.0, record->latency.p999 / 1000.0, record->latency.max / 1000.0);
+    if (record->throughput > 0)
+        fprintf(file, ",\n     \"throughput\": {\"value\": %.3f, \"unit\": \"%s\"}",
+                record->throughput, record->throughputUnit);
+    if (record->cpu >= 0)
+        fprintf(file, ",\n     \"cpu\": {\"value\": %.6g, \"unit\": \"%s\"}", record->cpu, record->cpuUnit);
+    if (record->rssKB >= 0) fprintf(file, ", \"rss_kb\": %ld", record->rssKB);
+    if (record->metrics[0]) fprintf(file, ",\n     \"metrics\": {%s}", record->metrics);
+    fprintf(file, "}");
+    fflush(file);
+}
+
+static void BenchJsonClose(BENCHJSON *json, const char *fileName) {
+    if (!json->file) return;
+    fprintf(json->file, "\n  ]\n}\n");
+    fclose(json->file);
+    json->file = NULL;
+    printf("Results written to %s\n", fileName);
+}
+
+#endif
@@ -0,0 +1,405 @@
+// *************************************************************************
+// A B O U T   T H I S   W O R K  -   S H E L L S P A W N
+// *************************************************************************
+// Work Name   : ShellSpawn
+// Description : This provides a simple interface to spawn a process
+//             : with redirected input and output
+// Copyright   : Copyright (C) 2008,2021 Adrian Sutherland
+// *************************************************************************
+// A B O U T   T H I S   F I L E
+// *************************************************************************
+// File Name   : benchcompare.c
+// Description : Compares a benchmark results file with a baseline
+// *************************************************************************
+// L I C E N S E
+// *************************************************************************
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of version 3 of the GNU General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//
+// For the avoidance of doubt:
+// - Version 3 of the license (i.e. not earlier nor later versions) apply.
+// - a copy of the license text should be in the "license" directory of the
+//   source distribution.
+// - Requests for use under other licenses will be treated sympathetically,
+//   please see contact details.
+// *************************************************************************
+// C O N T A C T   D E T A I L S
+// *************************************************************************
+// E-mail      : adrian@sutherlandonline.org
+// *************************************************************************
+
+// Usage: benchcompare [-t percent] [-T percent] [-z score] baseline.json current.json
+//  - Reads two results files written by the benchmarks (see bench.h) and
+//    compares each result in current.json with the baseline result of the
+//    same name
+//  - A metric regresses if it is worse by more than -t percent (default 5),
+//    or -T percent for the p99 latency (default 20). A mean latency change
+//    must also be significant - Welch's t statistic above -z (default 3)
+//  - Exits with 1 if anything regressed (2 on error)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Parsed JSON
+#define JSON_NULL   0
+#define JSON_BOOL   1
+#define JSON_NUMBER 2
+#define JSON_STRING 3
+#define JSON_ARRAY  4
+#define JSON_OBJECT 5
+
+typedef struct jsonvalue {
+    int type;
+    char *key;                 // Member name (if in an object)
+    char *string;
+    double number;
+    struct jsonvalue *child;   // First element / member
+    struct jsonvalue *next;    // Next sibling
+} JSONVALUE;
+
+// Comparison settings and totals
+typedef struct comparison {
+    double threshold;
+    double tailThreshold;
+    double zScore;
+    int regressions;
+    int improvements;
+} COMPARISON;
+
+/* Private functions */
+static JSONVALUE* ParseValue(const char **text);
+static void FreeJson(JSONVALUE *value);
+
+static void SkipSpace(const char **text) {
+    while (**text == ' ' || **text == '\t' || **text == '\r' || **text == '\n') (*text)++;
+}
+
+static char* ParseString(const char **text) {
+    const char *start = *text + 1;
+    const char *end;
+    char *string;
+    char *out;
+
+    for (end = start; *end && *end != '"'; end++)
+        if (*end == '\\' && end[1]) end++;
+    if (*end != '"') return NULL;
+
+    string = malloc((size_t)(end - start) + 1);
+    for (out = string; start < end; start++) {
+        if (*start != '\\') *out++ = *start;
+        else {
+            start++;
+            switch (*start) {
+                case 'n': *out++ = '\n'; break;
+                case 't': *out++ = '\t'; break;
+                case 'r': *out++ = '\r'; break;
+                case 'b': *out++ = '\b'; break;
+                case 'f': *out++ = '\f'; break;
+                case 'u': // Only needed for control characters - not decoded
+                    *out++ = '?';
+                    if (strlen(start) > 4) start += 4;
+                    break;
+                default: *out++ = *start;
+            }
+        }
+    }
+    *out = 0;
+    *text = end + 1;
+    return string;
+}
+
+// Parses the elements of an array or the members of an object
+static int ParseChildren(const char **text, JSONVALUE *parent, char close) {
+    JSONVALUE **last = &parent->child;
+    JSONVALUE *child;
+    char *key = NULL;
+
+    (*text)++;
+    SkipSpace(text);
+    if (**text == close) {
+        (*text)++;
+        return 0;
+    }
+    while (1) {
+        if (close == '}') {
+            if (**text != '"' || !(key = ParseString(text))) return -1;
+            SkipSpace(text);
+            if (**text != ':') {
+                free(key);
+                return -1;
+            }
+            (*text)++;
+        }
+        child = ParseValue(text);
+        if (!child) {
+            if (key) free(key);
+            return -1;
+        }
+        child->key = key;
+        key = NULL;
+        *last = child;
+        last = &child->next;
+        SkipSpace(text);
+        if (**text == ',') {
+            (*text)++;
+            SkipSpace(text);
+        }
+        else if (**text == close) {
+            (*text)++;
+            return 0;
+        }
+        else return -1;
+    }
+}
+
+static JSONVALUE* ParseValue(const char **text) {
+    JSONVALUE *value = calloc(1, sizeof(JSONVALUE));
+    char *end;
+
+    SkipSpace(text);
+    switch (**text) {
+        case '{':
+            value->type = JSON_OBJECT;
+            if (ParseChildren(text, value, '}')) break;
+            return value;
+
+        case '[':
+            value->type = JSON_ARRAY;
+            if (ParseChildren(text, value, ']')) break;
+            return value;
+
+        case '"':
+            value->type = JSON_STRING;
+            if (!(value->string = ParseString(text))) break;
+            return value;
+
+        default:
+            if (strncmp(*text, "true", 4) == 0 || strncmp(*text, "false", 5) == 0) {
+                value->type = JSON_BOOL;
+                value->number = **text == 't';
+                *text += **text == 't' ? 4 : 5;
+                return value;
+            }
+            if (strncmp(*text, "null", 4) == 0) {
+                *text += 4;
+                return value;
+            }
+            value->type = JSON_NUMBER;
+            value->number = strtod(*text, &end);
+            if (end == *text) break;
+            *text = end;
+            return value;
+    }
+    FreeJson(value);
+    return NULL;
+}
+
+static void FreeJson(JSONVALUE *value) {
+    JSONVALUE *next;
+
+    while (value) {
+        next = value->next;
+        FreeJson(value->child);
+        if (value->key) free(value->key);
+        if (value->string) free(value->string);
+        free(value);
+        value = next;
+    }
+}
+
+static JSONVALUE* ReadJson(const char *fileName) {
+    FILE *file = fopen(fileName, "rb");
+    JSONVALUE *json;
+    const char *text;
+    char *buffer;
+    long size;
+
+    if (!file) {
+        fprintf(stderr, "Error opening %s\n", fileName);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    buffer = malloc((size_t)size + 1);
+    size = (long)fread(buffer, 1, (size_t)size, file);
+    buffer[size] = 0;
+    fclose(file);
+
+    text = buffer;
+    json = ParseValue(&text);
+    free(buffer);
+    if (!json || json->type != JSON_OBJECT) {
+        fprintf(stderr, "Error parsing %s\n", fileName);
+        FreeJson(json);
+        return NULL;
+    }
+    return json;
+}
+
+// Member of an object (NULL if missing)
+static JSONVALUE* Member(JSONVALUE *object, const char *key) {
+    JSONVALUE *child;
+
+    if (!object || object->type != JSON_OBJECT) return NULL;
+    for (child = object->child; child; child = child->next)
+        if (child->key && strcmp(child->key, key) == 0) return child;
+    return NULL;
+}
+
+static const char* String(JSONVALUE *object, const char *key) {
+    JSONVALUE *value = Member(object, key);
+    return value && value->type == JSON_STRING ? value->string : "";
+}
+
+// Number member - returns 0 if missing
+static int Number(JSONVALUE *object, const char *key, double *number) {
+    JSONVALUE *value = Member(object, key);
+    if (!value || value->type != JSON_NUMBER) return 0;
+    *number = value->number;
+    return 1;
+}
+
+// The baseline result with the same name
+static JSONVALUE* FindResult(JSONVALUE *results, const char *name) {
+    JSONVALUE *result;
+
+    if (!results) return NULL;
+    for (result = results->child; result; result = result->next)
+        if (strcmp(String(result, "name"), name) == 0) return result;
+    return NULL;
+}
+
+// Compares a metric and prints a line. lowerIsBetter is 0 for throughput.
+// significant is 0 if a change is within the noise
+static void CompareMetric(COMPARISON *comparison, const char *name, const char *metric,
+                          double base, double current, int lowerIsBetter,
+                          double threshold, int significant) {
+    double change;
+    const char *verdict = "";
+
+    if (base == 0) change = current == 0 ? 0 : 100;
+    else change = (current - base) / base * 100.0;
+
+    if ((lowerIsBetter ? change : -change) > threshold) {
+        if (significant) {
+            verdict = "REGRESSION";
+            comparison->regressions++;
+        }
+        else verdict = "(noise)";
+    }
+    else if ((lowerIsBetter ? -change : change) > threshold && significant) {
+        verdict = "improved";
+        comparison->improvements++;
+    }
+
+    printf("%-32s %-14s %14.3f %14.3f %+9.1f%% %s\n", name, metric, base, current, change, verdict);
+}
+
+static void CompareResult(COMPARISON *comparison, JSONVALUE *base, JSONVALUE *current) {
+    const char *name = String(current, "name");
+    JSONVALUE *baseLatency = Member(base, "latency_us");
+    JSONVALUE *latency = Member(current, "latency_us");
+    double a, b, sa, sb, na, nb, se;
+    int significant;
+
+    if (Number(base, "failures", &a) && Number(current, "failures", &b) && b > a) {
+        printf("%-32s %-14s %14.0f %14.0f %10s REGRESSION\n", name, "failures", a, b, "");
+        comparison->regressions++;
+    }
+
+    if (baseLatency && latency) {
+        if (Number(baseLatency, "mean", &a) && Number(latency, "mean", &b)) {
+            // Welch's t statistic - needs the standard deviations and counts
+            significant = 1;
+            if (Number(baseLatency, "stddev", &sa) && Number(latency, "stddev", &sb) &&
+                Number(baseLatency, "count", &na) && Number(latency, "count", &nb) && na > 1 && nb > 1) {
+                se = sqrt(sa * sa / na + sb * sb / nb);
+                significant = se == 0 || fabs(b - a) / se > comparison->zScore;
+            }
+            CompareMetric(comparison, name, "mean us", a, b, 1, comparison->threshold, significant);
+        }
+        if (Number(baseLatency, "p50", &a) && Number(latency, "p50", &b))
+            CompareMetric(comparison, name, "p50 us", a, b, 1, comparison->threshold, 1);
+        if (Number(baseLatency, "p99", &a) && Number(latency, "p99", &b))
+            CompareMetric(comparison, name, "p99 us", a, b, 1, comparison->tailThreshold, 1);
+    }
+
+    if (Number(Member(base, "throughput"), "value", &a) && Number(Member(current, "throughput"), "value", &b))
+        CompareMetric(comparison, name, String(Member(current, "throughput"), "unit"), a, b, 0,
+                      comparison->threshold, 1);
+    if (Number(Member(base, "cpu"), "value", &a) && Number(Member(current, "cpu"), "value", &b))
+        CompareMetric(comparison, name, String(Member(current, "cpu"), "unit"), a, b, 1,
+                      comparison->threshold, 1);
+    if (Number(base, "rss_kb", &a) && Number(current, "rss_kb", &b))
+        CompareMetric(comparison, name, "rss KB", a, b, 1, comparison->threshold, 1);
+}
+
+int main(int argc, char **argv) {
+    COMPARISON comparison;
+    JSONVALUE *baseline, *current;
+    JSONVALUE *baseResults, *results, *result, *base;
+    const char *baseModel, *model;
+    int i;
+
+    memset(&comparison, 0, sizeof(comparison));
+    comparison.threshold = 5;
+    comparison.tailThreshold = 20;
+    comparison.zScore = 3;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) comparison.threshold = atof(argv[++i]);
+        else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) comparison.tailThreshold = atof(argv[++i]);
+        else if (strcmp(argv[i], "-z") == 0 && i + 1 < argc) comparison.zScore = atof(argv[++i]);
+        else break;
+    }
+    if (argc - i != 2) {
+        fprintf(stderr, "Usage: benchcompare [-t percent] [-T percent] [-z score] baseline.json current.json\n");
+        return 2;
+    }
+
+    baseline = ReadJson(argv[i]);
+    current = ReadJson(argv[i + 1]);
+    if (!baseline || !current) return 2;
+
+    if (strcmp(String(baseline, "schema"), String(current, "schema")) != 0 ||
+        strcmp(String(baseline, "benchmark"), String(current, "benchmark")) != 0) {
+        fprintf(stderr, "Error: %s is %s %s but %s is %s %s\n",
+                argv[i], String(baseline, "schema"), String(baseline, "benchmark"),
+                argv[i + 1], String(current, "schema"), String(current, "benchmark"));
+        return 2;
+    }
+
+    printf("%s: %s (%s) against baseline %s (%s)\n", String(current, "benchmark"),
+           argv[i + 1], String(current, "git_revision"), argv[i], String(baseline, "git_revision"));
+    baseModel = String(Member(baseline, "host"), "cpu_model");
+    model = String(Member(current, "host"), "cpu_model");
+    if (strcmp(String(Member(baseline, "host"), "name"), String(Member(current, "host"), "name")) != 0 ||
+        strcmp(baseModel, model) != 0)
+        printf("Warning: the results are from different hosts (%s / %s)\n", baseModel, model);
+    printf("%-32s %-14s %14s %14s %10s\n", "result", "metric", "baseline", "current", "change");
+
+    baseResults = Member(baseline, "results");
+    results = Member(current, "results");
+    for (result = results ? results->child : NULL; result; result = result->next) {
+        base = FindResult(baseResults, String(result, "name"));
+        if (!base) printf("%-32s not in the baseline\n", String(result, "name"));
+        else CompareResult(&comparison, base, result);
+    }
+
+    printf("%d regression(s), %d improvement(s)\n", comparison.regressions, comparison.improvements);
+    FreeJson(baseline);
+    FreeJson(current);
+    return comparison.regressions ? 1 : 0;
+}
@@ -0,0 +1,241 @@
+// *************************************************************************
+// A B O U T   T H I S   W O R K  -   S H E L L S P A W N
+// *************************************************************************
+// Work Name   : ShellSpawn
+// Description : This provides a simple interface to spawn a process
+//             : with redirected input and output
+// Copyright   : Copyright (C) 2008,2021 Adrian Sutherland
+// *************************************************************************
+// A B O U T   T H I S   F I L E
+// *************************************************************************
+// File Name   : concurrencybench.c
+// Description : Benchmark of shellspawn() called from many threads at once
+// *************************************************************************
+// L I C E N S E
+// *************************************************************************
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of version 3 of the GNU General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//
+// For the avoidance of doubt:
+// - Version 3 of the license (i.e. not earlier nor later versions) apply.
+// - a copy of the license text should be in the "license" directory of the
+//   source distribution.
+// - Requests for use under other licenses will be treated sympathetically,
+//   please see contact details.
+// *************************************************************************
+// C O N T A C T   D E T A I L S
+// *************************************************************************
+// E-mail      : adrian@sutherlandonline.org
+// *************************************************************************
+
+// Usage: concurrencybench [-n spawns per thread] [-t max threads] [-c command] [-j jsonfile]
+//  - Runs the command (with its stdout and stderr captured to strings) from
+//    1, 2, 4 ... max threads at once
+//  - Reports spawns/s, latency percentiles, CPU per spawn, and the peak
+//    thread, fd and in-flight shellspawn() counts and RSS at each level
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "shellspawn.h"
+#include "bench.h"
+
+// Work for one caller thread
+typedef struct caller {
+    pthread_t thread;
+    const char *command;
+    int spawns;
+    size_t failures;
+    BENCHSAMPLES samples;
+} CALLER;
+
+static pthread_mutex_t startMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startCond = PTHREAD_COND_INITIALIZER;
+static int started = 0;
+static volatile int sampling = 0;
+static long peakThreads = 0;
+static int peakFds = 0;
+static long peakRssKB = 0;
+
+static void* CallerThread(void *param) {
+    CALLER *caller = (CALLER*)param;
+    char *sOut = 0;
+    char *sErr = 0;
+    char *errorText = 0;
+    unsigned long long start;
+    int rc;
+    int i;
+
+    // Wait for all the threads to be ready
+    pthread_mutex_lock(&startMutex);
+    while (!started) pthread_cond_wait(&startCond, &startMutex);
+    pthread_mutex_unlock(&startMutex);
+
+    for (i = 0; i < caller->spawns; i++) {
+        start = BenchNow();
+        if (shellspawn(caller->command, NULL, NULL, NULL, NULL,
+                       NULL, &sOut, NULL, NULL,
+                       NULL, &sErr, NULL, NULL, &rc, &errorText, NULL)) {
+            caller->failures++;
+            if (errorText) free(errorText);
+            errorText = 0;
+            continue;
+        }
+        BenchAddSample(&caller->samples, BenchNow() - start);
+        if (sOut) free(sOut);
+        if (sErr) free(sErr);
+        sOut = 0;
+        sErr = 0;
+    }
+    return NULL;
+}
+
+// Samples the thread and fd counts and RSS while a level runs
+static void* SamplerThread(void *param) {
+    long threads;
+    long rss;
+    int fds;
+
+    while (sampling) {
+        threads = BenchThreadCount();
+        fds = BenchFdCount();
+        rss = BenchRssKB();
+        if (threads > peakThreads) peakThreads = threads;
+        if (fds > peakFds) peakFds = fds;
+        if (rss > peakRssKB) peakRssKB = rss;
+        usleep(1000);
+    }
+    return NULL;
+}
+
+static void Run(BENCHRECORD *record, const char *command, int threads, int spawns) {
+    CALLER *callers = calloc((size_t)threads, sizeof(CALLER));
+    BENCHSAMPLES samples = {0, 0, 0};
+    SHELLSPAWN_STATS *stats = calloc(1, sizeof(SHELLSPAWN_STATS));
+    pthread_t sampler;
+    unsigned long long start, elapsed;
+    char name[32];
+    double cpu;
+    size_t s;
+    int i;
+
+    snprintf(name, sizeof(name), "threads=%d", threads);
+    BenchRecordInit(record, name);
+    BenchJsonAdd(record->params, sizeof(record->params), "threads", "%d", threads);
+    peakThreads = 0;
+    peakFds = 0;
+    peakRssKB = 0;
+    started = 0;
+    shellspawn_resetstats();
+
+    sampling = 1;
+    pthread_create(&sampler, NULL, SamplerThread, NULL);
+
+    for (i = 0; i < threads; i++) {
+        callers[i].command = command;
+        callers[i].spawns = spawns;
+        if (pthread_create(&callers[i].thread, NULL, CallerThread, &callers[i])) {
+            fprintf(stderr, "Error creating caller thread %d\n", i);
+            exit(1);
+        }
+    }
+
+    // Start them all at once
+    cpu = BenchCpuSeconds(RUSAGE_SELF);
+    pthread_mutex_lock(&startMutex);
+    start = BenchNow();
+    started = 1;
+    pthread_cond_broadcast(&startCond);
+    pthread_mutex_unlock(&startMutex);
+
+    for (i = 0; i < threads; i++) pthread_join(callers[i].thread, NULL);
+    elapsed = BenchNow() - start;
+    cpu = BenchCpuSeconds(RUSAGE_SELF) - cpu;
+
+    sampling = 0;
+    pthread_join(sampler, NULL);
+
+    for (i = 0; i < threads; i++) {
+        for (s = 0; s < callers[i].samples.count; s++)
+            BenchAddSample(&samples, callers[i].samples.values[s]);
+        record->failures += callers[i].failures;
+        BenchFreeSamples(&callers[i].samples);
+    }
+    free(callers);
+
+    shellspawn_totalstats(stats);
+    record->runs = samples.count;
+    BenchSummarise(&samples, &record->latency);
+    BenchFreeSamples(&samples);
+    record->throughput = elapsed ? (double)record->runs / ((double)elapsed / 1e9) : 0;
+    record->throughputUnit = "spawns/s";
+    record->cpu = record->runs ? cpu * 1e6 / (double)record->runs : 0;
+    record->cpuUnit = "us/spawn";
+    record->rssKB = peakRssKB;
+    BenchJsonAdd(record->metrics, sizeof(record->metrics), "peak_threads", "%ld", peakThreads);
+    BenchJsonAdd(record->metrics, sizeof(record->metrics), "peak_fds", "%d", peakFds);
+    BenchJsonAdd(record->metrics, sizeof(record->metrics), "peak_in_flight", "%llu", stats->peakInFlight);
+
+    printf("%7d %6lu %5lu %9.1f %9.1f %9.1f %9.1f %9.1f %10.1f %8ld %6d %9llu\n",
+           threads, (unsigned long)record->runs, (unsigned long)record->failures,
+           record->throughput, record->latency.mean / 1000.0, record->latency.p50 / 1000.0,
+           record->latency.p99 / 1000.0, record->latency.p999 / 1000.0, record->latency.max / 1000.0,
+           peakThreads, peakFds, stats->peakInFlight);
+    fflush(stdout);
+    free(stats);
+}
+
+int main(int argc, char **argv) {
+    const char *command = "/bin/true";
+    const char *jsonFile = "concurrencybench.json";
+    char params[512] = "";
+    BENCHRECORD record;
+    BENCHJSON json;
+    int spawns = 20;
+    int maxThreads = 256;
+    int threads;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) spawns = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) maxThreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) command = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) jsonFile = argv[++i];
+        else {
+            fprintf(stderr, "Usage: concurrencybench [-n spawns per thread] [-t max threads] "
+                            "[-c command] [-j jsonfile]\n");
+            return 1;
+        }
+    }
+    if (spawns < 1) spawns = 1;
+
+    BenchJsonAdd(params, sizeof(params), "command", "%s", command);
+    BenchJsonAdd(params, sizeof(params), "spawns_per_thread", "%d", spawns);
+    BenchJsonOpen(&json, jsonFile, "concurrencybench", params);
+
+    printf("Concurrency scaling of \"%s\", %d spawns per thread (latencies in us)\n", command, spawns);
+    printf("%7s %6s %5s %9s %9s %9s %9s %9s %10s %8s %6s %9s\n",
+           "threads", "runs", "fail", "spawns/s", "mean", "p50", "p99", "p999", "max",
+           "threads", "fds", "inflight");
+
+    for (threads = 1; threads <= maxThreads; threads *= 2) {
+        Run(&record, command, threads, spawns);
+        BenchJsonResult(&json, &record);
+    }
+
+    BenchJsonClose(&json, jsonFile);
+    return 0;
+}
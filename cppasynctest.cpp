@@ -0,0 +1,163 @@
+// *************************************************************************
+// A B O U T   T H I S   W O R K  -   S H E L L S P A W N
+// *************************************************************************
+// Work Name   : ShellSpawn
+// Description : This provides a simple interface to spawn a process
+//             : with redirected input and output
+// Copyright   : Copyright (C) 2008,2021 Adrian Sutherland
+// *************************************************************************
+// A B O U T   T H I S   F I L E
+// *************************************************************************
+// File Name   : cppasynctest.cpp
+// Description : Test harness for the C++20 coroutine interface
+//             : (shellspawnasync.hpp)
+// *************************************************************************
+// L I C E N S E
+// *************************************************************************
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of version 3 of the GNU General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//
+// For the avoidance of doubt:
+// - Version 3 of the license (i.e. not earlier nor later versions) apply.
+// - a copy of the license text should be in the "license" directory of the
+//   source distribution.
+// - Requests for use under other licenses will be treated sympathetically,
+//   please see contact details.
+// *************************************************************************
+// C O N T A C T   D E T A I L S
+// *************************************************************************
+// E-mail      : adrian@sutherlandonline.org
+// *************************************************************************
+
+// Run from the build directory (it uses testclient)
+// Usage: cppasynctest [concurrent children (default 1000)]
+//  - Each child has 3 or 4 fds open, so the soft open file limit is raised to
+//    the hard limit
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "shellspawnasync.hpp"
+
+// Threads in this process (Linux only - 0 if unknown)
+static int Threads() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+        if (line.compare(0, 8, "Threads:") == 0) return std::atoi(line.c_str() + 8);
+    return 0;
+}
+
+static void PrintError(const shell::Error &error) {
+    std::cout << "Error Spawning Process. SpawnRC=" << static_cast<int>(error.code())
+              << ". Error Text=" << error.what() << "\n";
+}
+
+static shell::Task<> StringTest(shell::EventLoop &loop) {
+    shell::Process client("testclient");
+    client.input("Jones Simon\n");
+    shell::Result result = co_await shell::run(loop, client);
+    std::cout << "RC=" << result.rc() << "\n";
+    for (std::string_view line : result.outLines()) std::cout << "Stdout: " << line << "\n";
+    for (std::string_view line : result.errLines()) std::cout << "Stderr: " << line << "\n";
+}
+
+// 1000 lines of stdout read one at a time, while 2000 lines of stderr (more
+// than a pipe holds) are captured
+static shell::Task<> LineTest(shell::EventLoop &loop) {
+    shell::Process load("testclient --load -o 1000L -e 2000L");
+    shell::Child child(loop, load);
+    std::size_t lines = 0, bytes = 0;
+
+    while (std::optional<std::string_view> line = co_await child.nextLine()) {
+        lines++;
+        bytes += line->size() + 1;
+    }
+    shell::Result result = co_await child.wait();
+    std::cout << "RC=" << result.rc() << " stdout lines=" << lines << " bytes=" << bytes
+              << " stderr bytes=" << result.err().size() << " stdout left=" << result.out().size() << "\n";
+}
+
+// 1MB written to stdin while it is echoed back
+static shell::Task<> EchoTest(shell::EventLoop &loop) {
+    shell::Process echo("testclient --load -i echo");
+    echo.input(std::string(1024 * 1024, 'x'));
+    shell::Result result = co_await shell::run(loop, echo);
+    std::cout << "RC=" << result.rc() << " echoed bytes=" << result.out().size() << "\n";
+}
+
+static shell::Task<> ConcurrentChild(shell::EventLoop &loop, const shell::Process &client, int &ok) {
+    shell::Result result = co_await shell::run(loop, client);
+    if (result.rc() == 123 && result.outLines().toVector().size() == 5) ok++;
+}
+
+static shell::Task<> ErrorTest(shell::EventLoop &loop, const char *command, unsigned long timeoutMs) {
+    try {
+        shell::Process process(command);
+        if (timeoutMs) process.timeout(std::chrono::milliseconds(timeoutMs));
+        co_await shell::run(loop, process);
+        std::cout << "No error!\n";
+    } catch (const shell::Error &error) {
+        PrintError(error);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int children = argc > 1 ? std::atoi(argv[1]) : 1000;
+    shell::EventLoop loop;
+    rlimit files;
+
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    std::cout << "Test Harness for shellspawnasync.hpp\n";
+
+    std::cout << "\nString Test\n";
+    loop.run(StringTest(loop));
+
+    std::cout << "\n\nLine Test\n";
+    loop.run(LineTest(loop));
+
+    std::cout << "\n\nEcho Test\n";
+    loop.run(EchoTest(loop));
+
+    std::cout << "\n\nConcurrency Test - " << children << " children on one thread\n";
+    {
+        shell::Process client("testclient hello");
+        int ok = 0;
+        int peakThreads;
+        auto start = std::chrono::steady_clock::now();
+
+        for (int i = 0; i < children; i++) loop.spawn(ConcurrentChild(loop, client, ok));
+        peakThreads = Threads();
+        loop.run();
+        std::cout << "Succeeded=" << ok << " of " << children << " threads=" << peakThreads << " in "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()
+                  << "ms\n";
+    }
+
+    std::cout << "\n\nCommand does not exist test - should give an error message\n";
+    loop.run(ErrorTest(loop, "does_not_exist", 0));
+
+    std::cout << "\n\nTimeout Test - should give an error message\n";
+    loop.run(ErrorTest(loop, "testclient --load -s 5000", 200));
+
+    return 0;
+}
@@ -0,0 +1,179 @@
+// *************************************************************************
+// A B O U T   T H I S   W O R K  -   S H E L L S P A W N
+// *************************************************************************
+// Work Name   : ShellSpawn
+// Description : This provides a simple interface to spawn a process
+//             : with redirected input and output
+// Copyright   : Copyright (C) 2008,2021 Adrian Sutherland
+// *************************************************************************
+// A B O U T   T H I S   F I L E
+// *************************************************************************
+// File Name   : cppshelltest.cpp
+// Description : Test harness for the C++ wrapper (shellspawn.hpp and
+//             : shellspawnsinks.hpp)
+// *************************************************************************
+// L I C E N S E
+// *************************************************************************
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of version 3 of the GNU General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//
+// For the avoidance of doubt:
+// - Version 3 of the license (i.e. not earlier nor later versions) apply.
+// - a copy of the license text should be in the "license" directory of the
+//   source distribution.
+// - Requests for use under other licenses will be treated sympathetically,
+//   please see contact details.
+// *************************************************************************
+// C O N T A C T   D E T A I L S
+// *************************************************************************
+// E-mail      : adrian@sutherlandonline.org
+// *************************************************************************
+
+// Run from the build directory (it uses testclient)
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "shellspawn.hpp"
+#include "shellspawnsinks.hpp"
+
+// The handles own resources so must not be copyable
+static_assert(!std::is_copy_constructible<shell::Process>::value, "Process must be move-only");
+static_assert(!std::is_copy_constructible<shell::Result>::value, "Result must be move-only");
+static_assert(std::is_nothrow_move_constructible<shell::Result>::value, "Result must move");
+
+static void PrintLines(const char *stream, shell::Lines lines) {
+    int n = 0;
+    for (std::string_view line : lines) std::cout << stream << " line " << ++n << ": " << line << "\n";
+    if (!n) std::cout << "No " << stream << "\n";
+}
+
+static void PrintError(const shell::Error &error) {
+    std::cout << "Error Spawning Process. SpawnRC=" << static_cast<int>(error.code())
+              << ". Error Text=" << error.what() << "\n";
+}
+
+int main() {
+    std::cout << "Test Harness for shellspawn.hpp\n";
+
+    try {
+        std::cout << "\nString Test\n";
+        shell::Process client("testclient");
+        shell::Result result = client.input("Jones Simon\n").run();
+        std::cout << "RC=" << result.rc() << "\n";
+        PrintLines("Stdout", result.outLines());
+        PrintLines("Stderr", result.errLines());
+    } catch (const shell::Error &error) {
+        PrintError(error);
+    }
+
+    try {
+        std::cout << "\n\nMove Test (the process and result are moved, the output is not copied)\n";
+        shell::Process client("testclient hello");
+        shell::Process moved(std::move(client));
+        shell::Result first = moved.discardError().run();
+        const char *buffer = first.out().data();
+        shell::Result second(std::move(first));
+        std::cout << "RC=" << second.rc() << " buffer moved: " << (second.out().data() == buffer ? "yes" : "no")
+                  << " source empty: " << (first.out().empty() ? "yes" : "no") << "\n";
+        shell::CString released = second.releaseOut();
+        std::cout << "Released Stdout: " << released.get();
+    } catch (const shell::Error &error) {
+        PrintError(error);
+    }
+
+    try {
+        std::cout << "\n\nBinary Test (stdout holds nulls, which are kept)\n";
+        shell::Process binary("testclient --load -b -o 1000");
+        shell::Result result = binary.run();
+        std::cout << "RC=" << result.rc() << " Stdout bytes=" << result.out().size()
+                  << " nulls=" << (result.out().find('\0') != std::string_view::npos ? "yes" : "no") << "\n";
+    } catch (const shell::Error &error) {
+        PrintError(error);
+    }
+
+    try {
+        std::cout << "\n\nReuse Test (one Process run 3 times)\n";
+        shell::Process client("testclient");
+        client.input("Bob Smith\n");
+        for (int i = 0; i < 3; i++) {
+            shell::Result result = client.run();
+            std::cout << "Run " << i + 1 << " RC=" << result.rc() << " lines=" << result.outLines().toVector().size() << "\n";
+        }
+    } catch (const shell::Error &error) {
+        PrintError(error);
+    }
+
+    try {
+        std::cout << "\n\nEnvironment and Directory Test\n";
+        shell::Process env("env");
+        PrintLines("Stdout", env.environment({"SHELLSPAWN_TEST=cpp"}).run().outLines());
+        shell::Process pwd("pwd");
+        std::cout << "Stdout: " << pwd.directory("/").run().out();
+    } catch (const shell::Error &error) {
+        PrintError(error);
+    }
+
+    try {
+        std::cout << "\n\nSink Test (lines of stdout, the tail of stderr)\n";
+        shell::Process client("testclient");
+        client.input("Jones Simon\n");
+        int n = 0;
+        shell::LineSink lines([&n](std::string_view line) { std::cout << "Stdout line " << ++n << ": " << line << "\n"; });
+        shell::RingSink<16> tail;
+        int rc = shell::run(client, lines, tail);
+        std::cout << "RC=" << rc << " Stderr tail: " << tail.str();
+
+        shell::Process load("testclient --load -o 1000L -e 2000L");
+        shell::StringSink out;
+        shell::DiscardSink discard;
+        rc = shell::run(load, out, discard);
+        std::cout << "RC=" << rc << " Stdout bytes=" << out.str().size() << "\n";
+    } catch (const shell::Error &error) {
+        PrintError(error);
+    }
+
+    try {
+        std::cout << "\n\nSink Timeout Test - should give an error message\n";
+        shell::Process sleeper("testclient --load -s 5000");
+        shell::DiscardSink discard;
+        shell::run(sleeper.timeout(std::chrono::milliseconds(200)), discard);
+        std::cout << "No error!\n";
+    } catch (const shell::Error &error) {
+        PrintError(error);
+    }
+
+    try {
+        std::cout << "\n\nCommand does not exist test - should give an error message\n";
+        shell::run("does_not_exist");
+        std::cout << "No error!\n";
+    } catch (const shell::Error &error) {
+        PrintError(error);
+        std::cout << "Not Found: " << (error.code() == shell::Errc::NotFound ? "yes" : "no") << "\n";
+    }
+
+    try {
+        std::cout << "\n\nTimeout Test - should give an error message\n";
+        shell::Process sleeper("testclient --load -s 5000");
+        sleeper.timeout(std::chrono::milliseconds(200)).run();
+        std::cout << "No error!\n";
+    } catch (const shell::Error &error) {
+        PrintError(error);
+        std::cout << "Timeout: " << (error.code() == shell::Errc::Timeout ? "yes" : "no") << "\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,254 @@
+// *************************************************************************
+// A B O U T   T H I S   W O R K  -   S H E L L S P A W N
+// *************************************************************************
+// Work Name   : ShellSpawn
+// Description : This provides a simple interface to spawn a process
+//             : with redirected input and output
+// Copyright   : Copyright (C) 2008,2021 Adrian Sutherland
+// *************************************************************************
+// A B O U T   T H I S   F I L E
+// *************************************************************************
+// File Name   : forkbench.c
+// Description : Benchmark of spawn latency against the size of the caller
+// *************************************************************************
+// L I C E N S E
+// *************************************************************************
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of version 3 of the GNU General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//
+// For the avoidance of doubt:
+// - Version 3 of the license (i.e. not earlier nor later versions) apply.
+// - a copy of the license text should be in the "license" directory of the
+//   source distribution.
+// - Requests for use under other licenses will be treated sympathetically,
+//   please see contact details.
+// *************************************************************************
+// C O N T A C T   D E T A I L S
+// *************************************************************************
+// E-mail      : adrian@sutherlandonline.org
+// *************************************************************************
+
+// Usage: forkbench [-s sizes] [-n iterations] [-c command] [-H] [-j jsonfile]
+//  - sizes is a comma separated list of heap sizes with an optional K, M or
+//    G suffix (default 0,100M,1G). Each size is allocated and every page
+//    touched before the spawns are timed, so that it is all resident - make
+//    sure the machine has the memory
+//  - -H asks for transparent huge pages (madvise(MADV_HUGEPAGE)) for the heap
+//  - At each size the command is run with each launch strategy:
+//    shellspawn() with no redirection (one fork()), shellspawn() with an
+//    INHANDLER (which forks a proxy process that forks the child) and a
+//    posix_spawn() baseline
+//  - Reports latency percentiles and the minor page faults per spawn in the
+//    caller and in the children
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "shellspawn.h"
+#include "bench.h"
+
+extern char **environ;
+
+// Launch strategies
+#define STRATEGY_SHELLSPAWN  0
+#define STRATEGY_PROXY       1
+#define STRATEGY_POSIX_SPAWN 2
+#define STRATEGIES           3
+static const char *strategyNames[STRATEGIES] = {"shellspawn", "shellspawn-fIn", "posix_spawn"};
+
+// Parses a size with an optional K, M or G suffix
+static unsigned long long ParseSize(const char *text, char **end) {
+    unsigned long long size = strtoull(text, end, 10);
+    switch (**end) {
+        case 'k': case 'K': (*end)++; return size * 1024ULL;
+        case 'm': case 'M': (*end)++; return size * 1024ULL * 1024ULL;
+        case 'g': case 'G': (*end)++; return size * 1024ULL * 1024ULL * 1024ULL;
+        default: return size;
+    }
+}
+
+// Closes stdin straight away
+static int InHandler(char **data, void *context) {
+    return 1;
+}
+
+static int SpawnOnce(const char *command, int strategy) {
+    char *errorText = 0;
+    char *argv[2];
+    pid_t pid;
+    int status;
+    int rc = 0;
+    int result;
+
+    switch (strategy) {
+        case STRATEGY_POSIX_SPAWN:
+            argv[0] = (char*)command;
+            argv[1] = 0;
+            if (posix_spawn(&pid, command, NULL, NULL, argv, environ)) return -1;
+            if (waitpid(pid, &status, 0) == -1) return -1;
+            return 0;
+
+        case STRATEGY_PROXY:
+            result = shellspawn(command, NULL, NULL, InHandler, NULL,
+                                NULL, NULL, NULL, NULL,
+                                NULL, NULL, NULL, NULL, &rc, &errorText, NULL);
+            break;
+
+        default:
+            result = shellspawn(command, NULL, NULL, NULL, NULL,
+                                NULL, NULL, NULL, NULL,
+                                NULL, NULL, NULL, NULL, &rc, &errorText, NULL);
+    }
+
+    if (result) {
+        fprintf(stderr, "shellspawn(%s) failed. SpawnRC=%d. Error Text=%s\n",
+                command, result, errorText ? errorText : "");
+        if (errorText) free(errorText);
+    }
+    return result;
+}
+
+static void Run(BENCHRECORD *record, const char *command, int strategy,
+                unsigned long long size, int iterations) {
+    BENCHSAMPLES samples = {0, 0, 0};
+    struct rusage selfBefore, selfAfter, childBefore, childAfter;
+    unsigned long long start;
+    double parentFaults, childFaults;
+    char name[64];
+    int i;
+
+    snprintf(name, sizeof(name), "%s %llu", strategyNames[strategy], size);
+    BenchRecordInit(record, name);
+    BenchJsonAdd(record->params, sizeof(record->params), "strategy", "%s", strategyNames[strategy]);
+    BenchJsonAdd(record->params, sizeof(record->params), "heap_bytes", "%llu", size);
+
+    // Warm up
+    for (i = 0; i < 3; i++) SpawnOnce(command, strategy);
+
+    getrusage(RUSAGE_SELF, &selfBefore);
+    getrusage(RUSAGE_CHILDREN, &childBefore);
+    for (i = 0; i < iterations; i++) {
+        start = BenchNow();
+        if (SpawnOnce(command, strategy)) record->failures++;
+        else BenchAddSample(&samples, BenchNow() - start);
+    }
+    getrusage(RUSAGE_SELF, &selfAfter);
+    getrusage(RUSAGE_CHILDREN, &childAfter);
+
+    parentFaults = (double)(selfAfter.ru_minflt - selfBefore.ru_minflt) / (double)iterations;
+    childFaults = (double)(childAfter.ru_minflt - childBefore.ru_minflt) / (double)iterations;
+
+    record->runs = samples.count;
+    BenchSummarise(&samples, &record->latency);
+    BenchFreeSamples(&samples);
+    record->cpu = ((double)(selfAfter.ru_utime.tv_sec - selfBefore.ru_utime.tv_sec) +
+                   (double)(selfAfter.ru_utime.tv_usec - selfBefore.ru_utime.tv_usec) / 1e6 +
+                   (double)(selfAfter.ru_stime.tv_sec - selfBefore.ru_stime.tv_sec) +
+                   (double)(selfAfter.ru_stime.tv_usec - selfBefore.ru_stime.tv_usec) / 1e6)
+                  * 1e6 / (double)iterations;
+    record->cpuUnit = "us/spawn";
+    record->rssKB = BenchRssKB();
+    BenchJsonAdd(record->metrics, sizeof(record->metrics), "parent_minflt_per_spawn", "%.2f", parentFaults);
+    BenchJsonAdd(record->metrics, sizeof(record->metrics), "child_minflt_per_spawn", "%.2f", childFaults);
+    BenchJsonAdd(record->metrics, sizeof(record->metrics), "parent_majflt", "%ld",
+                 selfAfter.ru_majflt - selfBefore.ru_majflt);
+
+    printf("%10.0f %-15s %6lu %5lu %9.1f %9.1f %9.1f %9.1f %9.1f %10.1f %10.1f\n",
+           (double)size / 1048576.0, strategyNames[strategy],
+           (unsigned long)record->runs, (unsigned long)record->failures,
+           record->latency.mean / 1000.0, record->latency.p50 / 1000.0, record->latency.p99 / 1000.0,
+           record->latency.max / 1000.0, record->cpu, parentFaults, childFaults);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    const char *sizes = "0,100M,1G";
+    const char *command = "/bin/true";
+    const char *jsonFile = "forkbench.json";
+    const char *next;
+    char *end;
+    char params[512] = "";
+    BENCHRECORD record;
+    BENCHJSON json;
+    unsigned long long size;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t offset;
+    char *heap;
+    int iterations = 50;
+    int hugePages = 0;
+    int strategy;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) sizes = argv[++i];
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) iterations = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) command = argv[++i];
+        else if (strcmp(argv[i], "-H") == 0) hugePages = 1;
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) jsonFile = argv[++i];
+        else {
+            fprintf(stderr, "Usage: forkbench [-s sizes] [-n iterations] [-c command] [-H] [-j jsonfile]\n");
+            return 1;
+        }
+    }
+    if (iterations < 1) iterations = 1;
+
+    BenchJsonAdd(params, sizeof(params), "command", "%s", command);
+    BenchJsonAdd(params, sizeof(params), "iterations", "%d", iterations);
+    BenchJsonAdd(params, sizeof(params), "sizes", "%s", sizes);
+    BenchJsonAdd(params, sizeof(params), "huge_pages", "%d", hugePages);
+    BenchJsonOpen(&json, jsonFile, "forkbench", params);
+
+    printf("Spawn latency (us) of \"%s\" against caller heap size, %d iterations%s\n",
+           command, iterations, hugePages ? ", huge pages" : "");
+    printf("%10s %-15s %6s %5s %9s %9s %9s %9s %9s %10s %10s\n",
+           "heap MB", "strategy", "runs", "fail", "mean", "p50", "p99", "max", "CPU us",
+           "faults", "child flt");
+
+    for (next = sizes; *next; next = *end ? end + 1 : end) {
+        size = ParseSize(next, &end);
+        if (*end && *end != ',') {
+            fprintf(stderr, "Invalid size list %s\n", sizes);
+            return 1;
+        }
+
+        // Inflate the heap - every page written so that it is resident
+        heap = NULL;
+        if (size) {
+            heap = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (heap == MAP_FAILED) {
+                fprintf(stderr, "Error allocating %llu bytes\n", size);
+                break;
+            }
+#ifdef MADV_HUGEPAGE
+            if (hugePages && madvise(heap, (size_t)size, MADV_HUGEPAGE))
+                perror("madvise(MADV_HUGEPAGE) failed");
+#endif
+            for (offset = 0; offset < (size_t)size; offset += (size_t)pageSize) heap[offset] = 1;
+        }
+
+        for (strategy = 0; strategy < STRATEGIES; strategy++) {
+            Run(&record, command, strategy, size, iterations);
+            BenchJsonResult(&json, &record);
+        }
+
+        if (heap) munmap(heap, (size_t)size);
+    }
+
+    BenchJsonClose(&json, jsonFile);
+    return 0;
+}
@@ -0,0 +1,185 @@
+// *************************************************************************
+// A B O U T   T H I S   W O R K  -   S H E L L S P A W N
+// *************************************************************************
+// Work Name   : ShellSpawn
+// Description : This provides a simple interface to spawn a process
+//             : with redirected input and output
+// Copyright   : Copyright (C) 2008,2021 Adrian Sutherland
+// *************************************************************************
+// A B O U T   T H I S   F I L E
+// *************************************************************************
+// File Name   : interactivebench.c
+// Description : Round trip latency benchmark of the interactive (INHANDLER)
+//             : input mode
+// *************************************************************************
+// L I C E N S E
+// *************************************************************************
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of version 3 of the GNU General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//
+// For the avoidance of doubt:
+// - Version 3 of the license (i.e. not earlier nor later versions) apply.
+// - a copy of the license text should be in the "license" directory of the
+//   source distribution.
+// - Requests for use under other licenses will be treated sympathetically,
+//   please see contact details.
+// *************************************************************************
+// C O N T A C T   D E T A I L S
+// *************************************************************************
+// E-mail      : adrian@sutherlandonline.org
+// *************************************************************************
+
+// Usage: interactivebench [-n exchanges] [-t testclient] [-j jsonfile]
+//  - Drives testclient's name prompt through n exchanges (answering "repeat"
+//    so that it prompts again) with an INHANDLER callback
+//  - An exchange is timed from the callback returning an answer until the
+//    callback is asked for the next one (i.e. the child has read the answer,
+//    replied and is waiting for input again)
+//  - The same answers sent in one go as a string are timed as a baseline
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shellspawn.h"
+#include "bench.h"
+
+// State of the dialogue with the child
+typedef struct dialogue {
+    int exchanges;         // Number of exchanges wanted
+    int answered;          // Number answered so far
+    unsigned long long lastAnswer; // When the last answer was given (ns)
+    BENCHSAMPLES samples;
+} DIALOGUE;
+
+static int InHandler(char **data, void *context) {
+    DIALOGUE *dialogue = (DIALOGUE*)context;
+    unsigned long long now = BenchNow();
+    const char *answer;
+
+    if (dialogue->lastAnswer) BenchAddSample(&dialogue->samples, now - dialogue->lastAnswer);
+    if (dialogue->answered > dialogue->exchanges) return 1; // Close stdin
+
+    answer = dialogue->answered++ < dialogue->exchanges ? "repeat\n" : "Bench\n";
+    *data = malloc(strlen(answer) + 1);
+    strcpy(*data, answer);
+    dialogue->lastAnswer = BenchNow();
+    return 0;
+}
+
+static void OutHandler(char *data, void *context) {
+}
+
+int main(int argc, char **argv) {
+    const char *testclient = "./testclient";
+    const char *jsonFile = "interactivebench.json";
+    DIALOGUE dialogue;
+    SHELLSPAWN_STATS *stats = calloc(1, sizeof(SHELLSPAWN_STATS));
+    char *sIn;
+    char *sOut = 0;
+    char *errorText = 0;
+    unsigned long long start, interactiveTime, batchTime;
+    double interactiveRate, batchRate;
+    double cpu;
+    char params[256] = "";
+    BENCHRECORD record;
+    BENCHJSON json;
+    int exchanges = 1000;
+    int rc = 0;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) exchanges = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) testclient = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) jsonFile = argv[++i];
+        else {
+            fprintf(stderr, "Usage: interactivebench [-n exchanges] [-t testclient] [-j jsonfile]\n");
+            return 1;
+        }
+    }
+    if (exchanges < 1) exchanges = 1;
+
+    // Interactive
+    memset(&dialogue, 0, sizeof(dialogue));
+    dialogue.exchanges = exchanges;
+    shellspawn_setstats(stats);
+    cpu = BenchCpuSeconds(RUSAGE_SELF);
+    start = BenchNow();
+    if (shellspawn(testclient, NULL, NULL, InHandler, NULL,
+                   NULL, NULL, OutHandler, NULL,
+                   NULL, NULL, OutHandler, NULL, &rc, &errorText, &dialogue)) {
+        fprintf(stderr, "Error Spawning Process. Error Text=%s\n", errorText);
+        return 1;
+    }
+    interactiveTime = BenchNow() - start;
+    cpu = BenchCpuSeconds(RUSAGE_SELF) - cpu;
+    shellspawn_setstats(NULL);
+
+    // Baseline - all the answers in one string
+    sIn = malloc((size_t)exchanges * 7 + 7);
+    sIn[0] = 0;
+    for (i = 0; i < exchanges; i++) strcat(sIn + i * 7, "repeat\n");
+    strcat(sIn + exchanges * 7, "Bench\n");
+    start = BenchNow();
+    if (shellspawn(testclient, NULL, sIn, NULL, NULL,
+                   NULL, &sOut, NULL, NULL,
+                   NULL, NULL, NULL, NULL, &rc, &errorText, NULL)) {
+        fprintf(stderr, "Error Spawning Process. Error Text=%s\n", errorText);
+        return 1;
+    }
+    batchTime = BenchNow() - start;
+    free(sIn);
+    if (sOut) free(sOut);
+
+    BenchJsonAdd(params, sizeof(params), "testclient", "%s", testclient);
+    BenchJsonAdd(params, sizeof(params), "exchanges", "%d", exchanges);
+    BenchJsonOpen(&json, jsonFile, "interactivebench", params);
+
+    BenchRecordInit(&record, "interactive");
+    BenchJsonAdd(record.params, sizeof(record.params), "mode", "%s", "interactive");
+    record.runs = dialogue.samples.count;
+    BenchSummarise(&dialogue.samples, &record.latency);
+    interactiveRate = (double)dialogue.samples.count / ((double)interactiveTime / 1e9);
+    record.throughput = interactiveRate;
+    record.throughputUnit = "exchanges/s";
+    record.cpu = dialogue.samples.count ? cpu * 1e6 / (double)dialogue.samples.count : 0;
+    record.cpuUnit = "us/exchange";
+    record.rssKB = BenchMaxRssKB();
+    BenchJsonAdd(record.metrics, sizeof(record.metrics), "dispatch_p50_us", "%.3f",
+                 shellspawn_percentile(&stats->inCallback.dispatch, 50) / 1000.0);
+
+    printf("Interactive round trips with %s (latencies in us)\n", testclient);
+    printf("%-12s %9s %12s %9s %9s %9s %9s %9s %12s\n",
+           "mode", "exchanges", "exchanges/s", "mean", "p50", "p99", "p999", "max", "dispatch p50");
+    printf("%-12s %9lu %12.1f %9.1f %9.1f %9.1f %9.1f %9.1f %12.1f\n",
+           "interactive", (unsigned long)record.runs, interactiveRate,
+           record.latency.mean / 1000.0, record.latency.p50 / 1000.0, record.latency.p99 / 1000.0,
+           record.latency.p999 / 1000.0, record.latency.max / 1000.0,
+           shellspawn_percentile(&stats->inCallback.dispatch, 50) / 1000.0);
+    BenchJsonResult(&json, &record);
+
+    BenchRecordInit(&record, "batch");
+    BenchJsonAdd(record.params, sizeof(record.params), "mode", "%s", "batch");
+    batchRate = (double)exchanges / ((double)batchTime / 1e9);
+    record.runs = 1;
+    record.throughput = batchRate;
+    record.throughputUnit = "exchanges/s";
+    printf("%-12s %9d %12.1f\n", "batch", exchanges, batchRate);
+    BenchJsonResult(&json, &record);
+
+    BenchJsonClose(&json, jsonFile);
+
+    BenchFreeSamples(&dialogue.samples);
+    free(stats);
+    return 0;
+}
@@ -41,20 +41,123 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <termios.h>
 #ifdef __APPLE__
 #include <signal.h>
 #endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "shellspawn.h"
 
+// Atomic access to the counters shared between the worker threads and
+// shellspawn_progress()
+#define ATOMIC_ADD(p, n) __atomic_add_fetch((p), (n), __ATOMIC_RELAXED)
+#define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+// Stream indexes (same as the child's fd numbers)
+#define STREAM_IN  0
+#define STREAM_OUT 1
+#define STREAM_ERR 2
+
+// Live I/O counters of an in-flight shellspawn() call. These are updated by the
+// worker threads and read by shellspawn_progress() from any thread
+typedef struct spawnmonitor {
+    struct spawnmonitor *next;
+    struct spawnmonitor *prev;
+    void* context;
+    int pid;
+    int state;                         // SHELLSPAWN_STATE_xxx
+    unsigned long long bytes[3];       // Indexed by STREAM_xxx
+    unsigned long long lines[3];
+    unsigned long long startTime;      // ns (monotonic clock)
+    unsigned long long lastOutputTime; // ns - 0 if no output yet
+    SHELLSPAWN_STATS stats;            // Telemetry for the call
+    // Pipe probing state - each only used by the stream's reader thread
+    unsigned long long lastReadTime[3];
+    unsigned long long blockedTime[3]; // Blocked time of the current episode
+    int pipeSize[3];
+    size_t readSize;                   // A full read (attr.readBufferSize - 0 for
+                                       // the size asked for by each read)
+    unsigned long long callbackCpuTime; // CPU used by callbacks (ns)
+} SPAWNMONITOR;
+
+// List of the in-flight shellspawn() calls
+static SPAWNMONITOR *monitors = NULL;
+static int inFlight = 0;
+static pthread_mutex_t monitorsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Telemetry - the thread's collector and the process wide totals
+static __thread SHELLSPAWN_STATS *threadStats = NULL;
+static SHELLSPAWN_STATS totalStats;
+static pthread_mutex_t totalStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// A pipe is taken as full if it holds more than its size less this slack (as
+// small writes do not always pack the pipe's pages completely)
+#define PIPE_FULL_SLACK 4096
+
+// tcsetpgrp() failed because the input pseudo terminal has been closed (and
+// so hung up) by the main process
+#define TERMINAL_CLOSED (errno == EIO || errno == ENOTTY)
+
+// Resources kept between the spawns made through a SHELLSPAWN_CONTEXT. The
+// buffers only grow
+struct shellspawn_context {
+    int syncReady;                          // Synchronisation objects initialised
+    pthread_mutex_t criticalsection;
+    pthread_cond_t callbackRequested;
+    pthread_cond_t callbackHandled;
+    pthread_mutex_t callbackRequestedMutex;
+    pthread_mutex_t callbackHandledMutex;
+    pthread_mutex_t exitedMutex;
+    pthread_cond_t exitedCondition;
+    char* buffer;                           // Parsed command line
+    size_t bufferSize;
+    char** argv;
+    size_t argvSize;                        // Bytes
+    char* file_path;
+    size_t filePathSize;
+    char* readBuffer[3];                    // Indexed by STREAM_xxx
+    size_t readBufferSize[3];
+    char* lineBuffer[3];                    // Lines split between reads (attr.lines)
+    size_t lineBufferSize[3];
+    const SHELLSPAWN_ALLOCATOR* allocator;  // Allocated the context
+    const SHELLSPAWN_ALLOCATOR* bufferAllocator; // Allocated the buffers
+};
+
+// Bump allocator for a spawn's transient memory (the parsed command, argv,
+// executable path, read buffers and synchronisation objects) - released in one
+// go by ArenaRelease(). The first block is part of the arena so a typical spawn
+// allocates nothing for it; further blocks come from the spawn's allocator.
+// Only used by one thread at a time
+#define ARENA_FIRST_BLOCK 4096
+#define ARENA_BLOCK       8192
+#define ARENA_ALIGN       16
+typedef struct spawnarena {
+    char *next;                // Free space in the current block
+    size_t left;               // ... bytes of it
+    void *blocks;              // Allocated blocks - each starts with the address
+                               // of the one allocated before it
+    union {
+        long double align;
+        char bytes[ARENA_FIRST_BLOCK];
+    } first;
+} SPAWNARENA;
+
 // Private structure to allow all the threads to share data etc. and
 // make the shellspawn() call re-enterent
 typedef struct shelldata {
@@ -64,9 +167,15 @@ typedef struct shelldata {
     char* sInput;          // data for input stream
     char** sOutput;         // data for output stream
     char** sError;          // data for error stream
+    size_t* sOutputLength;  // bytes in *sOutput (NULL if not wanted)
+    size_t* sErrorLength;   // bytes in *sError (NULL if not wanted)
     INHANDLER fInput;        // callback for input stream
     OUTHANDLER fOutput;      // callback for output stream
     OUTHANDLER fError;       // callback for error stream
+    SHELLSPAWN_BUFFER* bOutput; // caller's buffer for output stream
+    SHELLSPAWN_BUFFER* bError;  // caller's buffer for error stream
+    OUTDATAHANDLER dOutput;  // data callback for output stream
+    OUTDATAHANDLER dError;   // data callback for error stream
     int hInputFile;
     int hOutputFile;
     int hErrorFile;
@@ -94,49 +203,155 @@ typedef struct shelldata {
     pthread_mutex_t *callbackRequestedMutex;
     pthread_mutex_t *callbackHandledMutex;
     int callbackType; /* 1=StdIn, 2=StdOut or StdErr, -1 means child process exited */
+    int callbackStream;                    // STREAM_xxx of the callback
+    unsigned long long callbackArrivalTime; // when the data/input request arrived (ns)
     OUTHANDLER callbackOutputHandler;      // function for output callbacks
+    OUTDATAHANDLER callbackDataHandler;    // ... or data function
+    size_t callbackLength;                 // Bytes at callbackBuffer (output)
     char *callbackBuffer;
     int callbackRC;
     void* context;
     int proxySend, proxyReceive, proxySendRead, proxyReceiveWrite, proxyPID;
     char* buffer;
+    size_t bufferSize;
     char* file_path;
+    size_t filePathSize;
     char** argv;
+    size_t argvSize;
+    SPAWNMONITOR* monitor;
+    SHELLSPAWN_CONTEXT* spawnContext; // Owns the buffers and sync objects (or NULL)
+    const SHELLSPAWN_ALLOCATOR* allocator; // The spawn's memory comes from this
+    SPAWNARENA arena;        // The spawn's transient memory
+    char* readBuffer[3];     // stdout/stderr read buffers (indexed by STREAM_xxx)
+    int linesTruncated[3];   // A line longer than attr->lines.maxLength was cut short
+    const SHELLSPAWN_ATTR* attr; // Environment, working directory, limits etc.
+    /* Timeout - only set up if attr->timeoutMs is set */
+    pthread_t hTimeoutThread;
+    pthread_mutex_t *exitedMutex;
+    pthread_cond_t *exitedCondition; // Signalled when the child has exited
+    int exited;
+    int timedOut;
 } SHELLDATA;
 
+// A line split between reads (see HandleOutputToLines())
+typedef struct linebuffer {
+    char **text;             // The spawn context's buffer or the reader's own
+    size_t *size;
+    size_t length;           // Bytes of the line so far
+} LINEBUFFER;
+
+// An asynchronous spawn - SHELLDATA is used for the fds and parsed command so
+// that FindCommand(), launchChild() and CleanUp() work as for Spawn()
+struct shellspawn_async {
+    SHELLDATA data;
+    SHELLSPAWN_ATTR attr;           // Prepared copy of the caller's
+    SPAWNMONITOR monitor;
+    size_t inLength;                // Bytes of attr.sIn
+    size_t inWritten;               // ... written so far
+    int exitFd;                     // pidfd (readable once the child exits) or -1
+    unsigned long long deadline;    // Now() after which the child is killed (0 for none)
+    int result;                     // SHELLSPAWN_RUNNING until the child is reaped
+    int rc;
+};
+
 // Private functions
 static void* HandleInputThread(void* lpvThreadParam);
 static void* HandleOutputThread(void* lpvThreadParam);
 static void* HandleErrorThread(void* lpvThreadParam);
 static void* WaitForProcessThread(void* pThreadParam);
+static void* TimeoutThread(void* pThreadParam);
+static void StopTimeout(SHELLDATA* data);
 static void WaitForProcess(SHELLDATA* data);
 static void Error(char *context, char **errorText);
 static void CleanUp(SHELLDATA* data);
 static int WriteToStdin(char *line, SHELLDATA* data);
-static void HandleOutputToVector(int hRead, STRINGARRAY** aOut, int *error, char **errorText);
-static void HandleOutputToString(int hRead, char** sOut, int *error, char **errorText);
-static void HandleOutputToCallback(int hRead, OUTHANDLER fOut, int *error, char **errorText, SHELLDATA* data);
+static void HandleOutput(SHELLDATA* data, int hRead, STRINGARRAY** aOut, char** sOut, OUTHANDLER fOut,
+                         OUTDATAHANDLER dOut, SHELLSPAWN_BUFFER* bOut,
+                         int *error, char **errorText, int stream);
+static void HandleOutputToVector(int hRead, char *lpBuffer, size_t size, STRINGARRAY** aOut, int *error, char **errorText, SPAWNMONITOR* monitor, int stream);
+static void HandleOutputToString(int hRead, char *lpBuffer, size_t size, char** sOut, size_t* sOutLength, int *error, char **errorText, SPAWNMONITOR* monitor, int stream);
+static void HandleOutputToCallback(int hRead, char *lpBuffer, size_t size, OUTHANDLER fOut, OUTDATAHANDLER dOut, int *error, char **errorText, SHELLDATA* data, int stream);
+static void HandleOutputToLines(int hRead, char *lpBuffer, size_t size, OUTHANDLER fOut, OUTDATAHANDLER dOut, int *error, char **errorText, SHELLDATA* data, int stream);
+static int PassLine(SHELLDATA* data, LINEBUFFER* line, char *text, size_t length, OUTHANDLER fOut, OUTDATAHANDLER dOut,
+                    unsigned long long arrivalTime, int *error, char **errorText, int stream);
+static int AppendLine(LINEBUFFER* line, const char *text, size_t length, int *error, char **errorText);
+static int CallOutputHandler(SHELLDATA* data, char *text, size_t length, OUTHANDLER fOut, OUTDATAHANDLER dOut,
+                             unsigned long long arrivalTime, int *error, char **errorText, int stream);
+static void HandleOutputToBuffer(int hRead, char *lpBuffer, size_t size, SHELLSPAWN_BUFFER* bOut, int *error, char **errorText, SPAWNMONITOR* monitor, int stream);
+static void ClearBuffer(SHELLSPAWN_BUFFER* bOut);
+static int Overflowed(SHELLSPAWN_BUFFER* bOut);
 static void HandleStdinFromVector(SHELLDATA* data);
 static void HandleStdinFromCallback(SHELLDATA* data);
 static int HandleCallback(SHELLDATA* data, char **errorText);
-static int ParseCommand(const char *command_string, char **command, char **file, char ***argv);
+static int ParseCommand(SPAWNARENA* arena, const char *command_string, char **command, size_t *commandSize,
+                        char **file, char ***argv, size_t *argvSize);
+static int Reserve(void **buffer, size_t *size, size_t needed);
+static void ArenaInit(SPAWNARENA* arena);
+static void* ArenaAlloc(SPAWNARENA* arena, size_t size);
+static int ArenaReserve(SPAWNARENA* arena, void **buffer, size_t *size, size_t needed);
+static void ArenaRelease(SPAWNARENA* arena);
+static char* ReadBuffer(SHELLDATA* data, int stream);
+static int InitContextSync(SHELLSPAWN_CONTEXT* spawnContext, char **errorText);
+static void FreeSync(SHELLDATA* data, int error);
+static void FreeBuffers(SHELLDATA* data);
+static int SpawnCall(SHELLSPAWN_CONTEXT* spawnContext, const char *command, const SHELLSPAWN_ATTR *attr,
+                     int *rc, char **errorText, void* context);
 static int ProxyWorker(SHELLDATA* data);
+static int FindCommand(SHELLDATA* data, const char *command, char **errorText);
 static void launchChild(SHELLDATA* data);
 static int ExeFound(char* exe);
+static int Spawn(SHELLSPAWN_CONTEXT* spawnContext, const char *command, const SHELLSPAWN_ATTR *attr,
+                 int *rc, char **errorText, void* context, SPAWNMONITOR* monitor);
+static void SetLimit(int resource, unsigned long long value);
+static unsigned long long Now(void);
+static unsigned long long ThreadCpuTime(void);
+static void StartMonitor(SPAWNMONITOR* monitor, void* context);
+static void EndMonitor(SPAWNMONITOR* monitor);
+static void CountOutput(SPAWNMONITOR* monitor, int stream, char *buffer, size_t length);
+static ssize_t ReadOutput(int hRead, char *buffer, size_t size, SPAWNMONITOR* monitor, int stream);
+static int AsyncStart(SHELLSPAWN_ASYNC* async, const char *command, char **errorText);
+static int AsyncPipe(int *hRead, int *hWrite, int parentWrites);
+static int AsyncFinish(SHELLSPAWN_ASYNC* async, int result);
+static ssize_t WriteNoSignal(int fd, const char *buffer, size_t size);
+static SHELLSPAWN_PIPESTATS* PipeStats(SHELLSPAWN_STATS* stats, int stream);
+static void Record(SHELLSPAWN_HISTOGRAM *histogram, unsigned long long value);
+static void AddHistogram(SHELLSPAWN_HISTOGRAM *to, const SHELLSPAWN_HISTOGRAM *from);
+static void AddStats(SHELLSPAWN_STATS *to, const SHELLSPAWN_STATS *from);
+static SHELLSPAWN_CALLBACKSTATS* CallbackStats(SHELLSPAWN_STATS* stats, int stream);
+static void ConsumeToVector(STRINGARRAY **aOut, char **partial, char *chunk, size_t length);
+static void FinishVector(STRINGARRAY **aOut, char **partial);
+static void ConsumeToString(char **sOut, size_t *sOutLength, char *chunk, size_t length);
+static void* SystemAlloc(size_t size, void *context);
+static void* SystemRealloc(void *block, size_t size, void *context);
+static void SystemFree(void *block, void *context);
+static void* Alloc(size_t size);
+static void* Realloc(void *block, size_t size);
+static void Free(void *block);
+static const SHELLSPAWN_ALLOCATOR* UseAllocator(const SHELLSPAWN_ALLOCATOR* allocator);
+static const SHELLSPAWN_ALLOCATOR* SpawnAllocator(const SHELLSPAWN_ATTR *attr);
+static void FreeContextBuffers(SHELLSPAWN_CONTEXT* spawnContext);
+static int AsyncWait(SHELLSPAWN_ASYNC *async, int block, int *rc, char **errorText);
+
+// Memory - the process wide allocator, and the allocator of the spawn that the
+// thread is working for (set by UseAllocator() so that the helpers allocate
+// from it without having to be passed it)
+static const SHELLSPAWN_ALLOCATOR systemAllocator = {SystemAlloc, SystemRealloc, SystemFree, NULL};
+static const SHELLSPAWN_ALLOCATOR *processAllocator = &systemAllocator;
+static __thread const SHELLSPAWN_ALLOCATOR *threadAllocator = NULL;
 
 static void setTextOutput(char **outputText, char *inputText) {
-    if (*outputText) free(*outputText);
-    *outputText = malloc(strlen(inputText) + 1);
+    if (*outputText) Free(*outputText);
+    *outputText = Alloc(strlen(inputText) + 1);
     strcpy(*outputText, inputText);
 }
 
 static void appendTextOutput(char **outputText, char *inputText) {
     if (*outputText) {
-        *outputText = realloc(*outputText, strlen(*outputText) + strlen(inputText) + 1);
+        *outputText = Realloc(*outputText, strlen(*outputText) + strlen(inputText) + 1);
         strcat(*outputText, inputText);
     }
     else {
-        *outputText = malloc(strlen(inputText) + 1);
+        *outputText = Alloc(strlen(inputText) + 1);
         strcpy(*outputText, inputText);
     }
 }
@@ -148,17 +363,87 @@ static void appendTextArray(STRINGARRAY **outputArray, char *inputText) {
 
     if (*outputArray) {
         for (s=0; (**outputArray)[s]; s++); /* Size of Array */
-        *outputArray = realloc(*outputArray, sizeof(char*) * (s + 2));
+        *outputArray = Realloc(*outputArray, sizeof(char*) * (s + 2));
         (**outputArray)[s] = inputText;
         (**outputArray)[s + 1] = 0;
     }
     else {
-        *outputArray = malloc(sizeof(char*) * 2);
+        *outputArray = Alloc(sizeof(char*) * 2);
         (**outputArray)[0] = inputText;
         (**outputArray)[1] = 0;
     }
 }
 
+void shellspawn_setallocator(const SHELLSPAWN_ALLOCATOR *allocator) {
+    processAllocator = allocator ? allocator : &systemAllocator;
+}
+
+void* shellspawn_alloc(const SHELLSPAWN_ALLOCATOR *allocator, size_t size) {
+    if (!allocator) allocator = processAllocator;
+    return allocator->alloc(size, allocator->context);
+}
+
+void* shellspawn_realloc(const SHELLSPAWN_ALLOCATOR *allocator, void *block, size_t size) {
+    if (!allocator) allocator = processAllocator;
+    if (!block) return allocator->alloc(size, allocator->context);
+    return allocator->realloc(block, size, allocator->context);
+}
+
+void shellspawn_free(const SHELLSPAWN_ALLOCATOR *allocator, void *block) {
+    if (!block) return;
+    if (!allocator) allocator = processAllocator;
+    allocator->free(block, allocator->context);
+}
+
+void shellspawn_freearray(const SHELLSPAWN_ALLOCATOR *allocator, STRINGARRAY *array) {
+    size_t s;
+    if (!array) return;
+    for (s = 0; (*array)[s]; s++) shellspawn_free(allocator, (*array)[s]);
+    shellspawn_free(allocator, *array);
+}
+
+// The default allocator - the C library's
+void* SystemAlloc(size_t size, void *context) {
+    (void)context;
+    return malloc(size);
+}
+
+void* SystemRealloc(void *block, size_t size, void *context) {
+    (void)context;
+    return realloc(block, size);
+}
+
+void SystemFree(void *block, void *context) {
+    (void)context;
+    free(block);
+}
+
+// Allocates, reallocates and frees with the allocator the thread is using
+void* Alloc(size_t size) {
+    return shellspawn_alloc(threadAllocator, size);
+}
+
+void* Realloc(void *block, size_t size) {
+    return shellspawn_realloc(threadAllocator, block, size);
+}
+
+void Free(void *block) {
+    shellspawn_free(threadAllocator, block);
+}
+
+// Sets the allocator the thread uses (NULL for the process wide one) -
+// returns the one it was using, for the caller to put back
+const SHELLSPAWN_ALLOCATOR* UseAllocator(const SHELLSPAWN_ALLOCATOR* allocator) {
+    const SHELLSPAWN_ALLOCATOR *previous = threadAllocator;
+    threadAllocator = allocator;
+    return previous;
+}
+
+// The allocator a spawn with attr uses
+const SHELLSPAWN_ALLOCATOR* SpawnAllocator(const SHELLSPAWN_ATTR *attr) {
+    return attr->allocator ? attr->allocator : processAllocator;
+}
+
 int shellspawn (const char *command,
                 STRINGARRAY *aIn,
                 char* sIn,
@@ -175,6 +460,952 @@ int shellspawn (const char *command,
                 int *rc,
                 char **errorText,
                 void* context) {
+    SHELLSPAWN_ATTR attr;
+
+    shellspawn_attr_init(&attr);
+    attr.aIn = aIn;
+    attr.sIn = sIn;
+    attr.fIn = fIn;
+    attr.pIn = pIn;
+    attr.aOut = aOut;
+    attr.sOut = sOut;
+    attr.fOut = fOut;
+    attr.pOut = pOut;
+    attr.aErr = aErr;
+    attr.sErr = sErr;
+    attr.fErr = fErr;
+    attr.pErr = pErr;
+
+    return shellspawn_ex(command, &attr, rc, errorText, context);
+}
+
+void shellspawn_attr_init(SHELLSPAWN_ATTR *attr) {
+    memset(attr, 0, sizeof(SHELLSPAWN_ATTR));
+    attr->lines.delimiter = '\n';
+}
+
+int shellspawn_attr_prepare(SHELLSPAWN_ATTR *attr, char **errorText) {
+    const SHELLSPAWN_ALLOCATOR *callerAllocator = UseAllocator(SpawnAllocator(attr));
+    int result = SHELLSPAWN_OK;
+
+    attr->prepared = 0;
+
+    if ((attr->aIn ? 1 : 0) + (attr->sIn ? 1 : 0) + (attr->fIn ? 1 : 0) + (attr->pIn ? 1 : 0) > 1) {
+        setTextOutput(errorText,
+                      "More than one of vIn, sIn, fIn or pIn specified");
+        result = SHELLSPAWN_TOOMANYIN;
+    }
+    else if ((attr->aOut ? 1 : 0) + (attr->sOut ? 1 : 0) + (attr->fOut ? 1 : 0) + (attr->pOut ? 1 : 0) +
+             (attr->bOut ? 1 : 0) + (attr->dOut ? 1 : 0) > 1) {
+        setTextOutput(errorText,
+                      "More than one of vOut, sOut, fOut, pOut, bOut or dOut specified");
+        result = SHELLSPAWN_TOOMANYOUT;
+    }
+    else if ((attr->aErr ? 1 : 0) + (attr->sErr ? 1 : 0) + (attr->fErr ? 1 : 0) + (attr->pErr ? 1 : 0) +
+             (attr->bErr ? 1 : 0) + (attr->dErr ? 1 : 0) > 1) {
+        setTextOutput(errorText,
+                      "More than one of vErr, sErr, fErr, pErr, bErr or dErr specified");
+        result = SHELLSPAWN_TOOMANYERR;
+    }
+    else {
+        attr->callbacks = (attr->fIn ? 1 : 0) + (attr->fOut ? 1 : 0) + (attr->fErr ? 1 : 0) +
+                          (attr->dOut ? 1 : 0) + (attr->dErr ? 1 : 0);
+        if (!attr->readBufferSize) attr->readBufferSize = SHELLSPAWN_READBUFFER_DEFAULT;
+        attr->prepared = 1;
+    }
+
+    UseAllocator(callerAllocator);
+    return result;
+}
+
+int shellspawn_ex(const char *command,
+                  const SHELLSPAWN_ATTR *attr,
+                  int *rc,
+                  char **errorText,
+                  void* context) {
+    return SpawnCall(NULL, command, attr, rc, errorText, context);
+}
+
+SHELLSPAWN_CONTEXT* shellspawn_context_create(void) {
+    SHELLSPAWN_CONTEXT* spawnContext = shellspawn_alloc(processAllocator, sizeof(SHELLSPAWN_CONTEXT));
+    if (spawnContext) {
+        memset(spawnContext, 0, sizeof(SHELLSPAWN_CONTEXT));
+        spawnContext->allocator = processAllocator;
+    }
+    return spawnContext;
+}
+
+void shellspawn_context_free(SHELLSPAWN_CONTEXT* spawnContext) {
+    if (!spawnContext) return;
+    if (spawnContext->syncReady) {
+        pthread_mutex_destroy(&spawnContext->criticalsection);
+        pthread_cond_destroy(&spawnContext->callbackRequested);
+        pthread_cond_destroy(&spawnContext->callbackHandled);
+        pthread_mutex_destroy(&spawnContext->callbackRequestedMutex);
+        pthread_mutex_destroy(&spawnContext->callbackHandledMutex);
+        pthread_mutex_destroy(&spawnContext->exitedMutex);
+        pthread_cond_destroy(&spawnContext->exitedCondition);
+    }
+    FreeContextBuffers(spawnContext);
+    shellspawn_free(spawnContext->allocator, spawnContext);
+}
+
+// Frees the context's buffers (with the allocator that allocated them)
+void FreeContextBuffers(SHELLSPAWN_CONTEXT* spawnContext) {
+    const SHELLSPAWN_ALLOCATOR *callerAllocator = UseAllocator(spawnContext->bufferAllocator);
+    int stream;
+
+    if (spawnContext->buffer) Free(spawnContext->buffer);
+    if (spawnContext->argv) Free(spawnContext->argv);
+    if (spawnContext->file_path) Free(spawnContext->file_path);
+    spawnContext->buffer = NULL;
+    spawnContext->bufferSize = 0;
+    spawnContext->argv = NULL;
+    spawnContext->argvSize = 0;
+    spawnContext->file_path = NULL;
+    spawnContext->filePathSize = 0;
+    for (stream = 0; stream < 3; stream++) {
+        if (spawnContext->readBuffer[stream]) Free(spawnContext->readBuffer[stream]);
+        if (spawnContext->lineBuffer[stream]) Free(spawnContext->lineBuffer[stream]);
+        spawnContext->readBuffer[stream] = NULL;
+        spawnContext->readBufferSize[stream] = 0;
+        spawnContext->lineBuffer[stream] = NULL;
+        spawnContext->lineBufferSize[stream] = 0;
+    }
+    UseAllocator(callerAllocator);
+}
+
+int shellspawn_run(SHELLSPAWN_CONTEXT* spawnContext,
+                   const char *command,
+                   const SHELLSPAWN_ATTR *attr,
+                   int *rc,
+                   char **errorText,
+                   void* context) {
+    return SpawnCall(spawnContext, command, attr, rc, errorText, context);
+}
+
+// Common body of shellspawn_ex() and shellspawn_run() - spawnContext can be NULL
+int SpawnCall(SHELLSPAWN_CONTEXT* spawnContext,
+              const char *command,
+              const SHELLSPAWN_ATTR *attr,
+              int *rc,
+              char **errorText,
+              void* context) {
+    SPAWNMONITOR monitor;
+    SHELLSPAWN_ATTR prepared;
+    int result = SHELLSPAWN_OK;
+    unsigned long long cpuStart = ThreadCpuTime();
+    const SHELLSPAWN_ALLOCATOR *callerAllocator = UseAllocator(SpawnAllocator(attr));
+
+    // Register the call so that its progress can be queried while it runs
+    StartMonitor(&monitor, context);
+
+    // An unprepared attr is checked on a copy - so that attr is never changed
+    if (!attr->prepared) {
+        prepared = *attr;
+        result = shellspawn_attr_prepare(&prepared, errorText);
+        attr = &prepared;
+    }
+    monitor.readSize = attr->readBufferSize;
+    if (result == SHELLSPAWN_OK) result = Spawn(spawnContext, command, attr, rc, errorText, context, &monitor);
+    monitor.stats.callerCpuNs = ThreadCpuTime() - cpuStart - monitor.callbackCpuTime;
+    Record(&monitor.stats.duration, Now() - monitor.startTime);
+    if (result >= 0 && result < SHELLSPAWN_RESULTS) monitor.stats.results[result]++;
+    EndMonitor(&monitor);
+    UseAllocator(callerAllocator);
+
+    return result;
+}
+
+int shellspawn_async_start(const char *command,
+                           const SHELLSPAWN_ATTR *attr,
+                           SHELLSPAWN_ASYNC **async,
+                           char **errorText,
+                           void* context) {
+    SHELLSPAWN_ASYNC* spawn;
+    SHELLDATA* data;
+    int result = SHELLSPAWN_OK;
+    const SHELLSPAWN_ALLOCATOR *callerAllocator = UseAllocator(SpawnAllocator(attr));
+
+    *async = NULL;
+    spawn = Alloc(sizeof(SHELLSPAWN_ASYNC));
+    if (!spawn) {
+        Error("Failure U95 in malloc(async) in shellspawn_async_start()", errorText);
+        UseAllocator(callerAllocator);
+        return SHELLSPAWN_FAILURE;
+    }
+    memset(spawn, 0, sizeof(SHELLSPAWN_ASYNC));
+    spawn->attr = *attr;
+    spawn->exitFd = -1;
+    spawn->result = SHELLSPAWN_RUNNING;
+    StartMonitor(&spawn->monitor, context);
+
+    data = &spawn->data;
+    data->hOutputRead = -1;
+    data->hOutputWrite = -1;
+    data->hErrorRead = -1;
+    data->hErrorWrite = -1;
+    data->hInputRead = -1;
+    data->hInputWrite = -1;
+    data->hInputFile = -1;
+    data->hOutputFile = -1;
+    data->hErrorFile = -1;
+    data->proxySend = -1;
+    data->proxyReceive = -1;
+    data->proxySendRead = -1;
+    data->proxyReceiveWrite = -1;
+    data->context = context;
+    data->monitor = &spawn->monitor;
+    data->attr = &spawn->attr;
+    data->allocator = threadAllocator;
+    ArenaInit(&data->arena);
+
+    if (!spawn->attr.prepared) result = shellspawn_attr_prepare(&spawn->attr, errorText);
+    if (result == SHELLSPAWN_OK) result = AsyncStart(spawn, command, errorText);
+    if (result != SHELLSPAWN_OK) {
+        CleanUp(data);
+        AsyncFinish(spawn, result);
+        Free(spawn);
+        UseAllocator(callerAllocator);
+        return result;
+    }
+
+    *async = spawn;
+    UseAllocator(callerAllocator);
+    return SHELLSPAWN_OK;
+}
+
+int shellspawn_async_fd(SHELLSPAWN_ASYNC *async, int stream) {
+    switch (stream) {
+        case SHELLSPAWN_STREAM_IN: return async->data.hInputWrite;
+        case SHELLSPAWN_STREAM_OUT: return async->data.hOutputRead;
+        case SHELLSPAWN_STREAM_ERR: return async->data.hErrorRead;
+        case SHELLSPAWN_STREAM_EXIT: return async->exitFd;
+        default: return -1;
+    }
+}
+
+long shellspawn_async_read(SHELLSPAWN_ASYNC *async, int stream, char *buffer, size_t size) {
+    int *hRead;
+    ssize_t nBytesRead;
+
+    if (stream == SHELLSPAWN_STREAM_OUT) hRead = &async->data.hOutputRead;
+    else if (stream == SHELLSPAWN_STREAM_ERR) hRead = &async->data.hErrorRead;
+    else {
+        errno = EINVAL;
+        return -1;
+    }
+    if (*hRead == -1) return 0; // Not a pipe, or already at the end
+
+    nBytesRead = ReadOutput(*hRead, buffer, size, &async->monitor, stream);
+    if (nBytesRead == 0) {
+        close(*hRead);
+        *hRead = -1;
+    }
+    return (long)nBytesRead;
+}
+
+int shellspawn_async_write(SHELLSPAWN_ASYNC *async) {
+    SHELLDATA* data = &async->data;
+    ssize_t nBytesWrote;
+    int error = 0;
+
+    if (data->hInputWrite == -1) return 0;
+
+    while (async->inWritten < async->inLength) {
+        nBytesWrote = WriteNoSignal(data->hInputWrite, async->attr.sIn + async->inWritten,
+                                    async->inLength - async->inWritten);
+        if (nBytesWrote == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1; // Pipe full
+            if (errno == EINTR) continue;
+            // EPIPE is a normal exit path - the child exited (or closed stdin)
+            // before reading all its input
+            if (errno != EPIPE) error = errno;
+            break;
+        }
+        async->inWritten += nBytesWrote;
+        ATOMIC_ADD(&async->monitor.bytes[STREAM_IN], nBytesWrote);
+    }
+
+    close(data->hInputWrite);
+    data->hInputWrite = -1;
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int shellspawn_async_wait(SHELLSPAWN_ASYNC *async, int block, int *rc, char **errorText) {
+    const SHELLSPAWN_ALLOCATOR *callerAllocator = UseAllocator(async->data.allocator);
+    int result = AsyncWait(async, block, rc, errorText);
+
+    UseAllocator(callerAllocator);
+    return result;
+}
+
+// Body of shellspawn_async_wait() - with the spawn's allocator in use
+int AsyncWait(SHELLSPAWN_ASYNC *async, int block, int *rc, char **errorText) {
+    SHELLDATA* data = &async->data;
+    struct rusage usage;
+    struct timespec pause;
+    unsigned long long remaining;
+    pid_t w;
+    int status;
+
+    if (async->result != SHELLSPAWN_RUNNING) {
+        *rc = async->rc;
+        if (async->result == SHELLSPAWN_TIMEOUT)
+            setTextOutput(errorText, "Failure U101 in shellspawn_async_wait() - Command timed out and was killed");
+        return async->result;
+    }
+
+    for (;;) {
+        // Only block in wait4() if there is no deadline to enforce
+        w = wait4(data->ChildProcessPID, &status,
+                  block && (!async->deadline || data->timedOut) ? 0 : WNOHANG, &usage);
+        if (w == -1 && errno == EINTR) continue;
+        if (w == -1) {
+            Error("Failure U100 in waitpid() in shellspawn_async_wait()", errorText);
+            data->ChildProcessPID = 0;
+            return AsyncFinish(async, SHELLSPAWN_FAILURE);
+        }
+        if (w) break;
+
+        // Still running - kill it if it has run for too long
+        if (async->deadline && !data->timedOut && Now() >= async->deadline) {
+            data->timedOut = 1;
+            kill(-data->ChildProcessPID, 9); // 9=KILL - its process group
+            if (block) continue;
+        }
+        if (!block) return SHELLSPAWN_RUNNING;
+
+        // Blocking with a deadline - check again in (at most) 10ms
+        remaining = async->deadline > Now() ? async->deadline - Now() : 0;
+        if (remaining > 10000000ULL) remaining = 10000000ULL;
+        pause.tv_sec = 0;
+        pause.tv_nsec = (long)remaining;
+        nanosleep(&pause, NULL);
+    }
+
+    data->ChildProcessPID = 0;
+    ATOMIC_STORE(&async->monitor.state, SHELLSPAWN_STATE_EXITED);
+    if (async->exitFd != -1) {
+        close(async->exitFd);
+        async->exitFd = -1;
+    }
+
+    // Child resource usage
+    async->monitor.stats.childUserUs = (unsigned long long)usage.ru_utime.tv_sec * 1000000ULL + usage.ru_utime.tv_usec;
+    async->monitor.stats.childSystemUs = (unsigned long long)usage.ru_stime.tv_sec * 1000000ULL + usage.ru_stime.tv_usec;
+    async->monitor.stats.childMaxRssKB = usage.ru_maxrss;
+
+    if (data->timedOut) {
+        setTextOutput(errorText, "Failure U101 in shellspawn_async_wait() - Command timed out and was killed");
+        return AsyncFinish(async, SHELLSPAWN_TIMEOUT);
+    }
+    async->rc = WEXITSTATUS(status);
+    *rc = async->rc;
+    return AsyncFinish(async, SHELLSPAWN_OK);
+}
+
+long shellspawn_async_timeout(SHELLSPAWN_ASYNC *async) {
+    unsigned long long now = Now();
+
+    if (!async->deadline || async->data.timedOut || async->result != SHELLSPAWN_RUNNING) return -1;
+    if (now >= async->deadline) return 0;
+    return (long)((async->deadline - now + 999999ULL) / 1000000ULL);
+}
+
+void shellspawn_async_free(SHELLSPAWN_ASYNC *async) {
+    const SHELLSPAWN_ALLOCATOR *callerAllocator;
+    int status;
+
+    if (!async) return;
+    callerAllocator = UseAllocator(async->data.allocator);
+
+    // Still running - kill and reap it so that no zombie is left
+    if (async->data.ChildProcessPID) {
+        kill(-async->data.ChildProcessPID, 9); // 9=KILL - its process group
+        while (waitpid(async->data.ChildProcessPID, &status, 0) == -1 && errno == EINTR);
+        async->data.ChildProcessPID = 0;
+    }
+    if (async->result == SHELLSPAWN_RUNNING) AsyncFinish(async, SHELLSPAWN_FAILURE);
+
+    if (async->exitFd != -1) close(async->exitFd);
+    CleanUp(&async->data);
+    Free(async);
+    UseAllocator(callerAllocator);
+}
+
+// Body of shellspawn_async_start() - on error the caller cleans up
+int AsyncStart(SHELLSPAWN_ASYNC* async, const char *command, char **errorText) {
+    SHELLDATA* data = &async->data;
+    const SHELLSPAWN_ATTR* attr = &async->attr;
+    int result;
+
+    if (attr->aIn || attr->fIn || attr->aOut || attr->sOut || attr->fOut || attr->bOut || attr->dOut ||
+        attr->aErr || attr->sErr || attr->fErr || attr->bErr || attr->dErr) {
+        setTextOutput(errorText,
+                      "Failure U96 in shellspawn_async_start() - Only sIn, pIn, pOut and pErr can be bound");
+        return SHELLSPAWN_FAILURE;
+    }
+
+    // Streams - as for Spawn() but the pipes are not inherited by other
+    // children, and our ends are nonblocking
+    if (attr->pOut) data->hOutputFile = fileno(attr->pOut);
+    else if (AsyncPipe(&data->hOutputRead, &data->hOutputWrite, 0)) {
+        Error("Failure U97 in pipe() in shellspawn_async_start()", errorText);
+        return SHELLSPAWN_FAILURE;
+    }
+    if (attr->pErr) data->hErrorFile = fileno(attr->pErr);
+    else if (AsyncPipe(&data->hErrorRead, &data->hErrorWrite, 0)) {
+        Error("Failure U98 in pipe() in shellspawn_async_start()", errorText);
+        return SHELLSPAWN_FAILURE;
+    }
+    if (attr->pIn) data->hInputFile = fileno(attr->pIn);
+    else if (AsyncPipe(&data->hInputRead, &data->hInputWrite, 1)) {
+        Error("Failure U99 in pipe() in shellspawn_async_start()", errorText);
+        return SHELLSPAWN_FAILURE;
+    }
+
+    result = FindCommand(data, command, errorText);
+    if (result != SHELLSPAWN_OK) return result;
+
+    if ((data->ChildProcessPID = fork()) == -1) {
+        data->ChildProcessPID = 0;
+        Error("Failure U102 in fork() in shellspawn_async_start()", errorText);
+        return SHELLSPAWN_FAILURE;
+    }
+    if (data->ChildProcessPID == 0) // Child Process
+    {
+        setpgid(0, 0); // Its own process group, as for Spawn()
+        launchChild(data);
+    }
+    setpgid(data->ChildProcessPID, data->ChildProcessPID);
+
+    Record(&async->monitor.stats.spawnLatency, Now() - async->monitor.startTime);
+    ATOMIC_STORE(&async->monitor.pid, data->ChildProcessPID);
+    ATOMIC_STORE(&async->monitor.state, SHELLSPAWN_STATE_RUNNING);
+
+    // Close the child ends of any pipes - and stdin at once if there is
+    // nothing to write
+    if (data->hOutputWrite != -1) {
+        close(data->hOutputWrite);
+        data->hOutputWrite = -1;
+    }
+    if (data->hErrorWrite != -1) {
+        close(data->hErrorWrite);
+        data->hErrorWrite = -1;
+    }
+    if (data->hInputRead != -1) {
+        close(data->hInputRead);
+        data->hInputRead = -1;
+    }
+    if (attr->sIn) async->inLength = strlen(attr->sIn);
+    if (!async->inLength && data->hInputWrite != -1) {
+        close(data->hInputWrite);
+        data->hInputWrite = -1;
+    }
+    FreeBuffers(data);
+
+#ifdef SYS_pidfd_open
+    async->exitFd = (int)syscall(SYS_pidfd_open, data->ChildProcessPID, 0); // -1 if not supported
+#endif
+    if (attr->timeoutMs) async->deadline = Now() + (unsigned long long)attr->timeoutMs * 1000000ULL;
+
+    return SHELLSPAWN_OK;
+}
+
+// Creates a pipe for an asynchronous spawn - close on exec (the child's ends
+// are dup()ed to its stdio by launchChild()) and with our end nonblocking
+int AsyncPipe(int *hRead, int *hWrite, int parentWrites) {
+    int temppipe[2];
+
+    if (pipe(temppipe)) return -1;
+    *hRead = temppipe[0];
+    *hWrite = temppipe[1];
+    if (fcntl(temppipe[0], F_SETFD, FD_CLOEXEC) == -1 ||
+        fcntl(temppipe[1], F_SETFD, FD_CLOEXEC) == -1 ||
+        fcntl(temppipe[parentWrites ? 1 : 0], F_SETFL, O_NONBLOCK) == -1)
+        return -1;
+#ifdef F_SETNOSIGPIPE
+    if (parentWrites && fcntl(temppipe[1], F_SETNOSIGPIPE, 1) == -1) return -1;
+#endif
+    return 0;
+}
+
+// Records the asynchronous spawn's telemetry and takes it off the in-flight
+// list. Returns result
+int AsyncFinish(SHELLSPAWN_ASYNC* async, int result) {
+    async->result = result;
+    Record(&async->monitor.stats.duration, Now() - async->monitor.startTime);
+    if (result >= 0 && result < SHELLSPAWN_RESULTS) async->monitor.stats.results[result]++;
+    EndMonitor(&async->monitor);
+    return result;
+}
+
+// write() to the child's stdin that fails with EPIPE, rather than raising
+// SIGPIPE, if the child has closed it. It runs on the caller's thread so the
+// signal mask is put back afterwards (discarding any SIGPIPE raised here)
+ssize_t WriteNoSignal(int fd, const char *buffer, size_t size) {
+#ifdef F_SETNOSIGPIPE
+    return write(fd, buffer, size); // Set on the pipe by AsyncPipe()
+#else
+    sigset_t pipeMask, oldMask, pending;
+    struct timespec zero = {0, 0};
+    ssize_t nBytesWrote;
+    int pipePending, savedErrno;
+
+    sigemptyset(&pipeMask);
+    sigaddset(&pipeMask, SIGPIPE);
+    sigpending(&pending);
+    pipePending = sigismember(&pending, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeMask, &oldMask);
+
+    nBytesWrote = write(fd, buffer, size);
+    if (nBytesWrote == -1 && errno == EPIPE && !pipePending) {
+        savedErrno = errno;
+        sigtimedwait(&pipeMask, NULL, &zero);
+        errno = savedErrno;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+    return nBytesWrote;
+#endif
+}
+
+int shellspawn_progress(SHELLSPAWN_PROGRESS *progress, int max) {
+    SPAWNMONITOR* monitor;
+    unsigned long long now = Now();
+    unsigned long long lastOutput;
+    int n = 0;
+
+    pthread_mutex_lock(&monitorsMutex);
+    for (monitor = monitors; monitor; monitor = monitor->next, n++) {
+        if (n >= max) continue; // Just count the rest
+        progress[n].context = monitor->context;
+        progress[n].pid = ATOMIC_LOAD(&monitor->pid);
+        progress[n].state = ATOMIC_LOAD(&monitor->state);
+        progress[n].outBytes = ATOMIC_LOAD(&monitor->bytes[STREAM_OUT]);
+        progress[n].outLines = ATOMIC_LOAD(&monitor->lines[STREAM_OUT]);
+        progress[n].errBytes = ATOMIC_LOAD(&monitor->bytes[STREAM_ERR]);
+        progress[n].errLines = ATOMIC_LOAD(&monitor->lines[STREAM_ERR]);
+        progress[n].inBytes = ATOMIC_LOAD(&monitor->bytes[STREAM_IN]);
+        progress[n].msRunning = (now - monitor->startTime) / 1000000;
+        lastOutput = ATOMIC_LOAD(&monitor->lastOutputTime);
+        if (!lastOutput) lastOutput = monitor->startTime;
+        progress[n].msSinceOutput = now > lastOutput ? (now - lastOutput) / 1000000 : 0;
+    }
+    pthread_mutex_unlock(&monitorsMutex);
+
+    return n;
+}
+
+// Monotonic time in ns
+unsigned long long Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+// CPU time used by the current thread in ns
+unsigned long long ThreadCpuTime(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts)) return 0;
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+// Adds the monitor to the in-flight list
+void StartMonitor(SPAWNMONITOR* monitor, void* context) {
+    memset(monitor, 0, sizeof(SPAWNMONITOR));
+    monitor->context = context;
+    monitor->state = SHELLSPAWN_STATE_STARTING;
+    monitor->startTime = Now();
+
+    pthread_mutex_lock(&monitorsMutex);
+    monitor->next = monitors;
+    if (monitors) monitors->prev = monitor;
+    monitors = monitor;
+    monitor->stats.peakInFlight = ++inFlight;
+    pthread_mutex_unlock(&monitorsMutex);
+}
+
+// Removes the monitor from the in-flight list and adds its telemetry to the
+// thread's collector and the totals
+void EndMonitor(SPAWNMONITOR* monitor) {
+    pthread_mutex_lock(&monitorsMutex);
+    if (monitor->prev) monitor->prev->next = monitor->next;
+    else monitors = monitor->next;
+    if (monitor->next) monitor->next->prev = monitor->prev;
+    inFlight--;
+    pthread_mutex_unlock(&monitorsMutex);
+
+    monitor->stats.spawns = 1;
+    monitor->stats.inBytes = monitor->bytes[STREAM_IN];
+    monitor->stats.outBytes = monitor->bytes[STREAM_OUT];
+    monitor->stats.errBytes = monitor->bytes[STREAM_ERR];
+    if (threadStats) AddStats(threadStats, &monitor->stats);
+    pthread_mutex_lock(&totalStatsMutex);
+    AddStats(&totalStats, &monitor->stats);
+    pthread_mutex_unlock(&totalStatsMutex);
+}
+
+// Counts bytes and lines read from the child's stdout or stderr
+void CountOutput(SPAWNMONITOR* monitor, int stream, char *buffer, size_t length) {
+    size_t i;
+    unsigned long long lines = 0;
+
+    for (i = 0; i < length; i++) if (buffer[i] == '\n') lines++;
+    ATOMIC_ADD(&monitor->bytes[stream], length);
+    if (lines) ATOMIC_ADD(&monitor->lines[stream], lines);
+    ATOMIC_STORE(&monitor->lastOutputTime, Now());
+}
+
+// Reads from the child's stdout or stderr pipe - and keeps the progress
+// counters and pipe telemetry up to date. Returns the result of read()
+ssize_t ReadOutput(int hRead, char *buffer, size_t size, SPAWNMONITOR* monitor, int stream) {
+    SHELLSPAWN_PIPESTATS *pipeStats = PipeStats(&monitor->stats, stream);
+    ssize_t nBytesRead;
+    unsigned long long now;
+    int backlog = 0;
+
+    nBytesRead = read(hRead, buffer, size);
+    if (nBytesRead <= 0) {
+        // End of the stream - close any blocked episode
+        if (monitor->blockedTime[stream]) {
+            Record(&pipeStats->blocked, monitor->blockedTime[stream]);
+            monitor->blockedTime[stream] = 0;
+        }
+        return nBytesRead;
+    }
+
+    CountOutput(monitor, stream, buffer, (size_t)nBytesRead);
+    now = Now(); // Not lastOutputTime - the other stream's reader sets that too
+    pipeStats->reads++;
+
+    // A short read means that the pipe has been drained, otherwise there may be
+    // a backlog so we sample it. Reads into a caller's buffer can ask for less
+    // than a full read buffer, so are compared with that
+    if ((size_t)nBytesRead >= (monitor->readSize ? monitor->readSize : size)) {
+        pipeStats->fullReads++;
+        if (ioctl(hRead, FIONREAD, &backlog) == -1) backlog = 0;
+    }
+    Record(&pipeStats->backlog, (unsigned long long)backlog);
+
+    if (!monitor->pipeSize[stream]) {
+#ifdef F_GETPIPE_SZ
+        monitor->pipeSize[stream] = fcntl(hRead, F_GETPIPE_SZ);
+#endif
+        if (monitor->pipeSize[stream] <= 0) monitor->pipeSize[stream] = 65536;
+    }
+
+    // Was the pipe full before this read? If so the child was probably blocked
+    // since the last read
+    if (nBytesRead + backlog + PIPE_FULL_SLACK > monitor->pipeSize[stream]) {
+        pipeStats->fullPipes++;
+        if (monitor->lastReadTime[stream]) {
+            pipeStats->blockedNs += now - monitor->lastReadTime[stream];
+            monitor->blockedTime[stream] += now - monitor->lastReadTime[stream];
+        }
+    }
+    else if (monitor->blockedTime[stream]) {
+        Record(&pipeStats->blocked, monitor->blockedTime[stream]);
+        monitor->blockedTime[stream] = 0;
+    }
+    monitor->lastReadTime[stream] = now;
+
+    return nBytesRead;
+}
+
+SHELLSPAWN_PIPESTATS* PipeStats(SHELLSPAWN_STATS* stats, int stream) {
+    if (stream == STREAM_ERR) return &stats->err;
+    return &stats->out;
+}
+
+SHELLSPAWN_CALLBACKSTATS* CallbackStats(SHELLSPAWN_STATS* stats, int stream) {
+    if (stream == STREAM_IN) return &stats->inCallback;
+    if (stream == STREAM_ERR) return &stats->errCallback;
+    return &stats->outCallback;
+}
+
+// Histogram bucket for a value - values below 8 have their own bucket, above
+// that each power of two has 8 linear sub-buckets
+static int HistogramBucket(unsigned long long value) {
+    int e;
+    int bucket;
+
+    if (value < 8) return (int)value;
+    for (e = 3; e < 63 && (value >> (e + 1)); e++);
+    bucket = (e - 2) * 8 + (int)((value >> (e - 3)) & 7);
+    if (bucket >= SHELLSPAWN_HISTOGRAM_BUCKETS) bucket = SHELLSPAWN_HISTOGRAM_BUCKETS - 1;
+    return bucket;
+}
+
+// Lowest value counted in a histogram bucket
+static unsigned long long HistogramValue(int bucket) {
+    if (bucket < 8) return (unsigned long long)bucket;
+    return (unsigned long long)(bucket % 8 + 8) << (bucket / 8 - 1);
+}
+
+void Record(SHELLSPAWN_HISTOGRAM *histogram, unsigned long long value) {
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max) histogram->max = value;
+    histogram->buckets[HistogramBucket(value)]++;
+}
+
+void AddHistogram(SHELLSPAWN_HISTOGRAM *to, const SHELLSPAWN_HISTOGRAM *from) {
+    int i;
+
+    if (!from->count) return;
+    to->count += from->count;
+    to->sum += from->sum;
+    if (from->max > to->max) to->max = from->max;
+    for (i = 0; i < SHELLSPAWN_HISTOGRAM_BUCKETS; i++) to->buckets[i] += from->buckets[i];
+}
+
+static void AddPipeStats(SHELLSPAWN_PIPESTATS *to, const SHELLSPAWN_PIPESTATS *from) {
+    to->reads += from->reads;
+    to->fullReads += from->fullReads;
+    to->fullPipes += from->fullPipes;
+    to->blockedNs += from->blockedNs;
+    AddHistogram(&to->backlog, &from->backlog);
+    AddHistogram(&to->blocked, &from->blocked);
+}
+
+static void AddCallbackStats(SHELLSPAWN_CALLBACKSTATS *to, const SHELLSPAWN_CALLBACKSTATS *from) {
+    AddHistogram(&to->dispatch, &from->dispatch);
+    AddHistogram(&to->run, &from->run);
+}
+
+void AddStats(SHELLSPAWN_STATS *to, const SHELLSPAWN_STATS *from) {
+    int i;
+
+    to->spawns += from->spawns;
+    for (i = 0; i < SHELLSPAWN_RESULTS; i++) to->results[i] += from->results[i];
+    if (from->peakInFlight > to->peakInFlight) to->peakInFlight = from->peakInFlight;
+    AddHistogram(&to->spawnLatency, &from->spawnLatency);
+    AddHistogram(&to->duration, &from->duration);
+    AddPipeStats(&to->out, &from->out);
+    AddPipeStats(&to->err, &from->err);
+    AddCallbackStats(&to->inCallback, &from->inCallback);
+    AddCallbackStats(&to->outCallback, &from->outCallback);
+    AddCallbackStats(&to->errCallback, &from->errCallback);
+    to->callerCpuNs += from->callerCpuNs;
+    to->helperCpuNs += from->helperCpuNs;
+    to->inBytes += from->inBytes;
+    to->outBytes += from->outBytes;
+    to->errBytes += from->errBytes;
+    to->childUserUs += from->childUserUs;
+    to->childSystemUs += from->childSystemUs;
+    if (from->childMaxRssKB > to->childMaxRssKB) to->childMaxRssKB = from->childMaxRssKB;
+}
+
+void shellspawn_overhead(const SHELLSPAWN_STATS *stats,
+                         double *usPerSpawn, double *usPerMB) {
+    double cpuUs = (double)(stats->callerCpuNs + stats->helperCpuNs) / 1000.0;
+    double mb = (double)(stats->inBytes + stats->outBytes + stats->errBytes) / 1000000.0;
+
+    if (usPerSpawn) *usPerSpawn = stats->spawns ? cpuUs / (double)stats->spawns : 0.0;
+    if (usPerMB) *usPerMB = mb > 0.0 ? cpuUs / mb : 0.0;
+}
+
+unsigned long long shellspawn_percentile(const SHELLSPAWN_HISTOGRAM *histogram,
+                                         double percentile) {
+    unsigned long long target;
+    unsigned long long seen = 0;
+    int i;
+
+    if (!histogram->count) return 0;
+    target = (unsigned long long)(percentile / 100.0 * (double)histogram->count + 0.5);
+    if (target < 1) target = 1;
+    if (target > histogram->count) target = histogram->count;
+    for (i = 0; i < SHELLSPAWN_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= target) return HistogramValue(i);
+    }
+    return histogram->max;
+}
+
+void shellspawn_setstats(SHELLSPAWN_STATS *stats) {
+    threadStats = stats;
+}
+
+void shellspawn_totalstats(SHELLSPAWN_STATS *stats) {
+    pthread_mutex_lock(&totalStatsMutex);
+    memcpy(stats, &totalStats, sizeof(SHELLSPAWN_STATS));
+    pthread_mutex_unlock(&totalStatsMutex);
+}
+
+void shellspawn_resetstats(void) {
+    pthread_mutex_lock(&totalStatsMutex);
+    memset(&totalStats, 0, sizeof(SHELLSPAWN_STATS));
+    pthread_mutex_unlock(&totalStatsMutex);
+}
+
+// Text buffer for shellspawn_metrics() - counts the full length even when
+// the buffer is too small
+typedef struct metricstext {
+    char *buffer;
+    size_t size;
+    size_t length;
+} METRICSTEXT;
+
+static void MetricsPrint(METRICSTEXT *text, const char *format, ...) {
+    va_list args;
+    int n;
+    size_t space = text->length < text->size ? text->size - text->length : 0;
+
+    va_start(args, format);
+    n = vsnprintf(space ? text->buffer + text->length : NULL, space, format, args);
+    va_end(args);
+    if (n > 0) text->length += (size_t)n;
+}
+
+// Prints ns as seconds - using integers so that nothing is allocated
+static void MetricsSeconds(METRICSTEXT *text, unsigned long long ns) {
+    MetricsPrint(text, "%llu.%09llu", ns / 1000000000ULL, ns % 1000000000ULL);
+}
+
+// Prints a histogram. The log-linear buckets are reported at power of two
+// boundaries (from 2^first to 2^last) to keep the output bounded. A bucket
+// starting at 2^e also holds larger values, so the le (inclusive) bound for
+// the buckets below 2^e is 2^e - 1 - exact as the values are integers. If
+// seconds is set the histogram values are ns and are reported in seconds
+static void MetricsHistogram(METRICSTEXT *text, const char *name, const char *labels,
+                             const SHELLSPAWN_HISTOGRAM *histogram,
+                             int first, int last, int seconds) {
+    unsigned long long cumulative = 0;
+    int bucket = 0;
+    int e;
+    const char *separator = labels[0] ? "," : "";
+
+    for (e = first; e <= last; e++) {
+        // Buckets below 2^e
+        for (; bucket < SHELLSPAWN_HISTOGRAM_BUCKETS && HistogramValue(bucket) < (1ULL << e); bucket++)
+            cumulative += histogram->buckets[bucket];
+        MetricsPrint(text, "%s_bucket{%s%sle=\"", name, labels, separator);
+        if (seconds) MetricsSeconds(text, (1ULL << e) - 1);
+        else MetricsPrint(text, "%llu", (1ULL << e) - 1);
+        MetricsPrint(text, "\"} %llu\n", cumulative);
+    }
+    MetricsPrint(text, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, separator, histogram->count);
+    MetricsPrint(text, "%s_count%s%s%s %llu\n", name,
+                 labels[0] ? "{" : "", labels, labels[0] ? "}" : "", histogram->count);
+    MetricsPrint(text, "%s_sum%s%s%s ", name,
+                 labels[0] ? "{" : "", labels, labels[0] ? "}" : "");
+    if (seconds) MetricsSeconds(text, histogram->sum);
+    else MetricsPrint(text, "%llu", histogram->sum);
+    MetricsPrint(text, "\n");
+}
+
+size_t shellspawn_metrics(char *buffer, size_t size) {
+    static const char *resultNames[SHELLSPAWN_RESULTS] =
+            {"ok", "toomanyin", "toomanyout", "toomanyerr", "nofound", "failure", "timeout", "overflow"};
+    static const char *streamLabels[3] =
+            {"stream=\"stdin\"", "stream=\"stdout\"", "stream=\"stderr\""};
+    METRICSTEXT text;
+    SHELLSPAWN_STATS *stats = &totalStats;
+    int current;
+    int i;
+
+    text.buffer = buffer;
+    text.size = size;
+    text.length = 0;
+    if (size) buffer[0] = 0;
+
+    pthread_mutex_lock(&monitorsMutex);
+    current = inFlight;
+    pthread_mutex_unlock(&monitorsMutex);
+
+    pthread_mutex_lock(&totalStatsMutex);
+
+    MetricsPrint(&text, "# TYPE shellspawn_spawns counter\n"
+                        "# HELP shellspawn_spawns Completed shellspawn() calls.\n"
+                        "shellspawn_spawns_total %llu\n", stats->spawns);
+
+    MetricsPrint(&text, "# TYPE shellspawn_results counter\n"
+                        "# HELP shellspawn_results Completed shellspawn() calls by return code.\n");
+    for (i = 0; i < SHELLSPAWN_RESULTS; i++)
+        MetricsPrint(&text, "shellspawn_results_total{code=\"%d\",name=\"%s\"} %llu\n",
+                     i, resultNames[i], stats->results[i]);
+
+    MetricsPrint(&text, "# TYPE shellspawn_in_flight gauge\n"
+                        "# HELP shellspawn_in_flight shellspawn() calls in flight.\n"
+                        "shellspawn_in_flight %d\n"
+                        "# TYPE shellspawn_in_flight_peak gauge\n"
+                        "# HELP shellspawn_in_flight_peak Most shellspawn() calls in flight at once.\n"
+                        "shellspawn_in_flight_peak %llu\n", current, stats->peakInFlight);
+
+    MetricsPrint(&text, "# TYPE shellspawn_spawn_latency_seconds histogram\n"
+                        "# HELP shellspawn_spawn_latency_seconds Time from the call until the child started.\n");
+    MetricsHistogram(&text, "shellspawn_spawn_latency_seconds", "", &stats->spawnLatency, 14, 30, 1);
+
+    MetricsPrint(&text, "# TYPE shellspawn_duration_seconds histogram\n"
+                        "# HELP shellspawn_duration_seconds Time taken by the call.\n");
+    MetricsHistogram(&text, "shellspawn_duration_seconds", "", &stats->duration, 14, 36, 1);
+
+    MetricsPrint(&text, "# TYPE shellspawn_bytes counter\n"
+                        "# HELP shellspawn_bytes Bytes transferred to or from the children.\n"
+                        "shellspawn_bytes_total{%s} %llu\n"
+                        "shellspawn_bytes_total{%s} %llu\n"
+                        "shellspawn_bytes_total{%s} %llu\n",
+                 streamLabels[STREAM_IN], stats->inBytes,
+                 streamLabels[STREAM_OUT], stats->outBytes,
+                 streamLabels[STREAM_ERR], stats->errBytes);
+
+    MetricsPrint(&text, "# TYPE shellspawn_pipe_full_reads counter\n"
+                        "# HELP shellspawn_pipe_full_reads Reads that found the child's pipe full.\n"
+                        "shellspawn_pipe_full_reads_total{%s} %llu\n"
+                        "shellspawn_pipe_full_reads_total{%s} %llu\n",
+                 streamLabels[STREAM_OUT], stats->out.fullPipes,
+                 streamLabels[STREAM_ERR], stats->err.fullPipes);
+    MetricsPrint(&text, "# TYPE shellspawn_pipe_blocked_seconds counter\n"
+                        "# HELP shellspawn_pipe_blocked_seconds Estimated time children were blocked on a full pipe.\n"
+                        "shellspawn_pipe_blocked_seconds_total{%s} ", streamLabels[STREAM_OUT]);
+    MetricsSeconds(&text, stats->out.blockedNs);
+    MetricsPrint(&text, "\nshellspawn_pipe_blocked_seconds_total{%s} ", streamLabels[STREAM_ERR]);
+    MetricsSeconds(&text, stats->err.blockedNs);
+    MetricsPrint(&text, "\n");
+
+    MetricsPrint(&text, "# TYPE shellspawn_callback_dispatch_seconds histogram\n"
+                        "# HELP shellspawn_callback_dispatch_seconds Time from data arriving until the callback started.\n");
+    MetricsHistogram(&text, "shellspawn_callback_dispatch_seconds", streamLabels[STREAM_IN],
+                     &stats->inCallback.dispatch, 10, 30, 1);
+    MetricsHistogram(&text, "shellspawn_callback_dispatch_seconds", streamLabels[STREAM_OUT],
+                     &stats->outCallback.dispatch, 10, 30, 1);
+    MetricsHistogram(&text, "shellspawn_callback_dispatch_seconds", streamLabels[STREAM_ERR],
+                     &stats->errCallback.dispatch, 10, 30, 1);
+
+    MetricsPrint(&text, "# TYPE shellspawn_cpu_seconds counter\n"
+                        "# HELP shellspawn_cpu_seconds CPU used by shellspawn() itself.\n"
+                        "shellspawn_cpu_seconds_total{thread=\"caller\"} ");
+    MetricsSeconds(&text, stats->callerCpuNs);
+    MetricsPrint(&text, "\nshellspawn_cpu_seconds_total{thread=\"helper\"} ");
+    MetricsSeconds(&text, stats->helperCpuNs);
+    MetricsPrint(&text, "\n# TYPE shellspawn_child_cpu_seconds counter\n"
+                        "# HELP shellspawn_child_cpu_seconds CPU used by the children.\n"
+                        "shellspawn_child_cpu_seconds_total{mode=\"user\"} ");
+    MetricsSeconds(&text, stats->childUserUs * 1000ULL);
+    MetricsPrint(&text, "\nshellspawn_child_cpu_seconds_total{mode=\"system\"} ");
+    MetricsSeconds(&text, stats->childSystemUs * 1000ULL);
+    MetricsPrint(&text, "\n# EOF\n");
+
+    pthread_mutex_unlock(&totalStatsMutex);
+
+    return text.length;
+}
+
+// Runs the command - attr must have been prepared. spawnContext (if not NULL)
+// provides the buffers and synchronisation objects
+int Spawn(SHELLSPAWN_CONTEXT* spawnContext,
+          const char *command,
+          const SHELLSPAWN_ATTR *attr,
+          int *rc,
+          char **errorText,
+          void* context,
+          SPAWNMONITOR* monitor) {
 // Create data structure - and make sure we make all the members empty
     SHELLDATA data;
     data.inThreadRC = 0;
@@ -206,7 +1437,11 @@ int shellspawn (const char *command,
     data.callbackRequestedMutex = NULL;
     data.callbackHandledMutex = NULL;
     data.callbackType = 0;
+    data.callbackStream = 0;
+    data.callbackArrivalTime = 0;
     data.callbackOutputHandler = NULL;
+    data.callbackDataHandler = NULL;
+    data.callbackLength = 0;
     data.callbackBuffer = NULL;
     data.callbackRC = 0;
     data.context = context;
@@ -215,91 +1450,132 @@ int shellspawn (const char *command,
     data.proxySendRead = -1;
     data.proxyReceiveWrite = -1;
     data.proxyPID = 0;
-    data.buffer = 0;
-    data.file_path = 0;
-    data.argv = 0;
-
-/* Input/Output vectors */
-    data.aInput = aIn;
-    data.aOutput = aOut;
-    data.aError = aErr;
-    data.sInput = sIn;
-    data.sOutput = sOut;
-    data.sError = sErr;
-    data.fInput = fIn;
-    data.fOutput = fOut;
-    data.fError = fErr;
-
-// Validate inputs
-    if ((aIn ? 1 : 0) + (sIn ? 1 : 0) + (fIn ? 1 : 0) + (pIn ? 1 : 0) > 1) {
-        setTextOutput(errorText,
-                      "More than one of vIn, sIn, fIn or pIn specified");
-        return SHELLSPAWN_TOOMANYIN;
-    }
-    if ((aOut ? 1 : 0) + (sOut ? 1 : 0) + (fOut ? 1 : 0) + (pOut ? 1 : 0) > 1) {
-        setTextOutput(errorText,
-                      "More than one of vOut, sOut, fOut or pOut specified");
-        return SHELLSPAWN_TOOMANYOUT;
-    }
-    if ((aErr ? 1 : 0) + (sErr ? 1 : 0) + (fErr ? 1 : 0) + (pErr ? 1 : 0) > 1) {
-        setTextOutput(errorText,
-                      "More than one of vErr, sErr, fErr or pErr specified");
-        return SHELLSPAWN_TOOMANYERR;
-    }
-
-    // Clear any output strings
+    data.monitor = monitor;
+    data.spawnContext = spawnContext;
+    data.allocator = threadAllocator;
+    ArenaInit(&data.arena);
+    data.readBuffer[STREAM_OUT] = NULL;
+    data.readBuffer[STREAM_ERR] = NULL;
+    data.linesTruncated[STREAM_OUT] = 0;
+    data.linesTruncated[STREAM_ERR] = 0;
+    if (spawnContext) {
+        // Buffers from another allocator are not reused
+        if (spawnContext->bufferAllocator != data.allocator) {
+            FreeContextBuffers(spawnContext);
+            spawnContext->bufferAllocator = data.allocator;
+        }
+        // Borrow the context's buffers - FreeBuffers() gives them back
+        data.buffer = spawnContext->buffer;
+        data.bufferSize = spawnContext->bufferSize;
+        data.file_path = spawnContext->file_path;
+        data.filePathSize = spawnContext->filePathSize;
+        data.argv = spawnContext->argv;
+        data.argvSize = spawnContext->argvSize;
+    } else {
+        data.buffer = 0;
+        data.bufferSize = 0;
+        data.file_path = 0;
+        data.filePathSize = 0;
+        data.argv = 0;
+        data.argvSize = 0;
+    }
+    data.attr = attr;
+    data.hTimeoutThread = 0;
+    data.exitedMutex = NULL;
+    data.exitedCondition = NULL;
+    data.exited = 0;
+    data.timedOut = 0;
+
+/* Input/Output vectors (validated by shellspawn_attr_prepare()) */
+    data.aInput = attr->aIn;
+    data.aOutput = attr->aOut;
+    data.aError = attr->aErr;
+    data.sInput = attr->sIn;
+    data.sOutput = attr->sOut;
+    data.sError = attr->sErr;
+    data.sOutputLength = attr->sOutLength;
+    data.sErrorLength = attr->sErrLength;
+    data.fInput = attr->fIn;
+    data.fOutput = attr->fOut;
+    data.fError = attr->fErr;
+    data.bOutput = attr->bOut;
+    data.bError = attr->bErr;
+    data.dOutput = attr->dOut;
+    data.dError = attr->dErr;
+
+    // Clear any output strings (and caller's buffers)
+    ClearBuffer(data.bOutput);
+    ClearBuffer(data.bError);
     if (data.aOutput && *data.aOutput) {
-        free(*data.aOutput);
+        Free(*data.aOutput);
         *data.aOutput = 0;
     }
     if (data.aError && *data.aError) {
-        free(*data.aError);
+        Free(*data.aError);
         *data.aError = 0;
     }
     if (data.sOutput && *data.sOutput) {
-        free(*data.sOutput);
+        Free(*data.sOutput);
         *data.sOutput = 0;
     }
     if (data.sError && *data.sError) {
-        free(*data.sError);
+        Free(*data.sError);
         *data.sError = 0;
     }
+    if (data.sOutputLength) *data.sOutputLength = 0;
+    if (data.sErrorLength) *data.sErrorLength = 0;
 
     // Do we need the event handlers i.e. Have we any callbacks ...
-    if ((fIn ? 1 : 0) + (fOut ? 1 : 0) + (fErr ? 1 : 0) > 0) {
-        data.callbackRequested = malloc(sizeof(pthread_cond_t));
-        if (pthread_cond_init(data.callbackRequested, NULL)) {
+    if (attr->callbacks && spawnContext) {
+        // The context's are set up once and reused
+        if (InitContextSync(spawnContext, errorText)) {
+            CleanUp(&data);
+            return SHELLSPAWN_FAILURE;
+        }
+        data.callbackRequested = &spawnContext->callbackRequested;
+        data.callbackRequestedMutex = &spawnContext->callbackRequestedMutex;
+        data.callbackHandled = &spawnContext->callbackHandled;
+        data.callbackHandledMutex = &spawnContext->callbackHandledMutex;
+        data.criticalsection = &spawnContext->criticalsection;
+    } else if (attr->callbacks) {
+        data.callbackRequested = ArenaAlloc(&data.arena, sizeof(pthread_cond_t));
+        if (!data.callbackRequested || pthread_cond_init(data.callbackRequested, NULL)) {
+            data.callbackRequested = NULL;
             Error("Failure U5 in pthread_cond_init(callbackRequested) in shellspawn()",
                   errorText);
             CleanUp(&data);
             return SHELLSPAWN_FAILURE;
         }
 
-        data.callbackRequestedMutex = malloc(sizeof(pthread_mutex_t));
-        if (pthread_mutex_init(data.callbackRequestedMutex, NULL)) {
+        data.callbackRequestedMutex = ArenaAlloc(&data.arena, sizeof(pthread_mutex_t));
+        if (!data.callbackRequestedMutex || pthread_mutex_init(data.callbackRequestedMutex, NULL)) {
+            data.callbackRequestedMutex = NULL;
             Error("Failure U6 in pthread_mutex_init(data.callbackRequestedMutex) in shellspawn()",
                   errorText);
             CleanUp(&data);
             return SHELLSPAWN_FAILURE;
         }
 
-        data.callbackHandled = malloc(sizeof(pthread_cond_t));
-        if (pthread_cond_init(data.callbackHandled, NULL)) {
+        data.callbackHandled = ArenaAlloc(&data.arena, sizeof(pthread_cond_t));
+        if (!data.callbackHandled || pthread_cond_init(data.callbackHandled, NULL)) {
+            data.callbackHandled = NULL;
             Error("Failure U7 in pthread_cond_init(callbackHandled) in shellspawn()",
                   errorText);
             CleanUp(&data);
             return SHELLSPAWN_FAILURE;
         }
 
-        data.callbackHandledMutex = malloc(sizeof(pthread_mutex_t));
-        if (pthread_mutex_init(data.callbackHandledMutex, NULL)) {
+        data.callbackHandledMutex = ArenaAlloc(&data.arena, sizeof(pthread_mutex_t));
+        if (!data.callbackHandledMutex || pthread_mutex_init(data.callbackHandledMutex, NULL)) {
+            data.callbackHandledMutex = NULL;
             Error("Failure U8 in pthread_mutex_init(data.callbackHandledMutex) in shellspawn()",
                   errorText);
             CleanUp(&data);
             return SHELLSPAWN_FAILURE;
         }
-        data.criticalsection = malloc(sizeof(pthread_mutex_t));
-        if (pthread_mutex_init(data.criticalsection, NULL)) {
+        data.criticalsection = ArenaAlloc(&data.arena, sizeof(pthread_mutex_t));
+        if (!data.criticalsection || pthread_mutex_init(data.criticalsection, NULL)) {
+            data.criticalsection = NULL;
             Error("Failure U9 in pthread_mutex_init(data.criticalsection) in shellspawn()",
                   errorText);
             CleanUp(&data);
@@ -308,9 +1584,9 @@ int shellspawn (const char *command,
     }
 
     // Create the output pipe and handles
-    if (pOut) {
+    if (attr->pOut) {
         // We have been given a FILE* stream so we want to make a file descriptor
-        data.hOutputFile = fileno(pOut);
+        data.hOutputFile = fileno(attr->pOut);
     } else {
         // We Create a pipe
         int temppipe[2];    // This holds the fd for the input & output of the pipe ([0] for reading, [1] for writing)
@@ -323,9 +1599,9 @@ int shellspawn (const char *command,
         data.hOutputWrite = temppipe[1];
     }
 // Create the standard error output pipe and handles
-    if (pErr) {
+    if (attr->pErr) {
 // We have been given a FILE* stream so we want to make a file descriptor
-        data.hErrorFile = fileno(pErr);
+        data.hErrorFile = fileno(attr->pErr);
     } else {
         // We Create a pipe
         int temppipe[2];    // This holds the fd for the input & output of the pipe ([0] for reading, [1] for writing)
@@ -339,10 +1615,10 @@ int shellspawn (const char *command,
     }
 
     // Create the child input pipe.
-    if (pIn) {
+    if (attr->pIn) {
         // We have been given a FILE* stream so we want to make a file descriptor
-        data.hInputFile = fileno(pIn);
-    } else if (fIn) {
+        data.hInputFile = fileno(attr->pIn);
+    } else if (attr->fIn) {
         // We have been given a function callback we need to create a Pseudo-Terminal Pair ....
 #ifdef __APPLE__
         data.hInputWrite = posix_openpt(O_RDWR);
@@ -399,49 +1675,14 @@ int shellspawn (const char *command,
         data.hInputWrite = temppipe[1];
     }
 
-    // Parse the command
-    char *base_name;
-    int i;
-    int commandFound = 0;
-    if (ParseCommand(command, &data.buffer, &base_name, &data.argv)) {
-        Error("Failure U18 in ParseCommand() in shellspawn()", errorText);
-        CleanUp(&data);
-        return SHELLSPAWN_NOFOUND;
-    }
-
-    if (ExeFound(base_name)) {
-        data.file_path = malloc(sizeof(char) * strlen(base_name) + 1);
-        strcpy(data.file_path, base_name);
-        commandFound = 1;
-    } else if (base_name[0] != '/') {
-        // Get PATH environment variable so we can find the exe
-        const char *env = getenv("PATH");
-        if (env) data.file_path = malloc(sizeof(char) * (strlen(env) + strlen(base_name) + 2)); // Make a buffer big enough
-        while (env && *env != ':') {
-            for (i = 0; (data.file_path[i] = *env); i++, env++) {
-                if (*env == ':') {
-                    data.file_path[i] = 0;
-                    break;
-                }
-            }
-
-            strcat(data.file_path, "/");
-            strcat(data.file_path, base_name);
-
-            if (ExeFound(data.file_path)) {
-                commandFound = 1;
-                break;
-            }
-        }
-    }
-
-    if (!commandFound) {
-        setTextOutput(errorText, "Failure U19 in shellspawn() - Command not found");
+    // Parse the command and find the executable
+    int found = FindCommand(&data, command, errorText);
+    if (found != SHELLSPAWN_OK) {
         CleanUp(&data);
-        return SHELLSPAWN_NOFOUND;
+        return found;
     }
 
-    if (fIn) // We need to create a proxy pseudo shell and launch the child process
+    if (attr->fIn) // We need to create a proxy pseudo shell and launch the child process
     {
         if ((data.proxyPID = fork()) == -1) {
             Error("Failure U22 in fork() in shellspawn()", errorText);
@@ -586,11 +1827,53 @@ int shellspawn (const char *command,
         }
         if (data.ChildProcessPID == 0) // Child Process
         {
+            // Make this process its own process group - so that a timeout or
+            // clean up kills anything it starts that holds the pipes open too
+            setpgid(0, 0); // Note: Ignore error conditions as one or other of these will fail (see below)
             launchChild(&data);
         }
+
+        // Make the child process its own process group - done here too to avoid any race
+        setpgid(data.ChildProcessPID, data.ChildProcessPID);
     }
 
 // We're the Parent Process ...
+    Record(&monitor->stats.spawnLatency, Now() - monitor->startTime);
+    ATOMIC_STORE(&monitor->pid, data.ChildProcessPID);
+    ATOMIC_STORE(&monitor->state, SHELLSPAWN_STATE_RUNNING);
+
+// Start the timeout thread (if needed) which kills the child if it runs too long
+    if (attr->timeoutMs && spawnContext) {
+        if (InitContextSync(spawnContext, errorText)) {
+            CleanUp(&data);
+            return SHELLSPAWN_FAILURE;
+        }
+        data.exitedMutex = &spawnContext->exitedMutex;
+        data.exitedCondition = &spawnContext->exitedCondition;
+    } else if (attr->timeoutMs) {
+        data.exitedMutex = ArenaAlloc(&data.arena, sizeof(pthread_mutex_t));
+        if (!data.exitedMutex || pthread_mutex_init(data.exitedMutex, NULL)) {
+            data.exitedMutex = NULL;
+            Error("Failure U86 in pthread_mutex_init(exitedMutex) in shellspawn()", errorText);
+            CleanUp(&data);
+            return SHELLSPAWN_FAILURE;
+        }
+        data.exitedCondition = ArenaAlloc(&data.arena, sizeof(pthread_cond_t));
+        if (!data.exitedCondition || pthread_cond_init(data.exitedCondition, NULL)) {
+            data.exitedCondition = NULL;
+            Error("Failure U87 in pthread_cond_init(exitedCondition) in shellspawn()", errorText);
+            CleanUp(&data);
+            return SHELLSPAWN_FAILURE;
+        }
+    }
+    if (attr->timeoutMs) {
+        if (pthread_create(&(data.hTimeoutThread), NULL, TimeoutThread, (void *) &data)) {
+            data.hTimeoutThread = 0;
+            Error("Failure U88 in pthread_create(TimeoutThread) in shellspawn()", errorText);
+            CleanUp(&data);
+            return SHELLSPAWN_FAILURE;
+        }
+    }
 
 // Close the child ends of any pipes
     if (data.hOutputFile == -1) {
@@ -606,6 +1889,14 @@ int shellspawn (const char *command,
         data.hErrorWrite = -1;
     }
 
+// The output threads' read buffers - set up here as the threads share the arena
+    if ((data.hOutputFile == -1 && !(data.readBuffer[STREAM_OUT] = ReadBuffer(&data, STREAM_OUT))) ||
+        (data.hErrorFile == -1 && !(data.readBuffer[STREAM_ERR] = ReadBuffer(&data, STREAM_ERR)))) {
+        Error("Failure U90 in malloc(read buffer) in shellspawn()", errorText);
+        CleanUp(&data);
+        return SHELLSPAWN_FAILURE;
+    }
+
 // If we have callbacks lock the cond mutex before starting the threads - in case they try to signal before we start waiting
     if (data.callbackRequested) {
         pthread_mutex_lock(data.callbackRequestedMutex);
@@ -687,6 +1978,9 @@ int shellspawn (const char *command,
         WaitForProcess(
                 &data); // no callback handlers - so we just wait for the process and input/output threads to exit
 
+// The child has exited - stop the timeout thread
+    StopTimeout(&data);
+
 // Handle any waitThread errors
     if (data.waitThreadRC) {
         appendTextOutput(errorText,data.waitThreadErrorText);
@@ -713,30 +2007,13 @@ int shellspawn (const char *command,
     }
 // Note that hInputWrite closed in HandleInputThread() below
 
-    if (data.callbackRequested) {
-        pthread_cond_destroy(data.callbackRequested);
-        free(data.callbackRequested);
-        data.callbackRequested = NULL;
-
-        pthread_mutex_destroy(data.callbackRequestedMutex);
-        free(data.callbackRequestedMutex);
-        data.callbackRequestedMutex = NULL;
-    }
-
-    if (data.callbackHandled) {
-        pthread_cond_destroy(data.callbackHandled);
-        free(data.callbackHandled);
-        data.callbackHandled = NULL;
-
-        pthread_mutex_destroy(data.callbackHandledMutex);
-        free(data.callbackHandledMutex);
-        data.callbackHandledMutex = NULL;
-    }
+    FreeSync(&data, 0);
+    FreeBuffers(&data);
+    ArenaRelease(&data.arena); // Nothing below uses it
 
-    if (data.criticalsection) {
-        pthread_mutex_destroy(data.criticalsection);
-        free(data.criticalsection);
-        data.criticalsection = NULL;
+    if (data.timedOut) {
+        setTextOutput(errorText, "Failure U89 in shellspawn() - Command timed out and was killed");
+        return SHELLSPAWN_TIMEOUT;
     }
 
 /* Check for errors set by threads */
@@ -755,69 +2032,292 @@ int shellspawn (const char *command,
 
     *rc = (int) data.ChildProcessRC;
 
+    if (Overflowed(data.bOutput) || Overflowed(data.bError)) {
+        setTextOutput(errorText, "Failure U105 in shellspawn() - Output did not fit in the caller's buffer");
+        return SHELLSPAWN_OVERFLOW;
+    }
+    if (attr->lines.overflow == SHELLSPAWN_OVERFLOW_FAIL &&
+        (data.linesTruncated[STREAM_OUT] || data.linesTruncated[STREAM_ERR])) {
+        setTextOutput(errorText, "Failure U106 in shellspawn() - A line was longer than attr.lines.maxLength");
+        return SHELLSPAWN_OVERFLOW;
+    }
+
     return SHELLSPAWN_OK;
 }
 
 void CleanUp(SHELLDATA* data)
 {
+    StopTimeout(data);
     if (data->ChildProcessPID) kill(-data->ChildProcessPID,15); // 15=TERM, 9=KILL
     if (data->hInThread) pthread_cancel(data->hInThread);
     if (data->hOutThread) pthread_cancel(data->hOutThread);
     if (data->hErrThread) pthread_cancel(data->hErrThread);
     if (data->hWaitThread) pthread_cancel(data->hWaitThread);
 
-    if (data->hOutputRead != -1) close(data->hOutputRead);
-    if (data->hOutputWrite != -1) close(data->hOutputWrite);
-    if (data->hErrorRead != -1) close(data->hErrorRead);
-    if (data->hErrorWrite != -1) close(data->hErrorWrite);
-    if (data->hInputRead != -1) close(data->hInputRead);
-    if (data->hInputWrite != -1) close(data->hInputWrite);
-    if (data->callbackRequested)
-    {
+    if (data->hOutputRead != -1) close(data->hOutputRead);
+    if (data->hOutputWrite != -1) close(data->hOutputWrite);
+    if (data->hErrorRead != -1) close(data->hErrorRead);
+    if (data->hErrorWrite != -1) close(data->hErrorWrite);
+    if (data->hInputRead != -1) close(data->hInputRead);
+    if (data->hInputWrite != -1) close(data->hInputWrite);
+    FreeSync(data, 1);
+    data->callbackType = 0;
+    data->callbackOutputHandler = NULL;
+    data->callbackDataHandler = NULL;
+    data->callbackBuffer = NULL;
+    data->callbackRC = 0;
+    if (data->proxySend != -1) close(data->proxySend);
+    if (data->proxyReceive != -1) close(data->proxyReceive);
+    if (data->proxySendRead != -1) close(data->proxySendRead);
+    if (data->proxyReceiveWrite != -1) close(data->proxyReceiveWrite);
+    if (data->proxyPID) kill(data->proxyPID,9); // 15=TERM, 9=KILL
+    FreeBuffers(data);
+    data->readBuffer[STREAM_OUT] = NULL;
+    data->readBuffer[STREAM_ERR] = NULL;
+    ArenaRelease(&data->arena);
+}
+
+// Sets up the spawn context's synchronisation objects (the first time)
+int InitContextSync(SHELLSPAWN_CONTEXT* spawnContext, char **errorText)
+{
+    if (spawnContext->syncReady) return 0;
+
+    if (pthread_cond_init(&spawnContext->callbackRequested, NULL)) {
+        Error("Failure U5 in pthread_cond_init(callbackRequested) in shellspawn()", errorText);
+        return -1;
+    }
+    if (pthread_mutex_init(&spawnContext->callbackRequestedMutex, NULL)) {
+        pthread_cond_destroy(&spawnContext->callbackRequested);
+        Error("Failure U6 in pthread_mutex_init(data.callbackRequestedMutex) in shellspawn()", errorText);
+        return -1;
+    }
+    if (pthread_cond_init(&spawnContext->callbackHandled, NULL)) {
+        pthread_cond_destroy(&spawnContext->callbackRequested);
+        pthread_mutex_destroy(&spawnContext->callbackRequestedMutex);
+        Error("Failure U7 in pthread_cond_init(callbackHandled) in shellspawn()", errorText);
+        return -1;
+    }
+    if (pthread_mutex_init(&spawnContext->callbackHandledMutex, NULL)) {
+        pthread_cond_destroy(&spawnContext->callbackRequested);
+        pthread_mutex_destroy(&spawnContext->callbackRequestedMutex);
+        pthread_cond_destroy(&spawnContext->callbackHandled);
+        Error("Failure U8 in pthread_mutex_init(data.callbackHandledMutex) in shellspawn()", errorText);
+        return -1;
+    }
+    if (pthread_mutex_init(&spawnContext->criticalsection, NULL)) {
+        pthread_cond_destroy(&spawnContext->callbackRequested);
+        pthread_mutex_destroy(&spawnContext->callbackRequestedMutex);
+        pthread_cond_destroy(&spawnContext->callbackHandled);
+        pthread_mutex_destroy(&spawnContext->callbackHandledMutex);
+        Error("Failure U9 in pthread_mutex_init(data.criticalsection) in shellspawn()", errorText);
+        return -1;
+    }
+    if (pthread_mutex_init(&spawnContext->exitedMutex, NULL)) {
+        pthread_cond_destroy(&spawnContext->callbackRequested);
+        pthread_mutex_destroy(&spawnContext->callbackRequestedMutex);
+        pthread_cond_destroy(&spawnContext->callbackHandled);
+        pthread_mutex_destroy(&spawnContext->callbackHandledMutex);
+        pthread_mutex_destroy(&spawnContext->criticalsection);
+        Error("Failure U86 in pthread_mutex_init(exitedMutex) in shellspawn()", errorText);
+        return -1;
+    }
+    if (pthread_cond_init(&spawnContext->exitedCondition, NULL)) {
+        pthread_cond_destroy(&spawnContext->callbackRequested);
+        pthread_mutex_destroy(&spawnContext->callbackRequestedMutex);
+        pthread_cond_destroy(&spawnContext->callbackHandled);
+        pthread_mutex_destroy(&spawnContext->callbackHandledMutex);
+        pthread_mutex_destroy(&spawnContext->criticalsection);
+        pthread_mutex_destroy(&spawnContext->exitedMutex);
+        Error("Failure U87 in pthread_cond_init(exitedCondition) in shellspawn()", errorText);
+        return -1;
+    }
+
+    spawnContext->syncReady = 1;
+    return 0;
+}
+
+// Destroys the spawn's synchronisation objects (their memory is the arena's). A spawn context's
+// are kept for the next spawn - unless error is set (as the threads may have
+// been cancelled while holding them) when they are destroyed and so set up
+// again next time
+void FreeSync(SHELLDATA* data, int error)
+{
+    SHELLSPAWN_CONTEXT* spawnContext = data->spawnContext;
+
+    if (spawnContext) {
+        if (error && spawnContext->syncReady) {
+            pthread_mutex_destroy(&spawnContext->criticalsection);
+            pthread_cond_destroy(&spawnContext->callbackRequested);
+            pthread_cond_destroy(&spawnContext->callbackHandled);
+            pthread_mutex_destroy(&spawnContext->callbackRequestedMutex);
+            pthread_mutex_destroy(&spawnContext->callbackHandledMutex);
+            pthread_mutex_destroy(&spawnContext->exitedMutex);
+            pthread_cond_destroy(&spawnContext->exitedCondition);
+            spawnContext->syncReady = 0;
+        }
+        data->callbackRequested = NULL;
+        data->callbackRequestedMutex = NULL;
+        data->callbackHandled = NULL;
+        data->callbackHandledMutex = NULL;
+        data->criticalsection = NULL;
+        data->exitedMutex = NULL;
+        data->exitedCondition = NULL;
+        return;
+    }
+
+    if (data->callbackRequested) {
         pthread_cond_destroy(data->callbackRequested);
-        free(data->callbackRequested);
         data->callbackRequested = NULL;
+    }
+    if (data->callbackRequestedMutex) {
         pthread_mutex_destroy(data->callbackRequestedMutex);
-        free(data->callbackRequestedMutex);
         data->callbackRequestedMutex = NULL;
     }
-    if (data->callbackHandled)
-    {
+    if (data->callbackHandled) {
         pthread_cond_destroy(data->callbackHandled);
-        free(data->callbackHandled);
         data->callbackHandled = NULL;
+    }
+    if (data->callbackHandledMutex) {
         pthread_mutex_destroy(data->callbackHandledMutex);
-        free(data->callbackHandledMutex);
         data->callbackHandledMutex = NULL;
     }
-    if (data->criticalsection)
-    {
+    if (data->criticalsection) {
         pthread_mutex_destroy(data->criticalsection);
-        free(data->criticalsection);
         data->criticalsection = NULL;
     }
-    data->callbackType = 0;
-    data->callbackOutputHandler = NULL;
-    data->callbackBuffer = NULL;
-    data->callbackRC = 0;
-    if (data->proxySend != -1) close(data->proxySend);
-    if (data->proxyReceive != -1) close(data->proxyReceive);
-    if (data->proxySendRead != -1) close(data->proxySendRead);
-    if (data->proxyReceiveWrite != -1) close(data->proxyReceiveWrite);
-    if (data->proxyPID) kill(data->proxyPID,9); // 15=TERM, 9=KILL
-    if (data->buffer) free(data->buffer);
-    if (data->argv) free(data->argv);
-    if (data->file_path) free(data->file_path);
+    if (data->exitedCondition) {
+        pthread_cond_destroy(data->exitedCondition);
+        data->exitedCondition = NULL;
+    }
+    if (data->exitedMutex) {
+        pthread_mutex_destroy(data->exitedMutex);
+        data->exitedMutex = NULL;
+    }
+}
+
+// Drops the parsed command (its memory is the arena's) - or gives the buffers
+// back to the spawn context
+void FreeBuffers(SHELLDATA* data)
+{
+    SHELLSPAWN_CONTEXT* spawnContext = data->spawnContext;
+
+    if (spawnContext) {
+        spawnContext->buffer = data->buffer;
+        spawnContext->bufferSize = data->bufferSize;
+        spawnContext->argv = data->argv;
+        spawnContext->argvSize = data->argvSize;
+        spawnContext->file_path = data->file_path;
+        spawnContext->filePathSize = data->filePathSize;
+    }
+    data->buffer = 0;
+    data->bufferSize = 0;
+    data->argv = 0;
+    data->argvSize = 0;
+    data->file_path = 0;
+    data->filePathSize = 0;
+}
+
+// Makes sure that the buffer (of size bytes) holds at least needed bytes -
+// growing (reallocating) it if not. Returns non-zero if out of memory (the
+// buffer is then left as it was)
+int Reserve(void **buffer, size_t *size, size_t needed)
+{
+    void *grown;
+
+    if (*buffer && *size >= needed) return 0;
+    grown = Realloc(*buffer, needed);
+    if (!grown) return -1;
+    *buffer = grown;
+    *size = needed;
+    return 0;
+}
+
+// Empties the arena (to just its first block)
+void ArenaInit(SPAWNARENA* arena)
+{
+    arena->next = arena->first.bytes;
+    arena->left = ARENA_FIRST_BLOCK;
+    arena->blocks = NULL;
+}
+
+// Allocates size bytes (aligned for any type) from the arena - NULL if out of
+// memory. There is no free, it is all released by ArenaRelease()
+void* ArenaAlloc(SPAWNARENA* arena, size_t size)
+{
+    void *block;
+    size_t blockSize;
+    char *allocated;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (size > arena->left) { // A new block - the rest of the current one is left
+        blockSize = size + ARENA_ALIGN > ARENA_BLOCK ? size + ARENA_ALIGN : ARENA_BLOCK;
+        block = Alloc(blockSize);
+        if (!block) return NULL;
+        *(void**)block = arena->blocks;
+        arena->blocks = block;
+        arena->next = (char*)block + ARENA_ALIGN;
+        arena->left = blockSize - ARENA_ALIGN;
+    }
+    allocated = arena->next;
+    arena->next += size;
+    arena->left -= size;
+    return allocated;
+}
+
+// As Reserve() but a buffer that is too small is replaced (not grown, so its
+// contents are lost) with one from the arena. If arena is NULL the buffer is
+// not the arena's and is grown by Reserve()
+int ArenaReserve(SPAWNARENA* arena, void **buffer, size_t *size, size_t needed)
+{
+    void *replaced;
+
+    if (!arena) return Reserve(buffer, size, needed);
+    if (*buffer && *size >= needed) return 0;
+    replaced = ArenaAlloc(arena, needed);
+    if (!replaced) return -1;
+    *buffer = replaced;
+    *size = needed;
+    return 0;
+}
+
+// Frees the arena's blocks - everything allocated from it goes
+void ArenaRelease(SPAWNARENA* arena)
+{
+    void *block;
+
+    while ((block = arena->blocks)) {
+        arena->blocks = *(void**)block;
+        Free(block);
+    }
+    ArenaInit(arena);
+}
+
+// The read buffer for the child's stdout or stderr - readBufferSize bytes and
+// one for a trailing null. A spawn context keeps a buffer for each stream,
+// otherwise it comes from the arena. NULL if out of memory
+char* ReadBuffer(SHELLDATA* data, int stream)
+{
+    SHELLSPAWN_CONTEXT* spawnContext = data->spawnContext;
+    size_t needed = data->attr->readBufferSize + 1;
+
+    if (!spawnContext) return ArenaAlloc(&data->arena, needed);
+    if (Reserve((void**)&spawnContext->readBuffer[stream], &spawnContext->readBufferSize[stream], needed))
+        return NULL;
+    return spawnContext->readBuffer[stream];
 }
 
 /* Procedure - running in the main thread - to call the caller's callback handlers */
 int HandleCallback(SHELLDATA* data, char **errorText) {
     INHANDLER inFunc;
     OUTHANDLER outFunc;
+    SHELLSPAWN_CALLBACKSTATS *callbackStats = CallbackStats(&data->monitor->stats, data->callbackStream);
+    unsigned long long cpuStart = ThreadCpuTime();
+    unsigned long long start = Now();
+
     switch (data->callbackType) {
         case 1: // Stdin
             if (data->callbackBuffer) {
-                free(data->callbackBuffer);
+                Free(data->callbackBuffer);
                 data->callbackBuffer = NULL;
             }
             inFunc = data->fInput;
@@ -825,12 +2325,14 @@ int HandleCallback(SHELLDATA* data, char **errorText) {
             break;
 
         case 2: // Stdout or StdErr
-            outFunc = data->callbackOutputHandler;
-            outFunc((data->callbackBuffer), data->context);
-            if (data->callbackBuffer) {
-                free(data->callbackBuffer);
-                data->callbackBuffer = NULL;
+            // The output thread's read buffer
+            if (data->callbackDataHandler)
+                data->callbackDataHandler(data->callbackBuffer, data->callbackLength, data->context);
+            else {
+                outFunc = data->callbackOutputHandler;
+                outFunc((data->callbackBuffer), data->context);
             }
+            data->callbackBuffer = NULL;
             break;
 
         default:
@@ -840,9 +2342,15 @@ int HandleCallback(SHELLDATA* data, char **errorText) {
             return -1;
     }
 
+// Record the cross thread dispatch latency and the callback's run time
+    Record(&callbackStats->dispatch, start > data->callbackArrivalTime ? start - data->callbackArrivalTime : 0);
+    Record(&callbackStats->run, Now() - start);
+    data->monitor->callbackCpuTime += ThreadCpuTime() - cpuStart;
+
 // Cleanup
     data->callbackType = 0;
     data->callbackOutputHandler = NULL;
+    data->callbackDataHandler = NULL;
 
 // Signal the in, out or err thread that the callback has been handled
     if (pthread_mutex_lock(data->callbackHandledMutex)) {
@@ -870,7 +2378,9 @@ int HandleCallback(SHELLDATA* data, char **errorText) {
 void* WaitForProcessThread(void* pThreadParam)
 {
     SHELLDATA* data = (SHELLDATA*)pThreadParam;
+    UseAllocator(data->allocator);
     WaitForProcess(data);
+    ATOMIC_ADD(&data->monitor->stats.helperCpuNs, ThreadCpuTime());
 
     // Fire callbackrequested type -1 to indicate that the child process and all the threads are done
     pthread_mutex_lock(data->callbackRequestedMutex);
@@ -886,6 +2396,7 @@ void WaitForProcess(SHELLDATA* data)
 {
     pid_t w;
     int status;
+    struct rusage usage;
 
     // Wait for child process to exit
     int pid;
@@ -893,20 +2404,36 @@ void WaitForProcess(SHELLDATA* data)
     else pid = data->ChildProcessPID;
 
     do {
-        w = waitpid(pid, &status, WUNTRACED | WCONTINUED);
+        w = wait4(pid, &status, WUNTRACED | WCONTINUED, &usage);
         if (w == -1)
         {
             data->waitThreadRC = 1;
             Error("Failure U43 in waitpid() in WaitForProcess()", &data->waitThreadErrorText);
             return;
         }
+        if (WIFSTOPPED(status)) ATOMIC_STORE(&data->monitor->state, SHELLSPAWN_STATE_STOPPED);
+        else if (WIFCONTINUED(status)) ATOMIC_STORE(&data->monitor->state, SHELLSPAWN_STATE_RUNNING);
     } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+    ATOMIC_STORE(&data->monitor->state, SHELLSPAWN_STATE_EXITED);
+
+    // Tell the timeout thread (if any) not to kill the child now
+    if (data->exitedMutex) {
+        pthread_mutex_lock(data->exitedMutex);
+        data->exited = 1;
+        pthread_cond_signal(data->exitedCondition);
+        pthread_mutex_unlock(data->exitedMutex);
+    }
     data->ChildProcessPID = 0;
     data->proxyPID = 0;
 
     // Get Return Code
     data->ChildProcessRC = WEXITSTATUS(status);
 
+    // Child resource usage
+    data->monitor->stats.childUserUs = (unsigned long long)usage.ru_utime.tv_sec * 1000000ULL + usage.ru_utime.tv_usec;
+    data->monitor->stats.childSystemUs = (unsigned long long)usage.ru_stime.tv_sec * 1000000ULL + usage.ru_stime.tv_usec;
+    data->monitor->stats.childMaxRssKB = usage.ru_maxrss;
+
     // Wait for the Output thread to die.
     if (data->hOutThread)
     {
@@ -948,35 +2475,57 @@ void WaitForProcess(SHELLDATA* data)
 }
 
 
+// Thread which kills the child if it has not exited within attr->timeoutMs
+void* TimeoutThread(void* pThreadParam)
+{
+    SHELLDATA* data = (SHELLDATA*)pThreadParam;
+    struct timespec deadline;
+    unsigned long long ns;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    ns = (unsigned long long)deadline.tv_nsec + (unsigned long long)(data->attr->timeoutMs % 1000) * 1000000ULL;
+    deadline.tv_sec += (time_t)(data->attr->timeoutMs / 1000 + ns / 1000000000ULL);
+    deadline.tv_nsec = (long)(ns % 1000000000ULL);
+
+    pthread_mutex_lock(data->exitedMutex);
+    while (!data->exited) {
+        if (pthread_cond_timedwait(data->exitedCondition, data->exitedMutex, &deadline) == ETIMEDOUT) {
+            if (!data->exited) {
+                // The child is its own process group, so this also kills any
+                // processes it started (which could hold the pipes open)
+                data->timedOut = 1;
+                kill(-data->ChildProcessPID, 9); // 9=KILL
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(data->exitedMutex);
+
+    ATOMIC_ADD(&data->monitor->stats.helperCpuNs, ThreadCpuTime());
+    return NULL;
+}
+
+// Stops (if it is still waiting) and joins the timeout thread
+void StopTimeout(SHELLDATA* data)
+{
+    if (data->hTimeoutThread) {
+        pthread_mutex_lock(data->exitedMutex);
+        data->exited = 1;
+        pthread_cond_signal(data->exitedCondition);
+        pthread_mutex_unlock(data->exitedMutex);
+        pthread_join(data->hTimeoutThread, NULL);
+        data->hTimeoutThread = 0;
+    }
+}
+
 /* Thread process to handle standard output */
 void* HandleOutputThread(void* lpvThreadParam)
 {
     SHELLDATA* data = (SHELLDATA*)lpvThreadParam;
-    if (data->aOutput)
-        HandleOutputToVector(data->hOutputRead,
-                             data->aOutput,
-                             &data->outThreadRC,
-                             &data->outThreadErrorText);
-
-    else if (data->sOutput)
-        HandleOutputToString(data->hOutputRead,
-                             data->sOutput,
-                             &data->outThreadRC,
-                             &data->outThreadErrorText);
-
-    else if (data->fOutput)
-        HandleOutputToCallback(data->hOutputRead,
-                               data->fOutput,
-                               &data->outThreadRC,
-                               &data->outThreadErrorText,
-                               data);
-    else {
-        // Read and discard output
-        HandleOutputToString(data->hOutputRead,
-                             NULL,
-                             &data->outThreadRC,
-                             &data->outThreadErrorText);
-    }
+    UseAllocator(data->allocator);
+    HandleOutput(data, data->hOutputRead, data->aOutput, data->sOutput, data->fOutput, data->dOutput, data->bOutput,
+                 &data->outThreadRC, &data->outThreadErrorText, STREAM_OUT);
+    ATOMIC_ADD(&data->monitor->stats.helperCpuNs, ThreadCpuTime());
     return NULL;
 }
 
@@ -984,107 +2533,208 @@ void* HandleOutputThread(void* lpvThreadParam)
 void* HandleErrorThread(void* lpvThreadParam)
 {
     SHELLDATA* data = (SHELLDATA*)lpvThreadParam;
-    if (data->aError)
-        HandleOutputToVector(data->hErrorRead,
-                             data->aError,
-                             &data->errThreadRC,
-                             &data->errThreadErrorText);
-
-    else if (data->sError)
-        HandleOutputToString(data->hErrorRead,
-                             data->sError,
-                             &data->errThreadRC,
-                             &data->errThreadErrorText);
-
-    else if (data->fError)
-        HandleOutputToCallback(data->hErrorRead,
-                               data->fError,
-                               &data->errThreadRC,
-                               &data->errThreadErrorText,
-                               data);
-
-    else {
-        // Read and discard output
-        HandleOutputToString(data->hErrorRead,
-                             NULL,
-                             &data->errThreadRC,
-                             &data->errThreadErrorText);
-    }
+    UseAllocator(data->allocator);
+    HandleOutput(data, data->hErrorRead, data->aError, data->sError, data->fError, data->dError, data->bError,
+                 &data->errThreadRC, &data->errThreadErrorText, STREAM_ERR);
+    ATOMIC_ADD(&data->monitor->stats.helperCpuNs, ThreadCpuTime());
     return NULL;
 }
 
+/* Reads the child's stdout or stderr into the vector, string, callback (each
+ * read or each line) or caller's buffer (or discards it) - using a read buffer of
+ * attr->readBufferSize bytes */
+void HandleOutput(SHELLDATA* data, int hRead, STRINGARRAY** aOut, char** sOut, OUTHANDLER fOut,
+                  OUTDATAHANDLER dOut, SHELLSPAWN_BUFFER* bOut,
+                  int *error, char **errorText, int stream)
+{
+    size_t size = data->attr->readBufferSize;
+    char *lpBuffer = data->readBuffer[stream]; // size + 1 bytes (see ReadBuffer())
+
+    if (aOut)
+        HandleOutputToVector(hRead, lpBuffer, size, aOut, error, errorText, data->monitor, stream);
+
+    else if (sOut)
+        HandleOutputToString(hRead, lpBuffer, size, sOut,
+                             stream == STREAM_ERR ? data->sErrorLength : data->sOutputLength,
+                             error, errorText, data->monitor, stream);
+
+    else if ((fOut || dOut) && data->attr->lines.enabled)
+        HandleOutputToLines(hRead, lpBuffer, size, fOut, dOut, error, errorText, data, stream);
+
+    else if (fOut || dOut)
+        HandleOutputToCallback(hRead, lpBuffer, size, fOut, dOut, error, errorText, data, stream);
+
+    else if (bOut)
+        HandleOutputToBuffer(hRead, lpBuffer, size, bOut, error, errorText, data->monitor, stream);
+
+    else // Read and discard output
+        HandleOutputToString(hRead, lpBuffer, size, NULL, NULL, error, errorText, data->monitor, stream);
+}
+
 /* Function to handle output to a vector of strings */
-void HandleOutputToVector(int hRead, STRINGARRAY** aOut, int *error, char **errorText) {
-    char lpBuffer[256 + 1]; // Add one for a trailing null if needed
-    size_t nBytesRead;
+void HandleOutputToVector(int hRead, char *lpBuffer, size_t size, STRINGARRAY** aOut, int *error,
+                          char **errorText, SPAWNMONITOR* monitor, int stream) {
+    ssize_t nBytesRead;
     char *buffer = 0;
-    size_t start;
     int reading = 1;
-    size_t i;
 
     while (reading) {
-        nBytesRead = read(hRead, lpBuffer, 256);
+        nBytesRead = ReadOutput(hRead, lpBuffer, size, monitor, stream);
         if (nBytesRead == 0) reading = 0;
         else if (nBytesRead == -1) {
             *error = 1;
             Error("Failure U47 in read() in HandleOutputToVector()", errorText);
             return;
         }
-        start = 0;
-        for (i = 0; i < nBytesRead; i++) {
-            if (lpBuffer[i] == '\n') {
-                lpBuffer[i] = 0;
-                appendTextOutput(&buffer, lpBuffer + start);
-                appendTextArray(aOut, buffer);
-                buffer = 0;
-                start = i + 1;
-            }
-        }
-        if (start<(int)nBytesRead) {
-            lpBuffer[nBytesRead]=0;
-            appendTextOutput(&buffer, lpBuffer+start);
-        }
+        ConsumeToVector(aOut, &buffer, lpBuffer, (size_t)nBytesRead);
     }
 
     /* Add the last line if need be */
-    if (buffer) {
-        appendTextArray(aOut,buffer);
-        buffer=0;
+    FinishVector(aOut, &buffer);
+}
+
+/* Splits a chunk of output into lines and appends them to the vector. The
+ * chunk must have room for a trailing null after length bytes (it is
+ * changed). The part of a line at the end of the chunk is kept in partial */
+void ConsumeToVector(STRINGARRAY **aOut, char **partial, char *chunk, size_t length) {
+    size_t start = 0;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        if (chunk[i] == '\n') {
+            chunk[i] = 0;
+            appendTextOutput(partial, chunk + start);
+            appendTextArray(aOut, *partial);
+            *partial = 0;
+            start = i + 1;
+        }
+    }
+    if (start < length) {
+        chunk[length] = 0;
+        appendTextOutput(partial, chunk + start);
     }
 }
 
-/* Function to handle output to a strings */
-void HandleOutputToString(int hRead, char **sOut, int *error, char **errorText) {
-    char lpBuffer[256 + 1]; // Add one for a trailing null if needed
-    size_t nBytesRead;
+/* Adds the last (unterminated) line to the vector */
+void FinishVector(STRINGARRAY **aOut, char **partial) {
+    if (*partial) {
+        appendTextArray(aOut, *partial);
+        *partial = 0;
+    }
+}
+
+/* Function to handle output to a strings - the string's length is kept (as
+ * the output can hold nulls) and passed back in *sOutLength if wanted */
+void HandleOutputToString(int hRead, char *lpBuffer, size_t size, char **sOut, size_t *sOutLength,
+                          int *error, char **errorText, SPAWNMONITOR* monitor, int stream) {
+    ssize_t nBytesRead;
     int reading = 1;
+    size_t length = 0;
 
     while (reading) {
-        nBytesRead = read(hRead, lpBuffer, 256);
+        nBytesRead = ReadOutput(hRead, lpBuffer, size, monitor, stream);
         if (nBytesRead == 0) reading = 0;
         else if (nBytesRead == -1) {
             *error = 1;
             Error("Failure U48 in read() in HandleOutputToString()", errorText);
+            break;
+        }
+        if (sOut) ConsumeToString(sOut, &length, lpBuffer, (size_t)nBytesRead); // if sOut is null discard output
+    }
+    if (sOutLength) *sOutLength = length;
+}
+
+/* Appends a chunk of output to the string. *sOutLength is the string's length
+ * so far - so the output can hold nulls, and the string is not scanned for its
+ * end on every chunk. The string is kept null terminated */
+void ConsumeToString(char **sOut, size_t *sOutLength, char *chunk, size_t length) {
+    char *grown = Realloc(*sOut, *sOutLength + length + 1);
+    if (!grown) return;
+    memcpy(grown + *sOutLength, chunk, length);
+    *sOutLength += length;
+    grown[*sOutLength] = 0;
+    *sOut = grown;
+}
+
+/* Function to handle output to a caller's buffer - it is read straight into
+ * the buffer and then, once that is full, into the continuation (or lpBuffer
+ * to be discarded) */
+void HandleOutputToBuffer(int hRead, char *lpBuffer, size_t size, SHELLSPAWN_BUFFER* bOut, int *error,
+                          char **errorText, SPAWNMONITOR* monitor, int stream) {
+    ssize_t nBytesRead;
+    size_t continuationSize = 0;
+    size_t *length;
+    char *target;
+    size_t room;
+
+    for (;;) {
+        if (bOut->length + 1 < bOut->capacity) {
+            target = bOut->data + bOut->length;
+            room = bOut->capacity - 1 - bOut->length;
+            length = &bOut->length;
+        }
+        else if (bOut->overflow == SHELLSPAWN_OVERFLOW_CONTINUE) {
+            // Grown by doubling so that a long output is not copied too often
+            if (continuationSize < bOut->continuationLength + size + 1 &&
+                Reserve((void**)&bOut->continuation, &continuationSize,
+                        2 * continuationSize + size + 1)) {
+                *error = 1;
+                Error("Failure U103 in malloc(continuation) in HandleOutputToBuffer()", errorText);
+                return;
+            }
+            target = bOut->continuation + bOut->continuationLength;
+            room = continuationSize - 1 - bOut->continuationLength;
+            length = &bOut->continuationLength;
+        }
+        else { // Read and discard
+            target = lpBuffer;
+            room = size;
+            length = NULL;
+        }
+
+        nBytesRead = ReadOutput(hRead, target, room, monitor, stream);
+        if (nBytesRead == 0) return;
+        if (nBytesRead == -1) {
+            *error = 1;
+            Error("Failure U104 in read() in HandleOutputToBuffer()", errorText);
             return;
         }
-        if (sOut) { // if sOut is null discard output
-            lpBuffer[nBytesRead] = 0;
-            appendTextOutput(sOut, lpBuffer);
+        if (length) {
+            *length += (size_t)nBytesRead;
+            target[nBytesRead] = 0;
         }
+        else bOut->truncated = 1;
     }
 }
 
-/* Function to handle output to a callback */
-void HandleOutputToCallback(int hRead, OUTHANDLER fOut, int *error,
-                            char **errorText, SHELLDATA* data)
+/* Resets a caller's buffer before a spawn (freeing any old continuation) */
+void ClearBuffer(SHELLSPAWN_BUFFER* bOut) {
+    if (!bOut) return;
+    bOut->length = 0;
+    if (bOut->capacity) bOut->data[0] = 0;
+    if (bOut->continuation) Free(bOut->continuation);
+    bOut->continuation = NULL;
+    bOut->continuationLength = 0;
+    bOut->truncated = 0;
+}
+
+/* Did output not fit in a caller's buffer that is to fail if so */
+int Overflowed(SHELLSPAWN_BUFFER* bOut) {
+    return bOut && bOut->truncated && bOut->overflow == SHELLSPAWN_OVERFLOW_FAIL;
+}
+
+/* Function to handle output to a callback (fOut) or data callback (dOut) */
+void HandleOutputToCallback(int hRead, char *lpBuffer, size_t size, OUTHANDLER fOut, OUTDATAHANDLER dOut,
+                            int *error, char **errorText, SHELLDATA* data, int stream)
 {
-    char lpBuffer[256+1]; // Add one for a trailing null if needed
-    size_t nBytesRead;
+    ssize_t nBytesRead;
     int reading = 1;
+    unsigned long long arrivalTime;
 
     while(reading)
     {
-        nBytesRead = read(hRead, lpBuffer, 256);
+        nBytesRead = ReadOutput(hRead, lpBuffer, size, data->monitor, stream);
+        arrivalTime = ATOMIC_LOAD(&data->monitor->lastOutputTime);
         if (nBytesRead == 0) reading = 0;
         else if (nBytesRead == -1)
         {
@@ -1095,83 +2745,221 @@ void HandleOutputToCallback(int hRead, OUTHANDLER fOut, int *error,
 
         if (nBytesRead)
         {
-
-            // Critical section is used to ensure that one callback is called at a time
-            if (pthread_mutex_lock(data->criticalsection))
-            {
-                *error = 1;
-                Error("Failure U50 in pthread_mutex_lock(criticalsection) in HandleOutputToCallback()", errorText);
+            // The callback gets the read buffer itself (which has room for the
+            // null) - this thread does not read again until it has returned
+            lpBuffer[nBytesRead] = 0;
+            if (CallOutputHandler(data, lpBuffer, (size_t)nBytesRead, fOut, dOut, arrivalTime,
+                                  error, errorText, stream))
                 return;
-            }
+        }
+    }
+}
 
-            lpBuffer[nBytesRead] = 0;
-            appendTextOutput(&(data->callbackBuffer), lpBuffer);
+/* Function to handle output to a callback (fOut) or data callback (dOut) a
+ * line at a time (attr->lines) */
+void HandleOutputToLines(int hRead, char *lpBuffer, size_t size, OUTHANDLER fOut, OUTDATAHANDLER dOut,
+                         int *error, char **errorText, SHELLDATA* data, int stream)
+{
+    const SHELLSPAWN_LINES *lines = &data->attr->lines;
+    SHELLSPAWN_CONTEXT* spawnContext = data->spawnContext;
+    char *ownText = NULL;
+    size_t ownSize = 0;
+    LINEBUFFER line;
+    ssize_t nBytesRead;
+    int reading = 1;
+    int discarding = 0; // Skipping the rest of a line that was too long
+    unsigned long long arrivalTime = 0;
+    char *next, *end, *delimiter;
+    size_t take;
 
-            // OK we need to signal the main thread to do the callback for us so that all
-            // callbacks run on the main thread - this helps the calling system
-            // Set up the common data
-            data->callbackType = 2; // Output
-            data->callbackOutputHandler = fOut;
+    // A spawn context keeps the buffer for its next spawn
+    line.text = spawnContext ? &spawnContext->lineBuffer[stream] : &ownText;
+    line.size = spawnContext ? &spawnContext->lineBufferSize[stream] : &ownSize;
+    line.length = 0;
 
-            // Signal the main thread
-            if (pthread_mutex_lock(data->callbackRequestedMutex))
-            {
-                *error = 1;
-                Error("Failure U51 in pthread_mutex_lock(callbackRequestedMutex) in HandleOutputToCallback()", errorText);
-                return;
-            }
-            if (pthread_cond_signal(data->callbackRequested))
-            {
-                *error = 1;
-                Error("Failure U52 in pthread_cond_signal(callbackRequested) in HandleOutputToCallback()", errorText);
-                return;
-            }
+    while (reading)
+    {
+        nBytesRead = ReadOutput(hRead, lpBuffer, size, data->monitor, stream);
+        arrivalTime = ATOMIC_LOAD(&data->monitor->lastOutputTime);
+        if (nBytesRead == 0) reading = 0;
+        else if (nBytesRead == -1)
+        {
+            *error = 1;
+            Error("Failure U107 in read() in HandleOutputToLines()", errorText);
+            reading = 0;
+        }
 
-            // Wait for the main thread to have done the work
-            if (pthread_mutex_lock(data->callbackHandledMutex)) // Lock the callback before unlocking the request
+        end = lpBuffer + (nBytesRead > 0 ? nBytesRead : 0);
+        for (next = lpBuffer; reading && next < end; next += take)
+        {
+            delimiter = memchr(next, lines->delimiter, (size_t)(end - next));
+            take = (size_t)((delimiter ? delimiter : end) - next);
+
+            if (discarding)
             {
-                *error = 1;
-                Error("Failure U53 in pthread_mutex_lock(callbackHandledMutex) in HandleOutputToCallback()", errorText);
-                return;
+                if (delimiter)
+                {
+                    discarding = 0;
+                    take++;
+                }
             }
-            if (pthread_mutex_unlock(data->callbackRequestedMutex))
+            else if (lines->maxLength && line.length + take > lines->maxLength)
             {
-                *error = 1;
-                Error("Failure U54 in pthread_mutex_unlock(callbackRequestedMutex) in HandleOutputToCallback()", errorText);
-                return;
+                // Pass the first maxLength bytes - the rest is either passed
+                // as the next piece (CONTINUE) or discarded
+                take = lines->maxLength - line.length;
+                if (PassLine(data, &line, next, take, fOut, dOut, arrivalTime, error, errorText, stream))
+                    reading = 0;
+                else if (lines->overflow != SHELLSPAWN_OVERFLOW_CONTINUE)
+                {
+                    discarding = 1;
+                    data->linesTruncated[stream] = 1;
+                }
             }
-            if (pthread_cond_wait(data->callbackHandled, data->callbackHandledMutex))
+            else if (!delimiter)
             {
-                *error = 1;
-                Error("Failure U55 in pthread_cond_wait(callbackHandled) in HandleOutputToCallback()", errorText);
-                return;
+                if (AppendLine(&line, next, take, error, errorText)) reading = 0;
             }
-            if (pthread_mutex_unlock(data->callbackHandledMutex))
+            else
             {
-                *error = 1;
-                Error("Failure U56 in pthread_mutex_unlock(callbackHandledMutex) in HandleOutputToCallback()", errorText);
-                return;
+                if (PassLine(data, &line, next, take, fOut, dOut, arrivalTime, error, errorText, stream))
+                    reading = 0;
+                take++; // And the delimiter
             }
+        }
+    }
 
-            if (data->callbackBuffer) {
-                free(data->callbackBuffer);
-                data->callbackBuffer = NULL;
-            }
+    /* Pass the last line if need be */
+    if (!*error && line.length)
+        PassLine(data, &line, lpBuffer, 0, fOut, dOut, arrivalTime, error, errorText, stream);
 
-            if (pthread_mutex_unlock(data->criticalsection))
-            {
-                *error = 1;
-                Error("Failure U57 in pthread_mutex_unlock(criticalsection) in HandleOutputToCallback()", errorText);
-                return;
-            }
-        }
+    if (ownText) Free(ownText);
+}
+
+/* Passes a line (or the first maxLength bytes of one) - length bytes at text
+ * following any of it already in the line buffer. Returns non-zero on error */
+int PassLine(SHELLDATA* data, LINEBUFFER* line, char *text, size_t length, OUTHANDLER fOut, OUTDATAHANDLER dOut,
+             unsigned long long arrivalTime, int *error, char **errorText, int stream)
+{
+    char saved;
+    int result;
+
+    if (line->length)
+    {
+        if (AppendLine(line, text, length, error, errorText)) return 1;
+        length = line->length;
+        line->length = 0;
+        return CallOutputHandler(data, *line->text, length, fOut, dOut, arrivalTime, error, errorText, stream);
+    }
+
+    // Straight from the read buffer - null terminated in place (the read
+    // buffer has room for a null after its last byte)
+    saved = text[length];
+    text[length] = 0;
+    result = CallOutputHandler(data, text, length, fOut, dOut, arrivalTime, error, errorText, stream);
+    text[length] = saved;
+    return result;
+}
+
+/* Adds length bytes at text to the line being assembled (keeping it null
+ * terminated). Returns non-zero on error */
+int AppendLine(LINEBUFFER* line, const char *text, size_t length, int *error, char **errorText)
+{
+    // Grown by doubling so that a long line is not copied too often
+    if (*line->size < line->length + length + 1 &&
+        Reserve((void**)line->text, line->size, 2 * *line->size + length + 1))
+    {
+        *error = 1;
+        Error("Failure U108 in malloc(line) in AppendLine()", errorText);
+        return 1;
+    }
+    memcpy(*line->text + line->length, text, length);
+    line->length += length;
+    (*line->text)[line->length] = 0;
+    return 0;
+}
+
+/* Has the main thread call fOut (or dOut) with length bytes at text (null
+ * terminated), waiting until it has returned. Returns non-zero on error */
+int CallOutputHandler(SHELLDATA* data, char *text, size_t length, OUTHANDLER fOut, OUTDATAHANDLER dOut,
+                      unsigned long long arrivalTime, int *error, char **errorText, int stream)
+{
+    // Critical section is used to ensure that one callback is called at a time
+    if (pthread_mutex_lock(data->criticalsection))
+    {
+        *error = 1;
+        Error("Failure U50 in pthread_mutex_lock(criticalsection) in CallOutputHandler()", errorText);
+        return 1;
+    }
+
+    data->callbackBuffer = text;
+    data->callbackLength = length;
+
+    // OK we need to signal the main thread to do the callback for us so that all
+    // callbacks run on the main thread - this helps the calling system
+    // Set up the common data
+    data->callbackType = 2; // Output
+    data->callbackStream = stream;
+    data->callbackArrivalTime = arrivalTime;
+    data->callbackOutputHandler = fOut;
+    data->callbackDataHandler = dOut;
+
+    // Signal the main thread
+    if (pthread_mutex_lock(data->callbackRequestedMutex))
+    {
+        *error = 1;
+        Error("Failure U51 in pthread_mutex_lock(callbackRequestedMutex) in CallOutputHandler()", errorText);
+        return 1;
     }
+    if (pthread_cond_signal(data->callbackRequested))
+    {
+        *error = 1;
+        Error("Failure U52 in pthread_cond_signal(callbackRequested) in CallOutputHandler()", errorText);
+        return 1;
+    }
+
+    // Wait for the main thread to have done the work
+    if (pthread_mutex_lock(data->callbackHandledMutex)) // Lock the callback before unlocking the request
+    {
+        *error = 1;
+        Error("Failure U53 in pthread_mutex_lock(callbackHandledMutex) in CallOutputHandler()", errorText);
+        return 1;
+    }
+    if (pthread_mutex_unlock(data->callbackRequestedMutex))
+    {
+        *error = 1;
+        Error("Failure U54 in pthread_mutex_unlock(callbackRequestedMutex) in CallOutputHandler()", errorText);
+        return 1;
+    }
+    if (pthread_cond_wait(data->callbackHandled, data->callbackHandledMutex))
+    {
+        *error = 1;
+        Error("Failure U55 in pthread_cond_wait(callbackHandled) in CallOutputHandler()", errorText);
+        return 1;
+    }
+    if (pthread_mutex_unlock(data->callbackHandledMutex))
+    {
+        *error = 1;
+        Error("Failure U56 in pthread_mutex_unlock(callbackHandledMutex) in CallOutputHandler()", errorText);
+        return 1;
+    }
+
+    data->callbackBuffer = NULL;
+
+    if (pthread_mutex_unlock(data->criticalsection))
+    {
+        *error = 1;
+        Error("Failure U57 in pthread_mutex_unlock(criticalsection) in CallOutputHandler()", errorText);
+        return 1;
+    }
+    return 0;
 }
 
 /* Thread process to handle standard input */
 void* HandleInputThread(void* lpvThreadParam)
 {
     SHELLDATA* data = (SHELLDATA*)lpvThreadParam;
+    UseAllocator(data->allocator);
     if (data->aInput)
         HandleStdinFromVector(data);
 
@@ -1184,6 +2972,7 @@ void* HandleInputThread(void* lpvThreadParam)
     // else  - Nothing to do ... just close the handle ... i.e. as below
     close(data->hInputWrite);
     data->hInputWrite = -1;
+    ATOMIC_ADD(&data->monitor->stats.helperCpuNs, ThreadCpuTime());
     return NULL;
 }
 
@@ -1201,11 +2990,13 @@ void HandleStdinFromCallback(SHELLDATA* data)
 {
     char CommBuffer[1];
     ssize_t rc;
+    unsigned long long arrivalTime;
 
     do
     {
         // Wait for the proxy to tell us that input is needed
         rc = read(data->proxyReceive, (void*)CommBuffer, 1);
+        arrivalTime = Now();
         if (rc == -1)
         {
             data->inThreadRC = 1;
@@ -1234,6 +3025,8 @@ void HandleStdinFromCallback(SHELLDATA* data)
         // callbacks run on the main thread - this helps the calling system
         // Set up the comon data
         data->callbackType = 1; // Input
+        data->callbackStream = STREAM_IN;
+        data->callbackArrivalTime = arrivalTime;
         if (pthread_cond_signal(data->callbackRequested))
         {
             data->inThreadRC = 1;
@@ -1289,7 +3082,7 @@ void HandleStdinFromCallback(SHELLDATA* data)
         // Write the line - exit on any error
         if (WriteToStdin(data->callbackBuffer, data)) {
             if (data->callbackBuffer) {
-                free(data->callbackBuffer);
+                Free(data->callbackBuffer);
                 data->callbackBuffer = 0;
             }
             pthread_mutex_unlock(data->callbackHandledMutex);
@@ -1298,7 +3091,7 @@ void HandleStdinFromCallback(SHELLDATA* data)
         }
 
         if (data->callbackBuffer) {
-            free(data->callbackBuffer);
+            Free(data->callbackBuffer);
             data->callbackBuffer = 0;
         }
 
@@ -1365,6 +3158,7 @@ int WriteToStdin(char *line, SHELLDATA* data)
             }
         }
         nTotalWrote += nBytesWrote;
+        ATOMIC_ADD(&data->monitor->bytes[STREAM_IN], nBytesWrote);
     }
     return 0;
 }
@@ -1377,22 +3171,22 @@ void Error(char *context, char **errorText)
     sprintf(sRC, "%d", errno);
 
     message_len = strlen(message) + strlen((char*)strerror(errno)) + strlen(context) + 11;
-    *errorText = malloc(message_len);
+    *errorText = Alloc(message_len);
     snprintf(*errorText, message_len, context, sRC, (char*)strerror(errno));
 }
 
-/* Parse the command to get the arguments */
-int ParseCommand(const char *command_string, char **command, char **file, char ***argv) {
+/* Parse the command to get the arguments. command (of commandSize bytes) and
+ * argv (of argvSize bytes) are grown if needed (see ArenaReserve()) - they
+ * belong to the caller (even on error) */
+int ParseCommand(SPAWNARENA* arena, const char *command_string, char **command, size_t *commandSize,
+                 char **file, char ***argv, size_t *argvSize) {
     int l = 0;
     int args = 1;
     int a;
     int arg_start;
 
-    *command = malloc(sizeof(char) * (strlen(command_string) + 1));
-    if (*command == NULL) {
-        *command = 0;
-        file = 0;
-        *argv = 0;
+    if (ArenaReserve(arena, (void**)command, commandSize, sizeof(char) * (strlen(command_string) + 1))) {
+        *file = 0;
         return -1;
     }
     strcpy(*command, command_string);
@@ -1410,10 +3204,7 @@ int ParseCommand(const char *command_string, char **command, char **file, char *
 
     // Is there any command at all
     if (!file[0]) {
-        free(*command);
-        *command = 0;
-        file = 0;
-        *argv = 0;
+        *file = 0;
         return -1;
     }
 
@@ -1458,12 +3249,8 @@ int ParseCommand(const char *command_string, char **command, char **file, char *
         }
     }
 
-    *argv = malloc(sizeof(char*) * (args + 1));
-    if (*argv == NULL) {
-        free(*command);
-        *command = 0;
-        file = 0;
-        *argv = 0;
+    if (ArenaReserve(arena, (void**)argv, argvSize, sizeof(char*) * (args + 1))) {
+        *file = 0;
         return -1;
     }
     if (((*argv)[0] = strrchr(*file, '/')) != NULL)
@@ -1560,7 +3347,9 @@ int ProxyWorker(SHELLDATA* data)
                         write(data->proxyReceiveWrite,(void*)CommBuffer, 1);
 
                         // Put the job into the foreground
-                        if (tcsetpgrp(data->hInputRead, data->ChildProcessPID) < 0)
+                        // Note: this fails if the input has already been closed (the
+                        // terminal is hung up) - the child then reads EOF anyway
+                        if (tcsetpgrp(data->hInputRead, data->ChildProcessPID) < 0 && !TERMINAL_CLOSED)
                         {
                             perror("Failure U72 in tcsetpgrp(ChildProcess) in shellspawn()");
                             return -1;
@@ -1600,7 +3389,7 @@ int ProxyWorker(SHELLDATA* data)
                             }
 #endif
                             // Put the job into the background
-                            if (tcsetpgrp(data->hInputRead, data->proxyPID)<0)
+                            if (tcsetpgrp(data->hInputRead, data->proxyPID) < 0 && !TERMINAL_CLOSED)
                             {
                                 perror("Failure U76 in tcsetpgrp(set proxy to foreground) in shellspawn()");
                                 return -1;
@@ -1619,7 +3408,7 @@ int ProxyWorker(SHELLDATA* data)
 
                     case 1: // Somthing to read from buffer
                         // Put the job into the foreground
-                        if (tcsetpgrp(data->hInputRead, data->ChildProcessPID) < 0)
+                        if (tcsetpgrp(data->hInputRead, data->ChildProcessPID) < 0 && !TERMINAL_CLOSED)
                         {
                             perror("Failure U78 in tcsetpgrp(ChildProcess) in shellspawn()");
                             return -1;
@@ -1645,7 +3434,7 @@ int ProxyWorker(SHELLDATA* data)
                             return -1;
                         }
                         // Put the job into the background
-                        if (tcsetpgrp(data->hInputRead, data->proxyPID) < 0)
+                        if (tcsetpgrp(data->hInputRead, data->proxyPID) < 0 && !TERMINAL_CLOSED)
                         {
                             perror("Failure U82 in tcsetpgrp(Proxy) in shellspawn()");
                             return -1;
@@ -1671,6 +3460,71 @@ int ProxyWorker(SHELLDATA* data)
 }
 
 
+// Parses the command into data's buffers and finds the executable (on the
+// PATH if need be). Returns SHELLSPAWN_OK, SHELLSPAWN_NOFOUND or
+// SHELLSPAWN_FAILURE (with errorText set)
+int FindCommand(SHELLDATA* data, const char *command, char **errorText)
+{
+    char *base_name;
+    int i;
+    int commandFound = 0;
+    SPAWNARENA* arena = data->spawnContext ? NULL : &data->arena; // A context's buffers are kept
+
+    if (ParseCommand(arena, command, &data->buffer, &data->bufferSize, &base_name, &data->argv, &data->argvSize)) {
+        Error("Failure U18 in ParseCommand() in shellspawn()", errorText);
+        return SHELLSPAWN_NOFOUND;
+    }
+
+    if (ExeFound(base_name)) {
+        if (ArenaReserve(arena, (void**)&data->file_path, &data->filePathSize, strlen(base_name) + 1)) {
+            Error("Failure U93 in malloc(file_path) in shellspawn()", errorText);
+            return SHELLSPAWN_FAILURE;
+        }
+        strcpy(data->file_path, base_name);
+        commandFound = 1;
+    } else if (base_name[0] != '/') {
+        // Get PATH environment variable so we can find the exe
+        const char *env = getenv("PATH");
+        if (env && ArenaReserve(arena, (void**)&data->file_path, &data->filePathSize,
+                                strlen(env) + strlen(base_name) + 2)) { // Make a buffer big enough
+            Error("Failure U94 in malloc(file_path) in shellspawn()", errorText);
+            return SHELLSPAWN_FAILURE;
+        }
+        while (env && *env) {
+            for (i = 0; (data->file_path[i] = *env); i++, env++) {
+                if (*env == ':') {
+                    data->file_path[i] = 0;
+                    break;
+                }
+            }
+
+            strcat(data->file_path, "/");
+            strcat(data->file_path, base_name);
+
+            if (ExeFound(data->file_path)) {
+                commandFound = 1;
+                break;
+            }
+            if (*env == ':') env++; // Next directory in the PATH
+        }
+    }
+
+    if (!commandFound) {
+        setTextOutput(errorText, "Failure U19 in shellspawn() - Command not found");
+        return SHELLSPAWN_NOFOUND;
+    }
+
+    // The command was found relative to our working directory - not the child's
+    if (data->attr->cwd && data->file_path[0] != '/') {
+        char absolute[PATH_MAX];
+        if (realpath(data->file_path, absolute) &&
+            !ArenaReserve(arena, (void**)&data->file_path, &data->filePathSize, strlen(absolute) + 1))
+            strcpy(data->file_path, absolute);
+    }
+
+    return SHELLSPAWN_OK;
+}
+
 // Launches the child job - never returnes
 void launchChild(SHELLDATA* data)
 {
@@ -1706,12 +3560,38 @@ void launchChild(SHELLDATA* data)
     signal(SIGTTOU, SIG_DFL);
     signal(SIGCHLD, SIG_DFL);
 
+    // Working directory and resource limits
+    if (data->attr->cwd && chdir(data->attr->cwd)) {
+        perror("Failure U91 chdir() Error");
+        exit(-1);
+    }
+    SetLimit(RLIMIT_CPU, data->attr->limits.cpuSeconds);
+    SetLimit(RLIMIT_AS, data->attr->limits.memoryBytes);
+    SetLimit(RLIMIT_FSIZE, data->attr->limits.fileBytes);
+    SetLimit(RLIMIT_NOFILE, data->attr->limits.openFiles);
+
     // Execute the command
-    execv(data->file_path, data->argv);
+    if (data->attr->env) execve(data->file_path, data->argv, data->attr->env);
+    else execv(data->file_path, data->argv);
     perror("Failure U85 execv() Error");
     exit(-1);
 }
 
+// Sets a resource limit in the child (0 leaves it unchanged) - does not return
+// on error
+void SetLimit(int resource, unsigned long long value)
+{
+    struct rlimit limit;
+
+    if (!value) return;
+    limit.rlim_cur = (rlim_t)value;
+    limit.rlim_max = (rlim_t)value;
+    if (setrlimit(resource, &limit)) {
+        perror("Failure U92 setrlimit() Error");
+        exit(-1);
+    }
+}
+
 // alarm handler doesn't need to do anything
 // other than simply exist
 static void alarm_handler( int sig ) {}
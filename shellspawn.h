@@ -48,11 +48,22 @@
 
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // Call back functions for stdout and stderr
 //  - data holds the line(s) output by the child process
 //  - context is passed from the call to spawnshell()
 typedef void(*OUTHANDLER)(char* data, void* context);
 
+// Call back functions for stdout and stderr that get each read as it is (see
+// attr.dOut and attr.dErr)
+//  - data points to length bytes straight in the library's read buffer - it is
+//    not null terminated, can hold nulls, and is only valid during the call
+//  - context is passed from the call to spawnshell()
+typedef void(*OUTDATAHANDLER)(const char* data, size_t length, void* context);
+
 // Call back functions for stdin
 //  - If this return non-zero then shellspawn() will close the stdin pipe
 //    Note: In this case any data put in the data variable is ignored
@@ -63,15 +74,6 @@ typedef int(*INHANDLER)(char **data, void* context);
 // Array of Strings - array null terminated
 typedef char *STRINGARRAY[];
 
-// Clear Array of Strings
-static void freeTextArray(STRINGARRAY *Array) {
-    size_t s;
-    if (*Array) {
-        for (s=0; (*Array)[s]; s++) free((*Array)[s]);
-        free(Array);
-    }
-}
-
 // Command to spawn the command
 //
 // - The caller should only populate at most one of vIn, sIn or fIn depending on
@@ -93,6 +95,11 @@ static void freeTextArray(STRINGARRAY *Array) {
 //  3 - SHELLSPAWN_TOOMANYERR - More than one of pErr, vErr, sErr or fErr specified.
 //  4 - SHELLSPAWN_NOFOUND    - The command was not found
 //  5 - SHELLSPAWN_FAILURE    - Spawn failed unexpectedly (see error text for details)
+//  6 - SHELLSPAWN_TIMEOUT    - The child was killed as it ran for too long
+//                              (shellspawn_ex() only)
+//  7 - SHELLSPAWN_OVERFLOW   - Output did not fit in a caller's buffer, or a
+//                              line was too long (shellspawn_ex() only - see
+//                              SHELLSPAWN_BUFFER and SHELLSPAWN_LINES)
 int shellspawn(const char *command,
                STRINGARRAY *aIn,
                char* sIn,
@@ -117,5 +124,411 @@ int shellspawn(const char *command,
 #define SHELLSPAWN_TOOMANYERR 3
 #define SHELLSPAWN_NOFOUND    4
 #define SHELLSPAWN_FAILURE    5
+#define SHELLSPAWN_TIMEOUT    6  // The child was killed after attr.timeoutMs
+#define SHELLSPAWN_OVERFLOW   7  // A SHELLSPAWN_OVERFLOW_FAIL buffer or line overflowed
+#define SHELLSPAWN_RESULTS    8  // Number of return codes
+
+// Resource limits set (setrlimit(), soft and hard) in the child before the
+// command is run. 0 leaves a limit as inherited from the caller
+typedef struct shellspawn_limits {
+    unsigned long long cpuSeconds;  // RLIMIT_CPU
+    unsigned long long memoryBytes; // RLIMIT_AS
+    unsigned long long fileBytes;   // RLIMIT_FSIZE
+    unsigned long long openFiles;   // RLIMIT_NOFILE
+} SHELLSPAWN_LIMITS;
+
+// Memory allocator - every allocation the library makes goes through one (the
+// C library's malloc(), realloc() and free() unless set otherwise)
+// - The process wide allocator is set by shellspawn_setallocator(), and a spawn
+//   can use its own (attr.allocator)
+// - Memory the library returns to the caller - output strings and vectors (and
+//   their lines), continuations (SHELLSPAWN_BUFFER) and error texts - comes
+//   from the spawn's allocator and belongs to the caller, who frees it with the
+//   same allocator (e.g. shellspawn_free() or shellspawn_freearray()). Output
+//   from an earlier call that the library frees (sOut, aOut etc. are freed when
+//   reused) must therefore have come from the same allocator
+// - An INHANDLER's *data is freed by the library with the spawn's allocator,
+//   so the handler allocates it with that allocator (e.g. shellspawn_alloc())
+// - The functions can be called from any of the library's threads at once, and
+//   must not call back into the library. The structure must stay valid while
+//   any memory allocated by it does
+typedef struct shellspawn_allocator {
+    void* (*alloc)(size_t size, void *context);
+    void* (*realloc)(void *block, size_t size, void *context);
+    void (*free)(void *block, void *context);
+    void *context;
+} SHELLSPAWN_ALLOCATOR;
+
+// Sets the process wide allocator (NULL for malloc() etc.). Set it before any
+// spawns are made (it is not synchronised with spawns in flight)
+// Note: Linux / OSX only at the moment
+void shellspawn_setallocator(const SHELLSPAWN_ALLOCATOR *allocator);
+
+// Allocates, reallocates or frees memory with allocator (or with the process
+// wide allocator if NULL) - e.g. to free the output of a spawn
+// Note: Linux / OSX only at the moment
+void* shellspawn_alloc(const SHELLSPAWN_ALLOCATOR *allocator, size_t size);
+void* shellspawn_realloc(const SHELLSPAWN_ALLOCATOR *allocator, void *block, size_t size);
+void shellspawn_free(const SHELLSPAWN_ALLOCATOR *allocator, void *block);
+
+// Frees a vector of strings (e.g. aOut) and its lines with allocator (or with
+// the process wide allocator if NULL)
+// Note: Linux / OSX only at the moment
+void shellspawn_freearray(const SHELLSPAWN_ALLOCATOR *allocator, STRINGARRAY *array);
+
+// Clear Array of Strings (allocated by the process wide allocator - see
+// shellspawn_freearray() for a spawn with its own)
+static void freeTextArray(STRINGARRAY *Array) {
+    shellspawn_freearray(NULL, Array);
+}
+
+// Caller provided buffer that stdout or stderr is captured into (attr.bOut or
+// attr.bErr) - the output is read straight into it, so a buffer that is big
+// enough needs no allocation at all. The text is null terminated, so at most
+// capacity - 1 bytes are kept in data
+// - overflow says what happens to output that does not fit
+// - A continuation from an earlier spawn with the same buffer is freed (as
+//   sOut is), so either free it and set it to NULL or leave it to be freed
+typedef struct shellspawn_buffer {
+    char *data;
+    size_t capacity;           // Bytes at data
+    int overflow;              // SHELLSPAWN_OVERFLOW_xxx
+    // Set by the spawn
+    size_t length;             // Bytes in data (excluding the null)
+    char *continuation;        // SHELLSPAWN_OVERFLOW_CONTINUE - the output after
+                               // the first length bytes (null terminated) or NULL
+                               // if it all fitted. The caller frees it (see
+                               // SHELLSPAWN_ALLOCATOR)
+    size_t continuationLength;
+    int truncated;             // Output was discarded (TRUNCATE or FAIL)
+} SHELLSPAWN_BUFFER;
+
+// What happens to output that does not fit in a SHELLSPAWN_BUFFER (or to a
+// line longer than SHELLSPAWN_LINES maxLength)
+#define SHELLSPAWN_OVERFLOW_TRUNCATE 0 // Keep what fits, discard the rest
+#define SHELLSPAWN_OVERFLOW_FAIL     1 // As truncate, but the call returns
+                                       // SHELLSPAWN_OVERFLOW (rc is still set)
+#define SHELLSPAWN_OVERFLOW_CONTINUE 2 // Carry on in a library allocated buffer
+                                       // (a line is passed in maxLength pieces)
+
+// Line mode for the output callbacks (attr.lines) - fOut/fErr and dOut/dErr
+// are called once for each complete line rather than for each read
+// - The line is passed without its delimiter (null terminated for fOut/fErr).
+//   A last line without a delimiter is passed at the end of the stream
+// - Lines within a read are passed straight from the read buffer. Only a line
+//   split between reads is copied, into a buffer that is kept for the next
+//   read (and by a spawn context for its next spawn)
+typedef struct shellspawn_lines {
+    int enabled;               // Non-zero for line mode
+    char delimiter;            // Ends a line ('\n' - set by shellspawn_attr_init())
+    size_t maxLength;          // Longest line passed, excluding the delimiter
+                               // (0 for no limit)
+    int overflow;              // SHELLSPAWN_OVERFLOW_xxx for a longer line
+} SHELLSPAWN_LINES;
+
+// Default bytes read from the child's stdout/stderr per read()
+#define SHELLSPAWN_READBUFFER_DEFAULT 256
+
+// Spawn attributes for shellspawn_ex() - set up once and reused for any number
+// of spawns. shellspawn_ex() does not change it, so an attr with no capture
+// bindings (aOut, sOut, bOut, aErr, sErr or bErr - each points at a single
+// output of the caller's) can be shared by any number of threads; otherwise
+// use one per thread
+// - Call shellspawn_attr_init() and then set the fields needed
+// - The stream bindings work as the shellspawn() parameters of the same name,
+//   bOut/bErr capture into a caller's buffer (see SHELLSPAWN_BUFFER) and
+//   dOut/dErr are callbacks like fOut/fErr that are passed the library's read
+//   buffer rather than a copy (see OUTDATAHANDLER). Set lines for the
+//   callbacks to be passed whole lines (see SHELLSPAWN_LINES)
+// - Call shellspawn_attr_prepare() once the fields are set (and again after
+//   changing them) so the checks are not repeated on every spawn. An
+//   unprepared attr still works, it is just checked on each call
+typedef struct shellspawn_attr {
+    STRINGARRAY *aIn;
+    char* sIn;
+    INHANDLER fIn;
+    FILE* pIn;
+    STRINGARRAY **aOut;
+    char** sOut;
+    OUTHANDLER fOut;
+    FILE* pOut;
+    SHELLSPAWN_BUFFER *bOut;
+    OUTDATAHANDLER dOut;
+    STRINGARRAY **aErr;
+    char** sErr;
+    OUTHANDLER fErr;
+    FILE* pErr;
+    SHELLSPAWN_BUFFER *bErr;
+    OUTDATAHANDLER dErr;
+    size_t *sOutLength;        // Set to the bytes captured in *sOut / *sErr - which
+    size_t *sErrLength;        // can hold nulls (NULL if not wanted)
+    char **env;                // Child's environment - null terminated "NAME=value"
+                               // strings (NULL to inherit the caller's). Note
+                               // that the command is still found on the caller's PATH
+    const char *cwd;           // Child's working directory (NULL for the caller's)
+    unsigned long timeoutMs;   // Kill the child after this long (0 for no limit)
+    size_t readBufferSize;     // Bytes per read() of stdout/stderr (0 for the default)
+    SHELLSPAWN_LIMITS limits;
+    SHELLSPAWN_LINES lines;    // Line mode for fOut, fErr, dOut and dErr
+    const SHELLSPAWN_ALLOCATOR *allocator; // For the spawn's memory (NULL for the
+                               // process wide allocator - see SHELLSPAWN_ALLOCATOR)
+    // Set by shellspawn_attr_prepare()
+    int prepared;
+    int callbacks;             // Number of callback handlers bound
+} SHELLSPAWN_ATTR;
+
+// Sets the attributes to the defaults - no streams bound, the caller's
+// environment and working directory, no timeout or limits, and the output
+// callbacks passed each read (with '\n' as the line delimiter if lines is
+// enabled)
+// Note: Linux / OSX only at the moment
+void shellspawn_attr_init(SHELLSPAWN_ATTR *attr);
+
+// Validates the attributes and works out everything that does not depend on
+// the command. Returns SHELLSPAWN_OK or the code (and errorText) shellspawn()
+// would return for them
+// Note: Linux / OSX only at the moment
+int shellspawn_attr_prepare(SHELLSPAWN_ATTR *attr, char **errorText);
+
+// As shellspawn() but with the streams and options taken from attr
+// Note: Linux / OSX only at the moment
+int shellspawn_ex(const char *command,
+                  const SHELLSPAWN_ATTR *attr,
+                  int *rc,
+                  char **errorText,
+                  void* context);
+
+// Spawn context - owns the buffers (command line, argv, executable path, read
+// buffers and line buffers) and thread synchronisation objects a spawn needs, so that
+// successive spawns through the same context reuse them rather than allocating
+// and initialising them each time. The buffers only ever grow, to the largest
+// size needed so far
+// - A context can only be used by one shellspawn_run() call at a time (use a
+//   context per thread)
+// - The caller's output (vectors, strings and error texts) is still allocated
+//   for each call and belongs to the caller as usual
+// - The context itself comes from the process wide allocator, and its buffers
+//   from the allocator of the spawn using them (they are freed and allocated
+//   again if a spawn uses a different allocator)
+typedef struct shellspawn_context SHELLSPAWN_CONTEXT;
+
+// Creates a context (NULL if out of memory)
+// Note: Linux / OSX only at the moment
+SHELLSPAWN_CONTEXT* shellspawn_context_create(void);
+
+// Frees a context (and everything it owns)
+// Note: Linux / OSX only at the moment
+void shellspawn_context_free(SHELLSPAWN_CONTEXT* spawnContext);
+
+// As shellspawn_ex() but using (and keeping) the resources in spawnContext
+// Note: Linux / OSX only at the moment
+int shellspawn_run(SHELLSPAWN_CONTEXT* spawnContext,
+                   const char *command,
+                   const SHELLSPAWN_ATTR *attr,
+                   int *rc,
+                   char **errorText,
+                   void* context);
+
+// Asynchronous spawns - the child is started and the call returns at once. The
+// caller then does the I/O itself on nonblocking fds from its own event loop
+// (poll(), epoll etc.) so no threads are used, and any number of children can
+// be in flight on one thread
+// - Of the attr's stream bindings only sIn, pIn, pOut and pErr can be used
+//   (others give SHELLSPAWN_FAILURE). An unbound stdout or stderr is a pipe
+//   read with shellspawn_async_read(); an unbound stdin is closed
+// - sIn is written by shellspawn_async_write() so must stay valid until it
+//   returns 0
+// - env, cwd, limits and timeoutMs work as for shellspawn_ex(); the timeout is
+//   applied by shellspawn_async_wait()
+// - The call is shown by shellspawn_progress() and its telemetry recorded
+//   (for the thread that calls shellspawn_async_wait()) once it has finished
+// - A handle must only be used by one thread at a time
+typedef struct shellspawn_async SHELLSPAWN_ASYNC;
+
+// Streams (fds) of an asynchronous spawn
+#define SHELLSPAWN_STREAM_IN   0  // Writable - stdin (only while sIn is written)
+#define SHELLSPAWN_STREAM_OUT  1  // Readable - stdout
+#define SHELLSPAWN_STREAM_ERR  2  // Readable - stderr
+#define SHELLSPAWN_STREAM_EXIT 3  // Readable once the child has exited (Linux
+                                  // 5.3+ pidfd, otherwise -1)
+
+// shellspawn_async_wait() return code - the child is still running
+#define SHELLSPAWN_RUNNING   -1
+
+// Starts the command. On SHELLSPAWN_OK *async is the handle (which the caller
+// frees with shellspawn_async_free()), otherwise the codes are as shellspawn_ex()
+// Note: Linux / OSX only at the moment
+int shellspawn_async_start(const char *command,
+                           const SHELLSPAWN_ATTR *attr,
+                           SHELLSPAWN_ASYNC **async,
+                           char **errorText,
+                           void* context);
+
+// The fd of a SHELLSPAWN_STREAM_xxx to wait on, or -1 if there is none (not a
+// pipe, or finished with)
+// Note: Linux / OSX only at the moment
+int shellspawn_async_fd(SHELLSPAWN_ASYNC *async, int stream);
+
+// Reads the child's stdout or stderr (SHELLSPAWN_STREAM_OUT/ERR) - as read()
+// returns the bytes read, 0 at the end of the stream or -1 with errno set,
+// EAGAIN meaning that there is nothing to read yet
+// Note: Linux / OSX only at the moment
+long shellspawn_async_read(SHELLSPAWN_ASYNC *async, int stream, char *buffer, size_t size);
+
+// Writes as much of sIn to the child's stdin as it will take. Returns 1 if there
+// is more to write (wait for SHELLSPAWN_STREAM_IN to be writable), 0 once it has
+// all been written or the child has closed its stdin (stdin is then closed), or
+// -1 with errno set
+// Note: Linux / OSX only at the moment
+int shellspawn_async_write(SHELLSPAWN_ASYNC *async);
+
+// Reaps the child if it has exited - blocking until it does if block is set.
+// Returns SHELLSPAWN_RUNNING, or SHELLSPAWN_OK with the child's return code in
+// rc, SHELLSPAWN_TIMEOUT or SHELLSPAWN_FAILURE (with errorText set). Once the
+// child has been reaped the same result (and timeout text) is returned by any
+// later calls
+// Note: Linux / OSX only at the moment
+int shellspawn_async_wait(SHELLSPAWN_ASYNC *async, int block, int *rc, char **errorText);
+
+// Milliseconds until the timeout (see shellspawn_async_wait()), or -1 if there
+// is none (or the child has been killed already). Use it as the event loop's
+// wait limit
+// Note: Linux / OSX only at the moment
+long shellspawn_async_timeout(SHELLSPAWN_ASYNC *async);
+
+// Frees the handle - a child still running is killed (and reaped) first
+// Note: Linux / OSX only at the moment
+void shellspawn_async_free(SHELLSPAWN_ASYNC *async);
+
+// Child process states (see SHELLSPAWN_PROGRESS)
+#define SHELLSPAWN_STATE_STARTING 0
+#define SHELLSPAWN_STATE_RUNNING  1
+#define SHELLSPAWN_STATE_STOPPED  2
+#define SHELLSPAWN_STATE_EXITED   3
+
+// Snapshot of the I/O progress of an in-flight shellspawn() call
+// - Byte and line counts only cover streams shellspawn() reads or writes itself,
+//   streams redirected to a FILE* are not counted
+// - In callback input (fIn) mode the child is managed by a proxy process so the
+//   state will only be running or exited
+typedef struct shellspawn_progress {
+    void* context;                  // context passed to shellspawn()
+    int pid;                        // child process id (0 if not started yet)
+    int state;                      // SHELLSPAWN_STATE_xxx
+    unsigned long long outBytes;    // bytes read from the child's stdout
+    unsigned long long outLines;    // lines read from the child's stdout
+    unsigned long long errBytes;    // bytes read from the child's stderr
+    unsigned long long errLines;    // lines read from the child's stderr
+    unsigned long long inBytes;     // bytes written to the child's stdin
+    unsigned long long msRunning;   // milliseconds since shellspawn() was called
+    unsigned long long msSinceOutput; // milliseconds since the last stdout/stderr
+                                      // data (or since the call if none yet)
+} SHELLSPAWN_PROGRESS;
+
+// Get the progress of the shellspawn() calls in flight (in any thread)
+// - Fills in up to max entries of progress
+// - Returns the number of calls in flight (which may be more than max)
+// - Can be called from any thread, including from within a callback handler
+// Note: Linux / OSX only at the moment
+int shellspawn_progress(SHELLSPAWN_PROGRESS *progress, int max);
+
+// Log-linear (HDR style) histogram - each power of two range is split into 8
+// linear sub-buckets so values are recorded to within 12.5%. Values up to 2^41
+// are distinguished, larger values are counted in the last bucket
+#define SHELLSPAWN_HISTOGRAM_BUCKETS 312
+typedef struct shellspawn_histogram {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long long buckets[SHELLSPAWN_HISTOGRAM_BUCKETS];
+} SHELLSPAWN_HISTOGRAM;
+
+// Returns the (lower bound of the bucket holding the) value at percentile
+// (0-100) of the histogram, or 0 if it is empty
+// Note: Linux / OSX only at the moment
+unsigned long long shellspawn_percentile(const SHELLSPAWN_HISTOGRAM *histogram,
+                                         double percentile);
+
+// Pipe backpressure telemetry for a stdout/stderr pipe read by shellspawn()
+// - A read that fills the read buffer implies a backlog in the pipe, the
+//   backlog is then sampled (FIONREAD)
+// - If the pipe was full before a read the child was probably blocked writing
+//   to it; the time since the previous read is counted as blocked time
+typedef struct shellspawn_pipestats {
+    unsigned long long reads;      // read() calls returning data
+    unsigned long long fullReads;  // reads that filled the read buffer
+    unsigned long long fullPipes;  // reads that found the pipe full
+    unsigned long long blockedNs;  // estimated time the child was blocked (ns)
+    SHELLSPAWN_HISTOGRAM backlog;  // bytes left in the pipe after each read
+    SHELLSPAWN_HISTOGRAM blocked;  // estimated child-blocked time (ns) per
+                                   // episode of consecutive full pipes
+} SHELLSPAWN_PIPESTATS;
+
+// Callback handler timings for a stream
+// - Callbacks are run on the thread that called shellspawn() so each one
+//   involves a hop from the stream's worker thread
+typedef struct shellspawn_callbackstats {
+    SHELLSPAWN_HISTOGRAM dispatch; // ns from the data being read (or the input
+                                   // being requested) until the callback starts
+    SHELLSPAWN_HISTOGRAM run;      // ns the callback ran for
+} SHELLSPAWN_CALLBACKSTATS;
+
+// Telemetry collected by shellspawn() calls
+typedef struct shellspawn_stats {
+    unsigned long long spawns;     // Number of shellspawn() calls included
+    unsigned long long results[SHELLSPAWN_RESULTS]; // Calls by return code
+    unsigned long long peakInFlight; // Most calls in flight at once (including
+                                     // the calls themselves)
+    SHELLSPAWN_HISTOGRAM spawnLatency; // ns from the call until the child started
+    SHELLSPAWN_HISTOGRAM duration;   // ns the call took
+    SHELLSPAWN_PIPESTATS out;      // Child's stdout
+    SHELLSPAWN_PIPESTATS err;      // Child's stderr
+    SHELLSPAWN_CALLBACKSTATS inCallback;  // fIn callbacks
+    SHELLSPAWN_CALLBACKSTATS outCallback; // fOut callbacks
+    SHELLSPAWN_CALLBACKSTATS errCallback; // fErr callbacks
+    // Library overhead
+    unsigned long long callerCpuNs;  // CPU used by the calling thread inside
+                                     // shellspawn() - excluding callbacks
+    unsigned long long helperCpuNs;  // CPU used by shellspawn()'s worker threads
+    unsigned long long inBytes;      // Bytes written to the child's stdin
+    unsigned long long outBytes;     // Bytes read from the child's stdout
+    unsigned long long errBytes;     // Bytes read from the child's stderr
+    // Child resource usage. In callback input (fIn) mode this includes the
+    // proxy process that manages the child
+    unsigned long long childUserUs;  // User CPU
+    unsigned long long childSystemUs; // System CPU
+    long childMaxRssKB;              // Largest peak RSS of the child(ren)
+} SHELLSPAWN_STATS;
+
+// Library CPU overhead (callerCpuNs + helperCpuNs) of the stats in CPU
+// microseconds per shellspawn() call and per MB (10^6 bytes) transferred to
+// or from the child. Either pointer can be NULL
+void shellspawn_overhead(const SHELLSPAWN_STATS *stats,
+                         double *usPerSpawn, double *usPerMB);
+
+// Renders the telemetry totals (see shellspawn_totalstats()) as OpenMetrics
+// (Prometheus compatible) text into buffer
+// - Works like snprintf(): writes at most size bytes including a trailing null
+//   and returns the length of the full text, so if the result is size or more
+//   the text was truncated and a buffer of result + 1 bytes is needed
+// - Does not allocate any memory so it can be called often
+// Note: Linux / OSX only at the moment
+size_t shellspawn_metrics(char *buffer, size_t size);
+
+// Sets the stats structure that subsequent shellspawn() calls from this thread
+// add their telemetry to (NULL to stop). The caller should zero it first, and
+// can zero it before each call to get per call stats
+// Note: Linux / OSX only at the moment
+void shellspawn_setstats(SHELLSPAWN_STATS *stats);
+
+// Gets the telemetry of all shellspawn() calls (from any thread) since the
+// program started or shellspawn_resetstats() was called
+// Note: Linux / OSX only at the moment
+void shellspawn_totalstats(SHELLSPAWN_STATS *stats);
+void shellspawn_resetstats(void);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
\ No newline at end of file
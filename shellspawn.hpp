@@ -0,0 +1,355 @@
+// *************************************************************************
+// A B O U T   T H I S   W O R K  -   S H E L L S P A W N
+// *************************************************************************
+// Work Name   : ShellSpawn
+// Description : This provides a simple interface to spawn a process
+//             : with redirected input and output
+// Copyright   : Copyright (C) 2008,2021 Adrian Sutherland
+// *************************************************************************
+// A B O U T   T H I S   F I L E
+// *************************************************************************
+// File Name   : shellspawn.hpp
+// Description : C++17 wrapper of the library (header only)
+// *************************************************************************
+// L I C E N S E
+// *************************************************************************
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of version 3 of the GNU General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//
+// For the avoidance of doubt:
+// - Version 3 of the license (i.e. not earlier nor later versions) apply.
+// - a copy of the license text should be in the "license" directory of the
+//   source distribution.
+// - Requests for use under other licenses will be treated sympathetically,
+//   please see contact details.
+// *************************************************************************
+// C O N T A C T   D E T A I L S
+// *************************************************************************
+// E-mail      : adrian@sutherlandonline.org
+// *************************************************************************
+
+// Usage:
+//
+//     shell::Process ls("ls -l");
+//     ls.directory("/tmp").timeout(std::chrono::seconds(5));
+//     shell::Result result = ls.run();   // throws shell::Error
+//     for (std::string_view line : result.outLines()) ...
+//
+// - A Process holds the command and its options and can be run any number of
+//   times. It owns a spawn context (see shellspawn.h) so repeated runs reuse
+//   the library's buffers. It is move-only and not for concurrent use
+// - A Result owns the captured stdout and stderr - the buffers the library
+//   allocated are taken over, not copied - and gives string_view (and line)
+//   views of all of it (including any nulls). It is move-only; the views are
+//   valid while it lives
+// - Failures are thrown as shell::Error, with the library's return code
+//   as an Errc. The library's error text is always freed
+// Note: Linux / OSX only at the moment
+
+#ifndef shellspawn_hpp
+#define shellspawn_hpp
+
+#include <cstdlib>
+#include <chrono>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "shellspawn.h"
+
+namespace shell {
+
+// Frees memory allocated by the C library (the wrapper's spawns use the
+// process wide allocator - see shellspawn_setallocator())
+struct CFree {
+    void operator()(void *pointer) const { shellspawn_free(nullptr, pointer); }
+};
+using CString = std::unique_ptr<char, CFree>;
+
+// Library return codes (SHELLSPAWN_xxx)
+enum class Errc {
+    TooManyIn = SHELLSPAWN_TOOMANYIN,
+    TooManyOut = SHELLSPAWN_TOOMANYOUT,
+    TooManyErr = SHELLSPAWN_TOOMANYERR,
+    NotFound = SHELLSPAWN_NOFOUND,
+    Failure = SHELLSPAWN_FAILURE,
+    Timeout = SHELLSPAWN_TIMEOUT,
+    Overflow = SHELLSPAWN_OVERFLOW
+};
+
+// A spawn failure (not the child's return code - see Result::rc())
+class Error : public std::runtime_error {
+public:
+    Error(Errc code, const std::string &text) : std::runtime_error(text), code_(code) {}
+    Errc code() const noexcept { return code_; }
+
+private:
+    Errc code_;
+};
+
+// Forward range of the lines of a text, as views into it. Lines are split at
+// '\n' (which is dropped) and a last unterminated line is included - the same
+// lines the library's vector (aOut) mode gives
+class Lines {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string_view*;
+        using reference = const std::string_view&;
+
+        iterator() = default; // The end
+        explicit iterator(std::string_view text) : rest_(text), done_(text.empty()) {
+            if (!done_) next();
+        }
+
+        reference operator*() const { return line_; }
+        pointer operator->() const { return &line_; }
+        iterator& operator++() {
+            if (rest_.empty()) done_ = true;
+            else next();
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator previous = *this;
+            ++*this;
+            return previous;
+        }
+        bool operator==(const iterator &other) const {
+            return done_ == other.done_ && (done_ || line_.data() == other.line_.data());
+        }
+        bool operator!=(const iterator &other) const { return !(*this == other); }
+
+    private:
+        // Splits the next line off the rest of the text
+        void next() {
+            std::size_t newline = rest_.find('\n');
+            if (newline == std::string_view::npos) {
+                line_ = rest_;
+                rest_ = std::string_view();
+            } else {
+                line_ = rest_.substr(0, newline);
+                rest_ = rest_.substr(newline + 1);
+            }
+        }
+
+        std::string_view rest_; // Text after line_
+        std::string_view line_;
+        bool done_ = true;
+    };
+
+    explicit Lines(std::string_view text) : text_(text) {}
+    iterator begin() const { return iterator(text_); }
+    iterator end() const { return iterator(); }
+
+    // The lines as a vector (of views)
+    std::vector<std::string_view> toVector() const { return std::vector<std::string_view>(begin(), end()); }
+
+private:
+    std::string_view text_;
+};
+
+// Output of a run - owns the captured stdout and stderr
+class Result {
+public:
+    Result() = default;
+    Result(Result &&other) noexcept { *this = std::move(other); }
+    Result& operator=(Result &&other) noexcept {
+        rc_ = other.rc_;
+        out_ = std::move(other.out_);
+        err_ = std::move(other.err_);
+        outView_ = std::exchange(other.outView_, std::string_view());
+        errView_ = std::exchange(other.errView_, std::string_view());
+        return *this;
+    }
+    Result(const Result&) = delete;
+    Result& operator=(const Result&) = delete;
+
+    int rc() const noexcept { return rc_; }
+    std::string_view out() const noexcept { return outView_; }
+    std::string_view err() const noexcept { return errView_; }
+    Lines outLines() const noexcept { return Lines(outView_); }
+    Lines errLines() const noexcept { return Lines(errView_); }
+
+    // Hands the (malloc()ed, null terminated) stdout or stderr buffer over to
+    // the caller - the Result's view of it is then empty
+    CString releaseOut() noexcept {
+        outView_ = std::string_view();
+        return std::move(out_);
+    }
+    CString releaseErr() noexcept {
+        errView_ = std::string_view();
+        return std::move(err_);
+    }
+
+private:
+    friend class Process;
+    friend class Child; // shellspawnasync.hpp
+
+    // Takes over a buffer (of length bytes - it can hold nulls) from the library
+    static void Adopt(char *text, std::size_t length, CString &owner, std::string_view &view) noexcept {
+        owner.reset(text);
+        view = text ? std::string_view(text, length) : std::string_view();
+    }
+
+    int rc_ = 0;
+    CString out_;
+    CString err_;
+    std::string_view outView_; // Views of the buffers (which do not move when
+    std::string_view errView_; // the Result does)
+};
+
+// A command and its options - see the Usage notes above
+class Process {
+public:
+    explicit Process(std::string command) : command_(std::move(command)) {
+        shellspawn_attr_init(&attr_);
+        spawnContext_.reset(shellspawn_context_create());
+        if (!spawnContext_) throw std::bad_alloc();
+    }
+    Process(Process&&) noexcept = default;
+    Process& operator=(Process&&) noexcept = default;
+    Process(const Process&) = delete;
+    Process& operator=(const Process&) = delete;
+
+    // Input - text written to stdin, or a file (the default closes stdin)
+    Process& input(std::string text) {
+        input_ = std::move(text);
+        inputSet_ = true;
+        attr_.pIn = nullptr;
+        return *this;
+    }
+    Process& input(FILE *file) {
+        attr_.pIn = file;
+        inputSet_ = false;
+        return *this;
+    }
+
+    // Output - stdout and stderr are captured (into the Result) by default.
+    // They can go to a file instead, or be discarded
+    Process& output(FILE *file) {
+        attr_.pOut = file;
+        captureOut_ = false;
+        return *this;
+    }
+    Process& error(FILE *file) {
+        attr_.pErr = file;
+        captureErr_ = false;
+        return *this;
+    }
+    Process& discardOutput() { return output(nullptr); }
+    Process& discardError() { return error(nullptr); }
+
+    // Child's environment ("NAME=value" strings) replacing the caller's
+    Process& environment(std::vector<std::string> env) {
+        env_ = std::move(env);
+        envPointers_.clear();
+        for (std::string &variable : env_) envPointers_.push_back(&variable[0]);
+        envPointers_.push_back(nullptr);
+        attr_.env = envPointers_.data();
+        return *this;
+    }
+    Process& directory(std::string cwd) {
+        cwd_ = std::move(cwd);
+        attr_.cwd = cwd_.c_str();
+        return *this;
+    }
+    Process& timeout(std::chrono::milliseconds limit) {
+        attr_.timeoutMs = static_cast<unsigned long>(limit.count());
+        return *this;
+    }
+    Process& limits(const SHELLSPAWN_LIMITS &limits) {
+        attr_.limits = limits;
+        return *this;
+    }
+    Process& readBufferSize(std::size_t size) {
+        attr_.readBufferSize = size;
+        return *this;
+    }
+
+    const std::string& command() const noexcept { return command_; }
+    bool capturesOutput() const noexcept { return captureOut_; }
+    bool capturesError() const noexcept { return captureErr_; }
+
+    // The attributes for a spawn as set up, with the captured streams left
+    // unbound. They point into the Process so are valid until it is changed
+    SHELLSPAWN_ATTR attributes() const noexcept {
+        SHELLSPAWN_ATTR attr = attr_;
+
+        // The string members move, so the pointers into them are set here
+        attr.sIn = inputSet_ ? const_cast<char*>(input_.c_str()) : nullptr;
+        if (attr.env) attr.env = const_cast<char**>(envPointers_.data());
+        if (attr.cwd) attr.cwd = cwd_.c_str();
+        return attr;
+    }
+
+    // Runs the command to completion - throws Error if the spawn fails. context
+    // is reported by shellspawn_progress()
+    Result run(void *context = nullptr) {
+        Result result;
+        char *out = nullptr;
+        char *err = nullptr;
+        std::size_t outLength = 0;
+        std::size_t errLength = 0;
+        char *errorText = nullptr;
+        SHELLSPAWN_ATTR attr = attributes();
+        int code;
+
+        attr.sOut = captureOut_ ? &out : nullptr;
+        attr.sErr = captureErr_ ? &err : nullptr;
+        attr.sOutLength = &outLength;
+        attr.sErrLength = &errLength;
+
+        code = shellspawn_run(spawnContext_.get(), command_.c_str(), &attr, &result.rc_, &errorText, context);
+        Result::Adopt(out, outLength, result.out_, result.outView_);
+        Result::Adopt(err, errLength, result.err_, result.errView_);
+
+        if (code != SHELLSPAWN_OK) {
+            CString text(errorText);
+            throw Error(static_cast<Errc>(code), text ? text.get() : "shellspawn failed");
+        }
+        if (errorText) shellspawn_free(nullptr, errorText);
+        return result;
+    }
+
+private:
+    struct ContextFree {
+        void operator()(SHELLSPAWN_CONTEXT *spawnContext) const { shellspawn_context_free(spawnContext); }
+    };
+
+    std::string command_;
+    SHELLSPAWN_ATTR attr_;
+    std::unique_ptr<SHELLSPAWN_CONTEXT, ContextFree> spawnContext_;
+    std::string input_;
+    bool inputSet_ = false;
+    bool captureOut_ = true;
+    bool captureErr_ = true;
+    std::vector<std::string> env_;
+    std::vector<char*> envPointers_;
+    std::string cwd_;
+};
+
+// Runs a command with the default options (no input, output captured)
+inline Result run(std::string command) {
+    return Process(std::move(command)).run();
+}
+
+} // namespace shell
+
+#endif
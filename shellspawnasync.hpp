@@ -0,0 +1,560 @@
+// *************************************************************************
+// A B O U T   T H I S   W O R K  -   S H E L L S P A W N
+// *************************************************************************
+// Work Name   : ShellSpawn
+// Description : This provides a simple interface to spawn a process
+//             : with redirected input and output
+// Copyright   : Copyright (C) 2008,2021 Adrian Sutherland
+// *************************************************************************
+// A B O U T   T H I S   F I L E
+// *************************************************************************
+// File Name   : shellspawnasync.hpp
+// Description : C++20 coroutine interface (header only)
+// *************************************************************************
+// L I C E N S E
+// *************************************************************************
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of version 3 of the GNU General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//
+// For the avoidance of doubt:
+// - Version 3 of the license (i.e. not earlier nor later versions) apply.
+// - a copy of the license text should be in the "license" directory of the
+//   source distribution.
+// - Requests for use under other licenses will be treated sympathetically,
+//   please see contact details.
+// *************************************************************************
+// C O N T A C T   D E T A I L S
+// *************************************************************************
+// E-mail      : adrian@sutherlandonline.org
+// *************************************************************************
+
+// Usage:
+//
+//     shell::Task<> job(shell::EventLoop &loop, const shell::Process &ls) {
+//         shell::Result result = co_await shell::run(loop, ls);
+//         ...
+//         shell::Child child(loop, ls);
+//         while (auto line = co_await child.nextLine()) ...   // *line is a string_view
+//         result = co_await child.wait();
+//     }
+//     loop.spawn(job(loop, ls));   // any number of jobs
+//     loop.run();                  // until they have all finished
+//
+// - Children are run with the library's asynchronous spawns (see
+//   shellspawn_async_start()): their pipes are nonblocking and polled by the
+//   EventLoop on the thread that runs it, so there are no threads per child
+// - A Process given to run() or a Child must outlive it (its input is written
+//   from the Process)
+// - Input must be a string or a FILE* - there are no callbacks
+// Note: Linux / OSX only at the moment
+
+#ifndef shellspawnasync_hpp
+#define shellspawnasync_hpp
+
+#include <poll.h>
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "shellspawn.hpp"
+
+namespace shell {
+
+template <typename T> class Task;
+class EventLoop;
+
+namespace detail {
+
+// Promise parts common to Task<T> and Task<void>
+struct PromiseBase {
+    // Resumes the awaiting coroutine (if any) when the task finishes
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept {
+            std::coroutine_handle<> continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() noexcept { exception = std::current_exception(); }
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+    Task<T> get_return_object() noexcept;
+    template <typename U> void return_value(U &&value) { result_.emplace(std::forward<U>(value)); }
+    T result() {
+        if (exception) std::rethrow_exception(exception);
+        return std::move(*result_);
+    }
+
+    std::optional<T> result_;
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object() noexcept;
+    void return_void() const noexcept {}
+    void result() {
+        if (exception) std::rethrow_exception(exception);
+    }
+};
+
+} // namespace detail
+
+// A coroutine giving a T. It is lazy - it starts when it is co_await-ed (or
+// given to the EventLoop) and resumes its awaiter when it finishes
+template <typename T = void>
+class [[nodiscard]] Task {
+public:
+    using promise_type = detail::Promise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) noexcept : handle_(handle) {}
+    Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    Task& operator=(Task &&other) noexcept {
+        if (this != &other) {
+            if (handle_) handle_.destroy();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (handle_) handle_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        handle_.promise().continuation = awaiter;
+        return handle_;
+    }
+    T await_resume() { return handle_.promise().result(); }
+
+private:
+    friend class EventLoop;
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+template <typename T>
+Task<T> detail::Promise<T>::get_return_object() noexcept {
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> detail::Promise<void>::get_return_object() noexcept {
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+// Single threaded poll() loop - resumes the coroutines waiting for fds or
+// timeouts. Not for use from more than one thread
+class EventLoop {
+public:
+    static constexpr std::size_t MaxFds = 4;
+
+    // Awaitable (see wait()) - resumes once any of its fds is ready or its
+    // timeout has passed
+    class Wait {
+    public:
+        Wait(const Wait&) = delete;
+        Wait& operator=(const Wait&) = delete;
+        ~Wait() {
+            if (waiting_) loop_.Remove(this);
+        }
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            handle_ = handle;
+            loop_.Add(this);
+        }
+        void await_resume() const noexcept {}
+
+    private:
+        friend class EventLoop;
+
+        Wait(EventLoop &loop, const pollfd *fds, std::size_t count, long timeoutMs) noexcept : loop_(loop) {
+            for (; count_ < count && count_ < MaxFds; count_++) {
+                fds_[count_] = fds[count_];
+                fds_[count_].revents = 0;
+            }
+            if (timeoutMs >= 0) deadline_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        }
+
+        bool Ready(std::chrono::steady_clock::time_point now) const noexcept {
+            for (std::size_t i = 0; i < count_; i++) if (fds_[i].revents) return true;
+            return deadline_ && now >= *deadline_;
+        }
+
+        EventLoop &loop_;
+        pollfd fds_[MaxFds]; // The first count_ are used
+        std::size_t count_ = 0;
+        std::optional<std::chrono::steady_clock::time_point> deadline_;
+        std::coroutine_handle<> handle_;
+        bool waiting_ = false;
+        std::size_t index_ = 0; // In the loop's waiting_
+    };
+
+    EventLoop() = default;
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Waits (co_await) until one of the count fds (up to MaxFds, fd -1 is
+    // ignored) is ready for its events, or for timeoutMs (-1 for no limit)
+    Wait wait(const pollfd *fds, std::size_t count, long timeoutMs = -1) noexcept {
+        return Wait(*this, fds, count, timeoutMs);
+    }
+
+    // Starts a task which the loop then owns. Its exception (if any) is thrown
+    // from run()
+    void spawn(Task<> task) {
+        task.handle_.resume();
+        tasks_.push_back(std::move(task));
+    }
+
+    // Runs until all the spawned tasks have finished
+    void run() {
+        Reap();
+        while (!tasks_.empty()) {
+            Step();
+            Reap();
+        }
+    }
+
+    // Runs until task has finished and gives its result
+    template <typename T>
+    T run(Task<T> task) {
+        task.handle_.resume();
+        while (!task.handle_.done()) Step();
+        return task.handle_.promise().result();
+    }
+
+private:
+    // One poll() - then resumes the waits that are ready
+    void Step() {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        int timeoutMs = -1;
+        std::size_t i, j;
+
+        if (waiting_.empty()) throw std::logic_error("shell::EventLoop - tasks are suspended but nothing is awaited");
+
+        pollFds_.clear();
+        for (Wait *wait : waiting_) {
+            for (j = 0; j < wait->count_; j++) pollFds_.push_back(wait->fds_[j]);
+            if (wait->deadline_) {
+                long long ms = std::chrono::ceil<std::chrono::milliseconds>(*wait->deadline_ - now).count();
+                if (ms < 0) ms = 0;
+                if (timeoutMs == -1 || ms < timeoutMs) timeoutMs = (int)ms;
+            }
+        }
+        if (poll(pollFds_.data(), pollFds_.size(), timeoutMs) == -1) {
+            if (errno == EINTR) return;
+            throw std::system_error(errno, std::generic_category(), "shell::EventLoop poll()");
+        }
+
+        std::size_t n = 0;
+        for (Wait *wait : waiting_)
+            for (j = 0; j < wait->count_; j++) wait->fds_[j].revents = pollFds_[n++].revents;
+
+        // Resuming can add and remove waits - those removed ahead of i are
+        // just picked up by the next Step()
+        now = std::chrono::steady_clock::now();
+        for (i = 0; i < waiting_.size();) {
+            Wait *wait = waiting_[i];
+            if (!wait->Ready(now)) {
+                i++;
+                continue;
+            }
+            Remove(wait);
+            wait->handle_.resume();
+        }
+    }
+
+    // Destroys the finished tasks - rethrowing their exception
+    void Reap() {
+        std::size_t i;
+
+        for (i = 0; i < tasks_.size();) {
+            if (!tasks_[i].handle_.done()) {
+                i++;
+                continue;
+            }
+            Task<> task = std::move(tasks_[i]);
+            tasks_[i] = std::move(tasks_.back());
+            tasks_.pop_back();
+            task.handle_.promise().result();
+        }
+    }
+
+    void Add(Wait *wait) {
+        wait->index_ = waiting_.size();
+        wait->waiting_ = true;
+        waiting_.push_back(wait);
+    }
+
+    void Remove(Wait *wait) noexcept {
+        waiting_[wait->index_] = waiting_.back();
+        waiting_[wait->index_]->index_ = wait->index_;
+        waiting_.pop_back();
+        wait->waiting_ = false;
+    }
+
+    std::vector<Wait*> waiting_;
+    std::vector<pollfd> pollFds_; // Reused by each Step()
+    std::vector<Task<>> tasks_;
+};
+
+// A child started on an EventLoop. Its stdout can be read a line at a time
+// (nextLine()), and wait() finishes it giving the Result - with whatever
+// stdout was not read as lines
+class Child {
+public:
+    // Starts process's command - throws Error if it cannot. context is
+    // reported by shellspawn_progress()
+    Child(EventLoop &loop, const Process &process, void *context = nullptr)
+        : loop_(loop), discardOut_(!process.capturesOutput()), discardErr_(!process.capturesError()) {
+        SHELLSPAWN_ATTR attr = process.attributes();
+        char *errorText = nullptr;
+        int code = shellspawn_async_start(process.command().c_str(), &attr, &async_, &errorText, context);
+
+        if (code != SHELLSPAWN_OK) {
+            CString text(errorText);
+            throw Error(static_cast<Errc>(code), text ? text.get() : "shellspawn failed");
+        }
+        if (errorText) shellspawn_free(nullptr, errorText);
+        if (attr.readBufferSize) readSize_ = attr.readBufferSize;
+    }
+    Child(const Child&) = delete;
+    Child& operator=(const Child&) = delete;
+    ~Child() {
+        shellspawn_async_free(async_); // Kills the child if it is still running
+        shellspawn_free(nullptr, out_.text);
+        shellspawn_free(nullptr, err_.text);
+    }
+
+    // Awaitable (see nextLine()) - only suspends when a read is needed
+    class NextLine {
+    public:
+        bool await_ready() { return child_.TakeLine(line_); }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+            fill_.emplace(child_.Pump(true));
+            return fill_->await_suspend(awaiter);
+        }
+        std::optional<std::string_view> await_resume() {
+            if (fill_) {
+                fill_->await_resume(); // Throws any read error
+                child_.TakeLine(line_);
+            }
+            return line_;
+        }
+
+    private:
+        friend class Child;
+        explicit NextLine(Child &child) noexcept : child_(child) {}
+
+        Child &child_;
+        std::optional<Task<>> fill_;
+        std::optional<std::string_view> line_;
+    };
+
+    // Next line of stdout (without its '\n') - valid until the next call - or
+    // nullopt at the end of stdout. The last line need not end with '\n'
+    NextLine nextLine() noexcept { return NextLine(*this); }
+
+    // Writes the rest of the input, reads the rest of the output and reaps the
+    // child - throws Error if it failed or timed out
+    Task<Result> wait() {
+        Result result;
+        char *errorText = nullptr;
+        int code;
+        int rc = 0;
+
+        co_await Pump(false);
+        for (;;) {
+            code = shellspawn_async_wait(async_, 0, &rc, &errorText);
+            if (code != SHELLSPAWN_RUNNING) break;
+            // Without an exit fd (pidfd) we check every 10ms
+            pollfd exit = {shellspawn_async_fd(async_, SHELLSPAWN_STREAM_EXIT), POLLIN, 0};
+            long timeoutMs = shellspawn_async_timeout(async_);
+            if (exit.fd == -1 && (timeoutMs == -1 || timeoutMs > 10)) timeoutMs = 10;
+            co_await loop_.wait(&exit, 1, timeoutMs);
+        }
+        if (code != SHELLSPAWN_OK) {
+            CString text(errorText);
+            throw Error(static_cast<Errc>(code), text ? text.get() : "shellspawn failed");
+        }
+        if (errorText) shellspawn_free(nullptr, errorText);
+
+        result.rc_ = rc;
+        std::size_t length;
+        char *text = out_.Release(length);
+        Result::Adopt(text, length, result.out_, result.outView_);
+        text = err_.Release(length);
+        Result::Adopt(text, length, result.err_, result.errView_);
+        co_return result;
+    }
+
+private:
+    // Captured output - from the library's allocator so that the Result can
+    // take it over
+    struct Buffer {
+        char *text = nullptr;
+        std::size_t start = 0;    // Bytes before this have been taken (as lines)
+        std::size_t length = 0;
+        std::size_t capacity = 0;
+        bool ended = false;       // End of the stream
+
+        // Makes room for size more bytes (and a null)
+        char* Space(std::size_t size) {
+            if (start && start == length) start = length = 0;
+            if (length + size + 1 > capacity) {
+                if (start) { // Drop the lines taken
+                    std::memmove(text, text + start, length - start);
+                    length -= start;
+                    start = 0;
+                }
+                std::size_t grown = capacity ? capacity : size + 1;
+                while (grown < length + size + 1) grown *= 2;
+                char *bigger = static_cast<char*>(shellspawn_realloc(nullptr, text, grown));
+                if (!bigger) throw std::bad_alloc();
+                text = bigger;
+                capacity = grown;
+            }
+            return text + length;
+        }
+
+        // Hands the (null terminated) text not yet taken over to the caller,
+        // with its length (it can hold nulls)
+        char* Release(std::size_t &size) noexcept {
+            char *released = text;
+            size = 0;
+            if (!released) return nullptr;
+            size = length - start;
+            if (start) std::memmove(released, released + start, size);
+            released[size] = 0;
+            text = nullptr;
+            start = length = capacity = 0;
+            return released;
+        }
+    };
+
+    // Takes the next complete line of stdout (or the last, unterminated, one
+    // at the end of stdout). Returns false if a read is needed first
+    bool TakeLine(std::optional<std::string_view> &line) {
+        if (out_.start < out_.length) {
+            const char *begin = out_.text + out_.start;
+            const char *newline = static_cast<const char*>(std::memchr(begin, '\n', out_.length - out_.start));
+            if (newline) {
+                line = std::string_view(begin, newline - begin);
+                out_.start += newline - begin + 1;
+                return true;
+            }
+            if (!out_.ended) return false;
+            line = std::string_view(begin, out_.length - out_.start);
+            out_.start = out_.length;
+            return true;
+        }
+        line.reset();
+        return out_.ended;
+    }
+
+    bool HasLine() const noexcept {
+        return out_.ended || (out_.start < out_.length &&
+                              std::memchr(out_.text + out_.start, '\n', out_.length - out_.start));
+    }
+
+    // Does the child's I/O until a line can be taken (forLine) or until the
+    // input is written and stdout and stderr have ended
+    Task<> Pump(bool forLine) {
+        for (;;) {
+            Service();
+            if (forLine ? HasLine()
+                        : (out_.ended && err_.ended && shellspawn_async_fd(async_, SHELLSPAWN_STREAM_IN) == -1))
+                co_return;
+            pollfd fds[3] = {{shellspawn_async_fd(async_, SHELLSPAWN_STREAM_IN), POLLOUT, 0},
+                             {shellspawn_async_fd(async_, SHELLSPAWN_STREAM_OUT), POLLIN, 0},
+                             {shellspawn_async_fd(async_, SHELLSPAWN_STREAM_ERR), POLLIN, 0}};
+            co_await loop_.wait(fds, 3, shellspawn_async_timeout(async_));
+        }
+    }
+
+    // Writes and reads what can be done without blocking - and kills the child
+    // (see shellspawn_async_wait()) if it has timed out
+    void Service() {
+        int rc;
+
+        if (shellspawn_async_write(async_) == -1) Fail("Failure writing to the child's stdin");
+        Read(SHELLSPAWN_STREAM_OUT, out_, discardOut_);
+        Read(SHELLSPAWN_STREAM_ERR, err_, discardErr_);
+        if (shellspawn_async_timeout(async_) == 0) {
+            char *errorText = nullptr;
+            shellspawn_async_wait(async_, 0, &rc, &errorText); // wait() reports the result
+            shellspawn_free(nullptr, errorText);
+        }
+    }
+
+    // Reads a stream until there is nothing more to read for now. Reads fill
+    // the buffer's free space - at least readSize_ bytes
+    void Read(int stream, Buffer &buffer, bool discard) {
+        long n;
+
+        if (shellspawn_async_fd(async_, stream) == -1) buffer.ended = true; // Not a pipe
+        while (!buffer.ended) {
+            if (discard) buffer.start = buffer.length = 0;
+            char *space = buffer.Space(readSize_);
+            n = shellspawn_async_read(async_, stream, space, buffer.capacity - buffer.length - 1);
+            if (n > 0) buffer.length += (std::size_t)n;
+            else if (n == 0) buffer.ended = true;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            else if (errno != EINTR) Fail("Failure reading the child's output");
+        }
+    }
+
+    [[noreturn]] void Fail(const char *what) {
+        throw Error(Errc::Failure, std::string(what) + " - " + std::strerror(errno));
+    }
+
+    EventLoop &loop_;
+    SHELLSPAWN_ASYNC *async_ = nullptr;
+    bool discardOut_;
+    bool discardErr_;
+    std::size_t readSize_ = 4096;
+    Buffer out_;
+    Buffer err_;
+};
+
+// Runs process's command on loop - the coroutine form of Process::run()
+inline Task<Result> run(EventLoop &loop, const Process &process, void *context = nullptr) {
+    Child child(loop, process, context);
+    co_return co_await child.wait();
+}
+
+} // namespace shell
+
+#endif
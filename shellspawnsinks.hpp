@@ -0,0 +1,254 @@
+// *************************************************************************
+// A B O U T   T H I S   W O R K  -   S H E L L S P A W N
+// *************************************************************************
+// Work Name   : ShellSpawn
+// Description : This provides a simple interface to spawn a process
+//             : with redirected input and output
+// Copyright   : Copyright (C) 2008,2021 Adrian Sutherland
+// *************************************************************************
+// A B O U T   T H I S   F I L E
+// *************************************************************************
+// File Name   : shellspawnsinks.hpp
+// Description : C++17 output sinks - the reader loop is compiled for the
+//             : sink types (header only)
+// *************************************************************************
+// L I C E N S E
+// *************************************************************************
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of version 3 of the GNU General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//
+// For the avoidance of doubt:
+// - Version 3 of the license (i.e. not earlier nor later versions) apply.
+// - a copy of the license text should be in the "license" directory of the
+//   source distribution.
+// - Requests for use under other licenses will be treated sympathetically,
+//   please see contact details.
+// *************************************************************************
+// C O N T A C T   D E T A I L S
+// *************************************************************************
+// E-mail      : adrian@sutherlandonline.org
+// *************************************************************************
+
+// Usage:
+//
+//     shell::LineSink lines([&](std::string_view line) { ... });
+//     shell::RingSink<4096> tail;
+//     int rc = shell::run(process, lines, tail);   // throws shell::Error
+//
+// - shell::run() reads the child's stdout and stderr on the calling thread
+//   (polling the library's asynchronous spawn - see shellspawn_async_start())
+//   and passes each read to the sinks. It is a template so the sinks' calls
+//   are compiled (and inlined) into the read loop - unlike the C library there
+//   is no choice of sink made on each read, and no callback through a pointer
+// - A sink is any type with
+//       void write(const char *data, std::size_t size); // Each read
+//       void end();                                     // End of the stream
+// - The Process's output()/error() FILE*s still apply (the sink then just
+//   gets end()). Its input must be a string or a FILE*
+// Note: Linux / OSX only at the moment
+
+#ifndef shellspawnsinks_hpp
+#define shellspawnsinks_hpp
+
+#include <poll.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "shellspawn.hpp"
+
+namespace shell {
+
+// Throws the output away
+struct DiscardSink {
+    void write(const char*, std::size_t) noexcept {}
+    void end() noexcept {}
+};
+
+// Captures the stream into a string
+class StringSink {
+public:
+    void write(const char *data, std::size_t size) { text_.append(data, size); }
+    void end() noexcept {}
+
+    const std::string& str() const noexcept { return text_; }
+    std::string release() noexcept { return std::move(text_); }
+
+private:
+    std::string text_;
+};
+
+// Calls f(std::string_view) for each line (without its '\n'). Lines within a
+// read are passed straight from the read buffer; only a line split between
+// reads is copied (into a buffer kept for the next). A last unterminated
+// line is passed at the end
+template <typename F>
+class LineSink {
+public:
+    explicit LineSink(F f) : f_(std::move(f)) {}
+
+    void write(const char *data, std::size_t size) {
+        const char *end = data + size;
+        const char *newline;
+
+        while ((newline = static_cast<const char*>(std::memchr(data, '\n', end - data)))) {
+            if (partial_.empty()) f_(std::string_view(data, newline - data));
+            else {
+                partial_.append(data, newline - data);
+                f_(std::string_view(partial_));
+                partial_.clear();
+            }
+            data = newline + 1;
+        }
+        partial_.append(data, end - data);
+    }
+    void end() {
+        if (partial_.empty()) return;
+        f_(std::string_view(partial_));
+        partial_.clear();
+    }
+
+private:
+    F f_;
+    std::string partial_;
+};
+
+// Keeps the last N bytes of the stream (e.g. the tail of a log)
+template <std::size_t N>
+class RingSink {
+    static_assert(N > 0, "RingSink needs a size");
+
+public:
+    void write(const char *data, std::size_t size) {
+        if (size >= N) { // Only the end of it fits
+            std::memcpy(ring_, data + size - N, N);
+            head_ = 0;
+            length_ = N;
+            return;
+        }
+        std::size_t first = N - head_ < size ? N - head_ : size;
+        std::memcpy(ring_ + head_, data, first);
+        std::memcpy(ring_, data + first, size - first);
+        head_ = (head_ + size) % N;
+        length_ = length_ + size < N ? length_ + size : N;
+    }
+    void end() noexcept {}
+
+    // The bytes kept, oldest first
+    std::string str() const {
+        std::string text;
+        std::size_t start = (head_ + N - length_) % N;
+
+        text.reserve(length_);
+        if (start + length_ <= N) text.append(ring_ + start, length_);
+        else {
+            text.append(ring_ + start, N - start);
+            text.append(ring_, length_ - (N - start));
+        }
+        return text;
+    }
+
+private:
+    char ring_[N];
+    std::size_t head_ = 0;   // Where the next byte goes
+    std::size_t length_ = 0; // Bytes kept
+};
+
+namespace detail {
+
+struct AsyncFree {
+    void operator()(SHELLSPAWN_ASYNC *async) const { shellspawn_async_free(async); }
+};
+
+[[noreturn]] inline void ThrowErrno(const char *what) {
+    throw Error(Errc::Failure, std::string(what) + " - " + std::strerror(errno));
+}
+
+// Reads a stream into its sink until there is nothing more to read for now.
+// Returns false at the end of the stream
+template <typename Sink>
+bool ReadInto(SHELLSPAWN_ASYNC *async, int stream, char *buffer, std::size_t size, Sink &sink) {
+    for (;;) {
+        long n = shellspawn_async_read(async, stream, buffer, size);
+        if (n > 0) sink.write(buffer, (std::size_t)n);
+        else if (n == 0) {
+            sink.end();
+            return false;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+        else if (errno != EINTR) ThrowErrno("Failure reading the child's output");
+    }
+}
+
+} // namespace detail
+
+// Runs process's command with its stdout and stderr going to the sinks.
+// Returns the child's return code - throws Error if the spawn fails or times
+// out. context is reported by shellspawn_progress()
+template <typename OutSink, typename ErrSink>
+int run(const Process &process, OutSink &out, ErrSink &err, void *context = nullptr) {
+    SHELLSPAWN_ATTR attr = process.attributes();
+    SHELLSPAWN_ASYNC *started = nullptr;
+    char *errorText = nullptr;
+    int rc = 0;
+    int code = shellspawn_async_start(process.command().c_str(), &attr, &started, &errorText, context);
+
+    if (code != SHELLSPAWN_OK) {
+        CString text(errorText);
+        throw Error(static_cast<Errc>(code), text ? text.get() : "shellspawn failed");
+    }
+    std::unique_ptr<SHELLSPAWN_ASYNC, detail::AsyncFree> async(started);
+    std::vector<char> buffer(attr.readBufferSize ? attr.readBufferSize : 65536);
+    bool outOpen = true;
+    bool errOpen = true;
+
+    for (;;) {
+        if (shellspawn_async_write(async.get()) == -1) detail::ThrowErrno("Failure writing to the child's stdin");
+        if (outOpen) outOpen = detail::ReadInto(async.get(), SHELLSPAWN_STREAM_OUT, buffer.data(), buffer.size(), out);
+        if (errOpen) errOpen = detail::ReadInto(async.get(), SHELLSPAWN_STREAM_ERR, buffer.data(), buffer.size(), err);
+        if (!outOpen && !errOpen && shellspawn_async_fd(async.get(), SHELLSPAWN_STREAM_IN) == -1) break;
+
+        long timeoutMs = shellspawn_async_timeout(async.get());
+        if (timeoutMs == 0) { // Kills the child - the result is reported below
+            shellspawn_async_wait(async.get(), 0, &rc, &errorText);
+            shellspawn_free(nullptr, errorText);
+            errorText = nullptr;
+            continue;
+        }
+        pollfd fds[3] = {{shellspawn_async_fd(async.get(), SHELLSPAWN_STREAM_IN), POLLOUT, 0},
+                         {shellspawn_async_fd(async.get(), SHELLSPAWN_STREAM_OUT), POLLIN, 0},
+                         {shellspawn_async_fd(async.get(), SHELLSPAWN_STREAM_ERR), POLLIN, 0}};
+        if (poll(fds, 3, (int)timeoutMs) == -1 && errno != EINTR) detail::ThrowErrno("Failure in poll()");
+    }
+
+    code = shellspawn_async_wait(async.get(), 1, &rc, &errorText);
+    CString text(errorText);
+    if (code != SHELLSPAWN_OK) throw Error(static_cast<Errc>(code), text ? text.get() : "shellspawn failed");
+    return rc;
+}
+
+// As above with stderr discarded
+template <typename OutSink>
+int run(const Process &process, OutSink &out) {
+    DiscardSink err;
+    return run(process, out, err);
+}
+
+} // namespace shell
+
+#endif
@@ -87,6 +87,22 @@ void ErrHandle1(char *data, void *context)
     printf("ERR(%s)\n", data);
 }
 
+void OutHandle2(char *data, void *context)
+{
+    SHELLSPAWN_PROGRESS progress[4];
+    int n, i;
+
+    n = shellspawn_progress(progress, 4);
+    for (i=0; i<n && i<4; i++) {
+        if (progress[i].context != context) continue;
+        printf("PROGRESS(pid=%d state=%d out=%llu bytes/%llu lines err=%llu bytes/%llu lines in=%llu bytes)\n",
+               progress[i].pid, progress[i].state,
+               progress[i].outBytes, progress[i].outLines,
+               progress[i].errBytes, progress[i].errLines,
+               progress[i].inBytes);
+    }
+}
+
 int InHandle1(char **data, void *context)
 {
     char *response = "repeat\nBilly\n";
@@ -106,6 +122,42 @@ int InHandle2(char **data, void *context)
     return 0;
 }
 
+// Data callback - context is an unsigned long[2] of the bytes and nulls seen
+void DataHandle(const char *data, size_t length, void *context)
+{
+    size_t i;
+    ((unsigned long*)context)[0] += length;
+    for (i = 0; i < length; i++) if (!data[i]) ((unsigned long*)context)[1]++;
+}
+
+// Counts the lines passed in line mode (context is an unsigned long[3] of
+// lines, bytes and lines holding a newline)
+void LineHandle(char *data, void *context)
+{
+    ((unsigned long*)context)[0]++;
+    ((unsigned long*)context)[1] += strlen(data);
+    if (strchr(data, '\n')) ((unsigned long*)context)[2]++;
+}
+
+// Allocator that counts the blocks it hands out (context is a long[2] of
+// allocations and frees)
+void* CountingAlloc(size_t size, void *context)
+{
+    ((long*)context)[0]++;
+    return malloc(size);
+}
+
+void* CountingRealloc(void *block, size_t size, void *context)
+{
+    return realloc(block, size);
+}
+
+void CountingFree(void *block, void *context)
+{
+    ((long*)context)[1]++;
+    free(block);
+}
+
 int main(int argc, char **argv) {
 
     /* Hello */
@@ -179,6 +231,166 @@ int main(int argc, char **argv) {
         printf("RC=%d\n", rc);
     }
 
+    {
+        printf("\n\nData Call Back Test (binary stdout - the callback is passed each read as is)\n");
+        unsigned long counts[2] = {0, 0};
+        SHELLSPAWN_ATTR attr;
+        shellspawn_attr_init(&attr);
+        attr.dOut = DataHandle;
+        spawnErrorCode = shellspawn_ex("testclient --load -b -o 100000", &attr, &rc, &spawnErrorText, counts);
+        if (spawnErrorCode) {
+            printf("Error Spawning Process. SpawnRC=%d. Error Text=%s\n", spawnErrorCode, spawnErrorText);
+            if (spawnErrorText) free(spawnErrorText);
+            spawnErrorText = 0;
+        }
+        printf("RC=%d bytes=%lu nulls=%s\n", rc, counts[0], counts[1] ? "yes" : "no");
+    }
+
+    {
+        printf("\n\nLine Call Back Test (80 byte lines split between reads, passed whole)\n");
+        static const char *policies[] = {"truncate", "fail", "continue"};
+        unsigned long counts[3];
+        SHELLSPAWN_ATTR attr;
+        int i;
+        shellspawn_attr_init(&attr);
+        attr.fOut = LineHandle;
+        attr.lines.enabled = 1;
+        for (i = -1; i < 3; i++) {
+            memset(counts, 0, sizeof(counts));
+            if (i >= 0) {
+                attr.lines.maxLength = 50;
+                attr.lines.overflow = i; // SHELLSPAWN_OVERFLOW_xxx
+            }
+            spawnErrorCode = shellspawn_ex("testclient --load -o 1000L", &attr, &rc, &spawnErrorText, counts);
+            if (spawnErrorCode) {
+                printf("Error Spawning Process. SpawnRC=%d. Error Text=%s\n", spawnErrorCode, spawnErrorText);
+                if (spawnErrorText) free(spawnErrorText);
+                spawnErrorText = 0;
+            }
+            printf("maxLength=%lu %s: RC=%d lines=%lu bytes=%lu newlines=%lu\n", (unsigned long)attr.lines.maxLength,
+                   i >= 0 ? policies[i] : "", rc, counts[0], counts[1], counts[2]);
+        }
+    }
+
+    {
+        printf("\n\nProgress Test\n");
+        char *sIn = "Jones Simon\n";
+        SHELLSPAWN_STATS stats;
+        memset(&stats, 0, sizeof(stats));
+        shellspawn_setstats(&stats);
+        spawnErrorCode = shellspawn(command, NULL, sIn, NULL, NULL,
+                                    NULL, NULL, OutHandle2, NULL,
+                                    NULL, NULL, NULL, NULL, &rc, &spawnErrorText, &n);
+        if (spawnErrorCode) {
+            printf("Error Spawning Process. SpawnRC=%d. Error Text=%s\n", spawnErrorCode, spawnErrorText);
+            if (spawnErrorText) free(spawnErrorText);
+            spawnErrorText = 0;
+        }
+        shellspawn_setstats(NULL);
+        printf("RC=%d\n", rc);
+        printf("Stats: stdout reads=%llu full reads=%llu full pipes=%llu, stderr reads=%llu\n",
+               stats.out.reads, stats.out.fullReads, stats.out.fullPipes, stats.err.reads);
+        double usPerSpawn;
+        shellspawn_overhead(&stats, &usPerSpawn, NULL);
+        printf("Overhead: %.0f CPU-us (child user %llu us, system %llu us)\n",
+               usPerSpawn, stats.childUserUs, stats.childSystemUs);
+    }
+
+    {
+        printf("\n\nAttributes Test (one attr reused, environment, working directory and timeout)\n");
+        char *env[] = {"SHELLSPAWN_TEST=attributes", 0};
+        char *sOut = 0;
+        SHELLSPAWN_ATTR attr;
+        shellspawn_attr_init(&attr);
+        attr.sOut = &sOut;
+        attr.env = env;
+        attr.cwd = "/";
+        attr.timeoutMs = 500;
+        spawnErrorCode = shellspawn_attr_prepare(&attr, &spawnErrorText);
+        for (n = 0; n < 3 && !spawnErrorCode; n++) {
+            spawnErrorCode = shellspawn_ex(n == 0 ? "env" : n == 1 ? "pwd" : "testclient --load -s 5000",
+                                           &attr, &rc, &spawnErrorText, NULL);
+            printf("RC=%d Stdout: %s", rc, sOut ? sOut : "\n");
+        }
+        if (spawnErrorCode) {
+            printf("Error Spawning Process (expected a timeout). SpawnRC=%d. Error Text=%s\n", spawnErrorCode, spawnErrorText);
+            if (spawnErrorText) free(spawnErrorText);
+            spawnErrorText = 0;
+        }
+        if (sOut) free(sOut);
+    }
+
+    {
+        printf("\n\nCaller Buffer Test (stdout truncated, stderr continued, then an overflow error)\n");
+        char out[16];
+        char err[16];
+        SHELLSPAWN_BUFFER bOut = {0};
+        SHELLSPAWN_BUFFER bErr = {0};
+        SHELLSPAWN_ATTR attr;
+        bOut.data = out;
+        bOut.capacity = sizeof(out);
+        bOut.overflow = SHELLSPAWN_OVERFLOW_TRUNCATE;
+        bErr.data = err;
+        bErr.capacity = sizeof(err);
+        bErr.overflow = SHELLSPAWN_OVERFLOW_CONTINUE;
+        shellspawn_attr_init(&attr);
+        attr.sIn = "Jones Simon\n";
+        attr.bOut = &bOut;
+        attr.bErr = &bErr;
+        for (n = 0; n < 2; n++) {
+            spawnErrorCode = shellspawn_ex(command, &attr, &rc, &spawnErrorText, NULL);
+            if (spawnErrorCode) {
+                printf("Error Spawning Process. SpawnRC=%d. Error Text=%s\n", spawnErrorCode, spawnErrorText);
+                if (spawnErrorText) free(spawnErrorText);
+                spawnErrorText = 0;
+            }
+            printf("RC=%d\n", rc);
+            printf("Stdout (%d bytes, truncated=%d): %s\n", (int)bOut.length, bOut.truncated, bOut.data);
+            printf("Stderr (%d + %d bytes): %s%s", (int)bErr.length, (int)bErr.continuationLength,
+                   bErr.data, bErr.continuation ? bErr.continuation : "\n");
+            bOut.overflow = SHELLSPAWN_OVERFLOW_FAIL;
+        }
+        if (bErr.continuation) free(bErr.continuation);
+    }
+
+    {
+        printf("\n\nAllocator Test (a spawn's allocator, then the process wide allocator)\n");
+        long counts[2] = {0, 0};
+        SHELLSPAWN_ALLOCATOR allocator = {CountingAlloc, CountingRealloc, CountingFree, counts};
+        char *sOut = 0;
+        STRINGARRAY *err = 0;
+        SHELLSPAWN_ATTR attr;
+        shellspawn_attr_init(&attr);
+        attr.sIn = "Jones Simon\n";
+        attr.sOut = &sOut;
+        attr.aErr = &err;
+        attr.allocator = &allocator;
+        for (n = 0; n < 2; n++) { // The second spawn frees the first's sOut
+            spawnErrorCode = shellspawn_ex(command, &attr, &rc, &spawnErrorText, NULL);
+            if (spawnErrorCode) {
+                printf("Error Spawning Process. SpawnRC=%d. Error Text=%s\n", spawnErrorCode, spawnErrorText);
+                shellspawn_free(&allocator, spawnErrorText);
+                spawnErrorText = 0;
+            }
+            for (i = 0; err && (*err)[i]; i++) shellspawn_free(&allocator, (*err)[i]);
+            shellspawn_free(&allocator, err);
+            err = 0;
+        }
+        shellspawn_free(&allocator, sOut);
+        printf("RC=%d allocations=%s outstanding=%ld\n", rc, counts[0] ? "yes" : "no", counts[0] - counts[1]);
+
+        counts[0] = counts[1] = 0;
+        shellspawn_setallocator(&allocator);
+        spawnErrorCode = shellspawn("does_not_exist", NULL, NULL, NULL, NULL,
+                                    NULL, NULL, NULL, NULL,
+                                    NULL, NULL, NULL, NULL, &rc, &spawnErrorText, NULL);
+        printf("SpawnRC=%d. Error Text=%s\n", spawnErrorCode, spawnErrorText);
+        shellspawn_free(NULL, spawnErrorText);
+        spawnErrorText = 0;
+        shellspawn_setallocator(NULL);
+        printf("allocations=%s outstanding=%ld\n", counts[0] ? "yes" : "no", counts[0] - counts[1]);
+    }
+
     {
         printf("\n\nNULL Test\n");
         spawnErrorCode = shellspawn(command, NULL, NULL, NULL, NULL,
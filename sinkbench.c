@@ -0,0 +1,232 @@
+// *************************************************************************
+// A B O U T   T H I S   W O R K  -   S H E L L S P A W N
+// *************************************************************************
+// Work Name   : ShellSpawn
+// Description : This provides a simple interface to spawn a process
+//             : with redirected input and output
+// Copyright   : Copyright (C) 2008,2021 Adrian Sutherland
+// *************************************************************************
+// A B O U T   T H I S   F I L E
+// *************************************************************************
+// File Name   : sinkbench.c
+// Description : Microbenchmarks of the output line splitting and capture
+//             : append code with no child process
+// *************************************************************************
+// L I C E N S E
+// *************************************************************************
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of version 3 of the GNU General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//
+// For the avoidance of doubt:
+// - Version 3 of the license (i.e. not earlier nor later versions) apply.
+// - a copy of the license text should be in the "license" directory of the
+//   source distribution.
+// - Requests for use under other licenses will be treated sympathetically,
+//   please see contact details.
+// *************************************************************************
+// C O N T A C T   D E T A I L S
+// *************************************************************************
+// E-mail      : adrian@sutherlandonline.org
+// *************************************************************************
+
+// Usage: sinkbench [-s size] [-t seconds] [-f filter] [-j jsonfile]
+//  - Feeds a synthetic stream of size bytes (default 256K) in chunks through
+//    the library's vector (ConsumeToVector()) and string (ConsumeToString())
+//    sinks, for each line length distribution and chunk size
+//  - Each case is repeated for at least the given time (default 0.2s) and
+//    the time per stream, MB/s and lines/s reported. Freeing the result is
+//    not timed
+//  - filter runs only the cases with names containing it
+//  - The library is compiled in (linuxshell.c is included) so that its
+//    static functions can be called directly
+
+#include "linuxshell.c"
+#include "bench.h"
+
+// Sinks
+#define SINK_VECTOR 0
+#define SINK_STRING 1
+#define SINKS       2
+static const char *sinkNames[SINKS] = {"vector", "string"};
+
+// Line length distributions
+#define LINES_SHORT       0
+#define LINES_TYPICAL     1
+#define LINES_LONG        2
+#define LINES_UNIFORM     3
+#define LINES_EXPONENTIAL 4
+#define LINES_NONE        5
+#define DISTRIBUTIONS     6
+static const char *distributionNames[DISTRIBUTIONS] =
+        {"fixed16", "fixed80", "fixed4096", "uniform1-200", "exp80", "nolines"};
+
+static const size_t chunkSizes[] = {256, 4096, 65536};
+#define CHUNKSIZES 3
+
+// Small deterministic generator so that every run sees the same stream
+static unsigned long Random(unsigned long *seed) {
+    *seed = *seed * 1103515245UL + 12345UL;
+    return (*seed >> 16) & 0x7fff;
+}
+
+// Length of the next line (including the newline)
+static size_t LineLength(int distribution, unsigned long *seed) {
+    double uniform;
+
+    switch (distribution) {
+        case LINES_SHORT: return 16;
+        case LINES_TYPICAL: return 80;
+        case LINES_LONG: return 4096;
+        case LINES_UNIFORM: return 1 + Random(seed) % 200;
+        case LINES_EXPONENTIAL:
+            uniform = ((double)Random(seed) + 1.0) / 32769.0;
+            return 1 + (size_t)(-80.0 * log(uniform));
+        default: return 0;
+    }
+}
+
+// Builds a stream of size bytes - returns the number of lines
+static size_t Generate(char *stream, size_t size, int distribution) {
+    unsigned long seed = 1;
+    size_t lines = 0;
+    size_t length;
+    size_t i = 0;
+    size_t j;
+
+    while (i < size) {
+        length = LineLength(distribution, &seed);
+        if (!length || length > size - i) length = size - i;
+        for (j = 0; j + 1 < length; j++) stream[i + j] = (char)('a' + (i + j) % 26);
+        stream[i + length - 1] = distribution == LINES_NONE && i + length < size ? 'z' : '\n';
+        if (stream[i + length - 1] == '\n') lines++;
+        i += length;
+    }
+    if (distribution == LINES_NONE) stream[size - 1] = 'z';
+    return lines ? lines : 1;
+}
+
+// Feeds the stream through the sink once - returns the ns taken
+static unsigned long long FeedOnce(int sink, const char *stream, size_t size, char *chunk, size_t chunkSize) {
+    STRINGARRAY *aOut = 0;
+    char *sOut = 0;
+    size_t sOutLength = 0;
+    char *partial = 0;
+    unsigned long long start = BenchNow();
+    unsigned long long elapsed;
+    size_t offset;
+    size_t length;
+
+    for (offset = 0; offset < size; offset += length) {
+        length = size - offset < chunkSize ? size - offset : chunkSize;
+        memcpy(chunk, stream + offset, length); // As if read() into the buffer
+        if (sink == SINK_VECTOR) ConsumeToVector(&aOut, &partial, chunk, length);
+        else ConsumeToString(&sOut, &sOutLength, chunk, length);
+    }
+    if (sink == SINK_VECTOR) FinishVector(&aOut, &partial);
+    elapsed = BenchNow() - start;
+
+    if (aOut) freeTextArray(aOut);
+    if (sOut) free(sOut);
+    return elapsed;
+}
+
+static int Run(BENCHRECORD *record, int sink, int distribution, size_t chunkSize,
+               size_t size, double minSeconds, const char *filter) {
+    BENCHSAMPLES samples = {0, 0, 0};
+    unsigned long long total = 0;
+    char name[96];
+    char *stream;
+    char *chunk;
+    size_t lines;
+
+    snprintf(name, sizeof(name), "BM_%s/%s/chunk:%lu", sinkNames[sink], distributionNames[distribution],
+             (unsigned long)chunkSize);
+    if (filter && !strstr(name, filter)) return 0;
+
+    BenchRecordInit(record, name);
+    BenchJsonAdd(record->params, sizeof(record->params), "sink", "%s", sinkNames[sink]);
+    BenchJsonAdd(record->params, sizeof(record->params), "lines", "%s", distributionNames[distribution]);
+    BenchJsonAdd(record->params, sizeof(record->params), "chunk", "%lu", (unsigned long)chunkSize);
+
+    stream = malloc(size);
+    chunk = malloc(chunkSize + 1);
+    lines = Generate(stream, size, distribution);
+
+    FeedOnce(sink, stream, size, chunk, chunkSize); // Warm up
+    while (total < (unsigned long long)(minSeconds * 1e9) || samples.count < 3) {
+        BenchAddSample(&samples, FeedOnce(sink, stream, size, chunk, chunkSize));
+        total += samples.values[samples.count - 1];
+    }
+
+    record->runs = samples.count;
+    BenchSummarise(&samples, &record->latency);
+    BenchFreeSamples(&samples);
+    record->throughput = (double)size / 1e6 / (record->latency.mean / 1e9);
+    record->throughputUnit = "MB/s";
+    BenchJsonAdd(record->metrics, sizeof(record->metrics), "lines_per_s", "%.0f",
+                 (double)lines / (record->latency.mean / 1e9));
+    BenchJsonAdd(record->metrics, sizeof(record->metrics), "ns_per_byte", "%.3f",
+                 record->latency.mean / (double)size);
+
+    printf("%-36s %14.0f %14.0f %10lu %10.1f %14.0f\n", name, record->latency.mean,
+           (double)record->latency.p50, (unsigned long)record->runs, record->throughput,
+           (double)lines / (record->latency.mean / 1e9));
+    fflush(stdout);
+
+    free(stream);
+    free(chunk);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    const char *jsonFile = "sinkbench.json";
+    const char *filter = NULL;
+    char params[256] = "";
+    char *end;
+    BENCHRECORD record;
+    BENCHJSON json;
+    size_t size = 256 * 1024;
+    double minSeconds = 0.2;
+    int sink, distribution, c;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            size = (size_t)strtoul(argv[++i], &end, 10);
+            if (*end == 'k' || *end == 'K') size *= 1024;
+            else if (*end == 'm' || *end == 'M') size *= 1024 * 1024;
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) minSeconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) filter = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) jsonFile = argv[++i];
+        else {
+            fprintf(stderr, "Usage: sinkbench [-s size] [-t seconds] [-f filter] [-j jsonfile]\n");
+            return 1;
+        }
+    }
+    if (size < 1) size = 1;
+
+    BenchJsonAdd(params, sizeof(params), "size", "%lu", (unsigned long)size);
+    BenchJsonAdd(params, sizeof(params), "min_seconds", "%g", minSeconds);
+    BenchJsonOpen(&json, jsonFile, "sinkbench", params);
+
+    printf("Sink microbenchmarks, %lu byte stream\n", (unsigned long)size);
+    printf("%-36s %14s %14s %10s %10s %14s\n", "benchmark", "mean ns", "p50 ns", "iterations", "MB/s", "lines/s");
+    for (sink = 0; sink < SINKS; sink++)
+        for (distribution = 0; distribution < DISTRIBUTIONS; distribution++)
+            for (c = 0; c < CHUNKSIZES; c++)
+                if (Run(&record, sink, distribution, chunkSizes[c], size, minSeconds, filter))
+                    BenchJsonResult(&json, &record);
+
+    BenchJsonClose(&json, jsonFile);
+    return 0;
+}
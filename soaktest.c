@@ -0,0 +1,448 @@
+// *************************************************************************
+// A B O U T   T H I S   W O R K  -   S H E L L S P A W N
+// *************************************************************************
+// Work Name   : ShellSpawn
+// Description : This provides a simple interface to spawn a process
+//             : with redirected input and output
+// Copyright   : Copyright (C) 2008,2021 Adrian Sutherland
+// *************************************************************************
+// A B O U T   T H I S   F I L E
+// *************************************************************************
+// File Name   : soaktest.c
+// Description : Soak test - runs every spawn mode repeatedly and fails if
+//             : fds, threads, zombies or RSS leak
+// *************************************************************************
+// L I C E N S E
+// *************************************************************************
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of version 3 of the GNU General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//
+// For the avoidance of doubt:
+// - Version 3 of the license (i.e. not earlier nor later versions) apply.
+// - a copy of the license text should be in the "license" directory of the
+//   source distribution.
+// - Requests for use under other licenses will be treated sympathetically,
+//   please see contact details.
+// *************************************************************************
+// C O N T A C T   D E T A I L S
+// *************************************************************************
+// E-mail      : adrian@sutherlandonline.org
+// *************************************************************************
+
+// Usage: soaktest [-n iterations] [-m minutes] [-s interval] [-r rss KB]
+//                 [-f fds] [-t threads] [-z zombies]
+//  - Runs every scenario (each spawn mode, the error and cancellation paths,
+//    spawns through a reused spawn context and without one) per iteration,
+//    for n iterations (default 200) or m minutes (at least one iteration is
+//    run either way)
+//  - Samples the fd, thread and zombie child counts and RSS every interval
+//    iterations (default 10). The first sample (after one iteration, so
+//    that one-off allocations are made) is the baseline
+//  - Fails (exit code 1) if a scenario goes wrong or, at the end, a metric
+//    has grown by more than its tolerance from the baseline (default 0 fds,
+//    threads and zombies and 4096 KB RSS)
+//  - Run from the build directory (it uses testclient and input.txt)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "shellspawn.h"
+#include "bench.h"
+
+// Resource sample
+typedef struct sample {
+    int fds;
+    long threads;
+    int zombies;
+    long rssKB;
+} SAMPLE;
+
+// A soak scenario - returns 0 if everything happened as expected
+typedef struct scenario {
+    const char *name;
+    int (*run)(void);
+    unsigned long failures;
+} SCENARIO;
+
+static FILE *inputFile = NULL;
+static FILE *nullFile = NULL;
+static SHELLSPAWN_CONTEXT *spawnContext = NULL;
+
+static void Discard(char *data, void *context) {
+}
+
+// Answers the name prompt once
+static int AnswerOnce(char **data, void *context) {
+    int *calls = (int*)context;
+    if ((*calls)++) return 1;
+    *data = malloc(8);
+    strcpy(*data, "Soaker\n");
+    return 0;
+}
+
+// Closes stdin straight away
+static int CloseInput(char **data, void *context) {
+    return 1;
+}
+
+// Kills the child as soon as it has output something
+static void KillChild(char *data, void *context) {
+    SHELLSPAWN_PROGRESS progress[64];
+    int count = shellspawn_progress(progress, 64);
+    int i;
+
+    for (i = 0; i < count && i < 64; i++)
+        if (progress[i].context == context && progress[i].pid) kill(progress[i].pid, SIGKILL);
+}
+
+// Checks the outcome of a shellspawn() call
+static int Check(const char *name, int result, int expected, int rc, int expectedRC, char *errorText) {
+    int failed = result != expected || (result == SHELLSPAWN_OK && rc != expectedRC);
+
+    if (failed)
+        fprintf(stderr, "%s: SpawnRC=%d (expected %d) RC=%d (expected %d) Error Text=%s\n",
+                name, result, expected, rc, expectedRC, errorText ? errorText : "");
+    if (errorText) free(errorText);
+    return failed;
+}
+
+static int VectorMode(void) {
+    STRINGARRAY in = {"Soaker", 0};
+    STRINGARRAY *out = 0;
+    STRINGARRAY *err = 0;
+    char *errorText = 0;
+    int rc = 0;
+    int result = shellspawn("./testclient", &in, NULL, NULL, NULL,
+                            &out, NULL, NULL, NULL,
+                            &err, NULL, NULL, NULL, &rc, &errorText, NULL);
+    if (out) freeTextArray(out);
+    if (err) freeTextArray(err);
+    return Check("vector", result, SHELLSPAWN_OK, rc, 123, errorText);
+}
+
+static int StringMode(void) {
+    char *sOut = 0;
+    char *sErr = 0;
+    char *errorText = 0;
+    int rc = 0;
+    int result = shellspawn("./testclient", NULL, "Soaker\n", NULL, NULL,
+                            NULL, &sOut, NULL, NULL,
+                            NULL, &sErr, NULL, NULL, &rc, &errorText, NULL);
+    if (sOut) free(sOut);
+    if (sErr) free(sErr);
+    return Check("string", result, SHELLSPAWN_OK, rc, 123, errorText);
+}
+
+static int CallbackMode(void) {
+    char *errorText = 0;
+    int calls = 0;
+    int rc = 0;
+    int result = shellspawn("./testclient", NULL, NULL, AnswerOnce, NULL,
+                            NULL, NULL, Discard, NULL,
+                            NULL, NULL, Discard, NULL, &rc, &errorText, &calls);
+    return Check("callback", result, SHELLSPAWN_OK, rc, 123, errorText);
+}
+
+static int FileMode(void) {
+    char *errorText = 0;
+    int rc = 0;
+    int result;
+
+    fseek(inputFile, 0, SEEK_SET);
+    lseek(fileno(inputFile), 0, SEEK_SET);
+    result = shellspawn("./testclient", NULL, NULL, NULL, inputFile,
+                        NULL, NULL, NULL, nullFile,
+                        NULL, NULL, NULL, nullFile, &rc, &errorText, NULL);
+    return Check("FILE*", result, SHELLSPAWN_OK, rc, 123, errorText);
+}
+
+static int DiscardMode(void) {
+    char *errorText = 0;
+    int rc = 0;
+    int result = shellspawn("./testclient --load -o 64K -e 64K", NULL, NULL, NULL, NULL,
+                            NULL, NULL, NULL, NULL,
+                            NULL, NULL, NULL, NULL, &rc, &errorText, NULL);
+    return Check("discard", result, SHELLSPAWN_OK, rc, 0, errorText);
+}
+
+static int BinaryOutput(void) {
+    char *sOut = 0;
+    char *errorText = 0;
+    int rc = 0;
+    int result = shellspawn("./testclient --load -o 16K -b", NULL, NULL, NULL, NULL,
+                            NULL, &sOut, NULL, NULL,
+                            NULL, NULL, NULL, NULL, &rc, &errorText, NULL);
+    if (sOut) free(sOut);
+    return Check("binary", result, SHELLSPAWN_OK, rc, 0, errorText);
+}
+
+static int ExitCode(void) {
+    STRINGARRAY *out = 0;
+    char *errorText = 0;
+    int rc = 0;
+    int result = shellspawn("./testclient --load -o 10L -x 3", NULL, NULL, NULL, NULL,
+                            &out, NULL, NULL, NULL,
+                            NULL, NULL, NULL, NULL, &rc, &errorText, NULL);
+    if (out) freeTextArray(out);
+    return Check("exit code", result, SHELLSPAWN_OK, rc, 3, errorText);
+}
+
+static int NotFound(void) {
+    char *sOut = 0;
+    char *errorText = 0;
+    int rc = 0;
+    int result = shellspawn("./no_such_command", NULL, NULL, NULL, NULL,
+                            NULL, &sOut, NULL, NULL,
+                            NULL, NULL, NULL, NULL, &rc, &errorText, NULL);
+    if (sOut) free(sOut);
+    return Check("not found", result, SHELLSPAWN_NOFOUND, rc, 0, errorText);
+}
+
+static int TooManyInputs(void) {
+    STRINGARRAY in = {"Soaker", 0};
+    char *errorText = 0;
+    int rc = 0;
+    int result = shellspawn("./testclient", &in, "Soaker\n", NULL, NULL,
+                            NULL, NULL, NULL, NULL,
+                            NULL, NULL, NULL, NULL, &rc, &errorText, NULL);
+    return Check("too many inputs", result, SHELLSPAWN_TOOMANYIN, rc, 0, errorText);
+}
+
+// The child is killed part way through its output
+static int Killed(void) {
+    char *errorText = 0;
+    int context = 0;
+    int rc = 0;
+    int result = shellspawn("./testclient --load -o 1M -c 1K -r 1M", NULL, NULL, NULL, NULL,
+                            NULL, NULL, KillChild, NULL,
+                            NULL, NULL, NULL, NULL, &rc, &errorText, &context);
+    return Check("killed", result, SHELLSPAWN_OK, rc, rc, errorText);
+}
+
+// stdin is closed by the callback before the child reads any
+static int InputClosed(void) {
+    char *errorText = 0;
+    int rc = 0;
+    int result = shellspawn("./testclient --load -i consume", NULL, NULL, CloseInput, NULL,
+                            NULL, NULL, Discard, NULL,
+                            NULL, NULL, Discard, NULL, &rc, &errorText, NULL);
+    return Check("input closed", result, SHELLSPAWN_OK, rc, 0, errorText);
+}
+
+// The child exits without reading its (large) input
+static int InputIgnored(void) {
+    static char *sIn = NULL;
+    char *errorText = 0;
+    int rc = 0;
+    int result;
+
+    if (!sIn) {
+        sIn = malloc(1024 * 1024 + 1);
+        memset(sIn, 'x', 1024 * 1024);
+        sIn[1024 * 1024] = 0;
+    }
+    result = shellspawn("./testclient --load -x 0", NULL, sIn, NULL, NULL,
+                        NULL, NULL, NULL, NULL,
+                        NULL, NULL, NULL, NULL, &rc, &errorText, NULL);
+    return Check("input ignored", result, SHELLSPAWN_OK, rc, 0, errorText);
+}
+
+// Grandchildren keep the pipes open after the child has exited
+static int Grandchildren(void) {
+    char *sOut = 0;
+    char *errorText = 0;
+    int rc = 0;
+    int result = shellspawn("./testclient --load -o 1K -g 2 -G 20", NULL, NULL, NULL, NULL,
+                            NULL, &sOut, NULL, NULL,
+                            NULL, NULL, NULL, NULL, &rc, &errorText, NULL);
+    if (sOut) free(sOut);
+    return Check("grandchildren", result, SHELLSPAWN_OK, rc, 0, errorText);
+}
+
+// Callbacks and a larger read buffer through the (reused) spawn context
+static int ContextReuse(void) {
+    SHELLSPAWN_ATTR attr;
+    char *errorText = 0;
+    int calls = 0;
+    int rc = 0;
+    int result;
+
+    shellspawn_attr_init(&attr);
+    attr.fIn = AnswerOnce;
+    attr.fOut = Discard;
+    attr.fErr = Discard;
+    attr.readBufferSize = 4096;
+    result = shellspawn_run(spawnContext, "./testclient", &attr, &rc, &errorText, &calls);
+    return Check("context", result, SHELLSPAWN_OK, rc, 123, errorText);
+}
+
+// A child killed by the timeout, through the spawn context
+static int ContextTimeout(void) {
+    SHELLSPAWN_ATTR attr;
+    char *errorText = 0;
+    int rc = 0;
+    int result;
+
+    shellspawn_attr_init(&attr);
+    attr.fOut = Discard;
+    attr.timeoutMs = 20;
+    result = shellspawn_run(spawnContext, "./testclient --load -o 1K -s 5000", &attr, &rc, &errorText, NULL);
+    return Check("timeout", result, SHELLSPAWN_TIMEOUT, rc, 0, errorText);
+}
+
+// A large read buffer without a spawn context - so the read buffers come from
+// the spawn's arena blocks (which must all be released)
+static int LargeReadBuffer(void) {
+    SHELLSPAWN_ATTR attr;
+    char *sOut = 0;
+    char *errorText = 0;
+    int rc = 0;
+    int result;
+
+    shellspawn_attr_init(&attr);
+    attr.sOut = &sOut;
+    attr.readBufferSize = 65536;
+    result = shellspawn_ex("./testclient --load -o 256K", &attr, &rc, &errorText, NULL);
+    if (sOut) free(sOut);
+    return Check("large read buffer", result, SHELLSPAWN_OK, rc, 0, errorText);
+}
+
+static SCENARIO scenarios[] = {
+        {"vector", VectorMode, 0},
+        {"string", StringMode, 0},
+        {"callback", CallbackMode, 0},
+        {"FILE*", FileMode, 0},
+        {"discard", DiscardMode, 0},
+        {"binary", BinaryOutput, 0},
+        {"exit code", ExitCode, 0},
+        {"not found", NotFound, 0},
+        {"too many inputs", TooManyInputs, 0},
+        {"killed", Killed, 0},
+        {"input closed", InputClosed, 0},
+        {"input ignored", InputIgnored, 0},
+        {"grandchildren", Grandchildren, 0},
+        {"context", ContextReuse, 0},
+        {"timeout", ContextTimeout, 0},
+        {"large read buffer", LargeReadBuffer, 0}
+};
+#define SCENARIOS (sizeof(scenarios) / sizeof(SCENARIO))
+
+static void Sample(SAMPLE *sample) {
+    sample->fds = BenchFdCount();
+    sample->threads = BenchThreadCount();
+    sample->zombies = BenchZombieCount();
+    sample->rssKB = BenchRssKB();
+}
+
+// Reports a metric - returns 1 if it grew by more than the tolerance
+static int CheckGrowth(const char *metric, long baseline, long peak, long final, long tolerance) {
+    int failed = final - baseline > tolerance;
+
+    printf("%-8s baseline %8ld  peak %8ld  final %8ld  growth %6ld (tolerance %ld) %s\n",
+           metric, baseline, peak, final, final - baseline, tolerance, failed ? "FAILED" : "ok");
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    SAMPLE baseline, peak, sample;
+    unsigned long long end = 0;
+    unsigned long failures = 0;
+    long rssTolerance = 4096;
+    long fdTolerance = 0;
+    long threadTolerance = 0;
+    long zombieTolerance = 0;
+    double minutes = 0;
+    int iterations = 200;
+    int interval = 10;
+    int iteration;
+    int failed = 0;
+    size_t s;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) iterations = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) minutes = atof(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) interval = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) rssTolerance = atol(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) fdTolerance = atol(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) threadTolerance = atol(argv[++i]);
+        else if (strcmp(argv[i], "-z") == 0 && i + 1 < argc) zombieTolerance = atol(argv[++i]);
+        else {
+            fprintf(stderr, "Usage: soaktest [-n iterations] [-m minutes] [-s interval] [-r rss KB]\n"
+                            "                [-f fds] [-t threads] [-z zombies]\n");
+            return 1;
+        }
+    }
+    if (interval < 1) interval = 1;
+    if (iterations < 1) iterations = 1; // The baseline is taken after the first
+    if (minutes > 0) end = BenchNow() + (unsigned long long)(minutes * 60e9);
+
+    inputFile = fopen("input.txt", "r");
+    nullFile = fopen("/dev/null", "w");
+    spawnContext = shellspawn_context_create();
+    if (!inputFile || !nullFile || !spawnContext) {
+        fprintf(stderr, "Error opening input.txt or /dev/null - run from the build directory\n");
+        return 1;
+    }
+
+    if (end) printf("Soak test - %lu scenarios for %.1f minutes\n", (unsigned long)SCENARIOS, minutes);
+    else printf("Soak test - %lu scenarios, %d iterations\n", (unsigned long)SCENARIOS, iterations);
+    printf("%9s %6s %8s %8s %10s %9s\n", "iteration", "fds", "threads", "zombies", "RSS KB", "failures");
+    fflush(stdout); // Not to be copied into forked children
+
+    for (iteration = 1; iteration == 1 || (end ? BenchNow() < end : iteration <= iterations); iteration++) {
+        for (s = 0; s < SCENARIOS; s++) {
+            if (scenarios[s].run()) {
+                scenarios[s].failures++;
+                failures++;
+            }
+        }
+
+        if (iteration == 1 || iteration % interval == 0) {
+            Sample(&sample);
+            if (iteration == 1) {
+                baseline = sample;
+                peak = sample;
+            }
+            if (sample.fds > peak.fds) peak.fds = sample.fds;
+            if (sample.threads > peak.threads) peak.threads = sample.threads;
+            if (sample.zombies > peak.zombies) peak.zombies = sample.zombies;
+            if (sample.rssKB > peak.rssKB) peak.rssKB = sample.rssKB;
+            printf("%9d %6d %8ld %8d %10ld %9lu\n", iteration, sample.fds, sample.threads,
+                   sample.zombies, sample.rssKB, failures);
+            fflush(stdout);
+        }
+    }
+
+    Sample(&sample);
+    printf("\nAfter %d iterations\n", iteration - 1);
+    failed |= CheckGrowth("fds", baseline.fds, peak.fds, sample.fds, fdTolerance);
+    failed |= CheckGrowth("threads", baseline.threads, peak.threads, sample.threads, threadTolerance);
+    failed |= CheckGrowth("zombies", baseline.zombies, peak.zombies, sample.zombies, zombieTolerance);
+    failed |= CheckGrowth("RSS KB", baseline.rssKB, peak.rssKB, sample.rssKB, rssTolerance);
+    for (s = 0; s < SCENARIOS; s++) {
+        if (scenarios[s].failures) {
+            printf("Scenario %s failed %lu times\n", scenarios[s].name, scenarios[s].failures);
+            failed = 1;
+        }
+    }
+    printf("%s\n", failed ? "SOAK TEST FAILED" : "Soak test passed");
+
+    shellspawn_context_free(spawnContext);
+    fclose(inputFile);
+    fclose(nullFile);
+    return failed;
+}
@@ -0,0 +1,283 @@
+// *************************************************************************
+// A B O U T   T H I S   W O R K  -   S H E L L S P A W N
+// *************************************************************************
+// Work Name   : ShellSpawn
+// Description : This provides a simple interface to spawn a process
+//             : with redirected input and output
+// Copyright   : Copyright (C) 2008,2021 Adrian Sutherland
+// *************************************************************************
+// A B O U T   T H I S   F I L E
+// *************************************************************************
+// File Name   : spawnbench.c
+// Description : Spawn-to-exit latency benchmark for each shellspawn() mode
+//             : with posix_spawn(), popen() and system() baselines
+// *************************************************************************
+// L I C E N S E
+// *************************************************************************
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of version 3 of the GNU General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//
+// For the avoidance of doubt:
+// - Version 3 of the license (i.e. not earlier nor later versions) apply.
+// - a copy of the license text should be in the "license" directory of the
+//   source distribution.
+// - Requests for use under other licenses will be treated sympathetically,
+//   please see contact details.
+// *************************************************************************
+// C O N T A C T   D E T A I L S
+// *************************************************************************
+// E-mail      : adrian@sutherlandonline.org
+// *************************************************************************
+
+// Usage: spawnbench [-n iterations] [-t testclient] [-j jsonfile]
+//  - Run from the build directory (it needs testclient and input.txt)
+//  - Prints a table of latencies (microseconds) and the parent's CPU time
+//    per spawn, and writes the results as JSON (spawnbench.json by default)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include "shellspawn.h"
+#include "bench.h"
+
+extern char **environ;
+
+// shellspawn() input/output modes
+#define MODE_VECTOR   0
+#define MODE_STRING   1
+#define MODE_CALLBACK 2
+#define MODE_FILE     3
+#define MODE_NONE     4
+#define MODES         5
+static const char *modeNames[MODES] = {"vector", "string", "callback", "FILE*", "none"};
+
+// Baselines
+#define BASELINE_POSIX_SPAWN 0
+#define BASELINE_POPEN       1
+#define BASELINE_SYSTEM      2
+#define BASELINES            3
+static const char *baselineNames[BASELINES] = {"posix_spawn", "popen", "system"};
+
+static FILE *inputFile = NULL;
+static FILE *nullFile = NULL;
+
+static void OutHandler(char *data, void *context) {
+}
+
+// Answers the first input request - then closes stdin
+static int InHandler(char **data, void *context) {
+    int *calls = (int*)context;
+    if ((*calls)++) return 1;
+    *data = malloc(7);
+    strcpy(*data, "Bench\n");
+    return 0;
+}
+
+// Runs the command once with the input, output and error all in the same mode
+static int SpawnOnce(const char *command, int mode) {
+    STRINGARRAY in = {"Bench", 0};
+    STRINGARRAY *out = 0;
+    STRINGARRAY *err = 0;
+    char *sOut = 0;
+    char *sErr = 0;
+    char *errorText = 0;
+    int calls = 0;
+    int rc = 0;
+    int result;
+
+    switch (mode) {
+        case MODE_VECTOR:
+            result = shellspawn(command, &in, NULL, NULL, NULL,
+                                &out, NULL, NULL, NULL,
+                                &err, NULL, NULL, NULL, &rc, &errorText, NULL);
+            if (out) freeTextArray(out);
+            if (err) freeTextArray(err);
+            break;
+
+        case MODE_STRING:
+            result = shellspawn(command, NULL, "Bench\n", NULL, NULL,
+                                NULL, &sOut, NULL, NULL,
+                                NULL, &sErr, NULL, NULL, &rc, &errorText, NULL);
+            if (sOut) free(sOut);
+            if (sErr) free(sErr);
+            break;
+
+        case MODE_CALLBACK:
+            result = shellspawn(command, NULL, NULL, InHandler, NULL,
+                                NULL, NULL, OutHandler, NULL,
+                                NULL, NULL, OutHandler, NULL, &rc, &errorText, &calls);
+            break;
+
+        case MODE_FILE:
+            fseek(inputFile, 0, SEEK_SET);
+            lseek(fileno(inputFile), 0, SEEK_SET);
+            result = shellspawn(command, NULL, NULL, NULL, inputFile,
+                                NULL, NULL, NULL, nullFile,
+                                NULL, NULL, NULL, nullFile, &rc, &errorText, NULL);
+            break;
+
+        default:
+            result = shellspawn(command, NULL, NULL, NULL, NULL,
+                                NULL, NULL, NULL, NULL,
+                                NULL, NULL, NULL, NULL, &rc, &errorText, NULL);
+    }
+
+    if (result) {
+        fprintf(stderr, "shellspawn(%s) failed. SpawnRC=%d. Error Text=%s\n",
+                command, result, errorText ? errorText : "");
+        if (errorText) free(errorText);
+    }
+    return result;
+}
+
+// Runs the command once with a baseline method - input from /dev/null and output discarded
+static int BaselineOnce(const char *command, int baseline) {
+    char shellCommand[1024];
+    char buffer[4096];
+    char *argv[2];
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int status;
+    FILE *pipe;
+
+    switch (baseline) {
+        case BASELINE_POSIX_SPAWN:
+            argv[0] = (char*)command;
+            argv[1] = 0;
+            posix_spawn_file_actions_init(&actions);
+            posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+            posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+            posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+            status = posix_spawn(&pid, command, &actions, NULL, argv, environ);
+            posix_spawn_file_actions_destroy(&actions);
+            if (status) return -1;
+            if (waitpid(pid, &status, 0) == -1) return -1;
+            return 0;
+
+        case BASELINE_POPEN:
+            snprintf(shellCommand, sizeof(shellCommand), "%s </dev/null 2>/dev/null", command);
+            pipe = popen(shellCommand, "r");
+            if (!pipe) return -1;
+            while (fread(buffer, 1, sizeof(buffer), pipe) > 0);
+            pclose(pipe);
+            return 0;
+
+        default:
+            snprintf(shellCommand, sizeof(shellCommand), "%s </dev/null >/dev/null 2>&1", command);
+            return system(shellCommand) == -1 ? -1 : 0;
+    }
+}
+
+static void Run(BENCHRECORD *record, const char *command, int mode, int baseline, int iterations) {
+    BENCHSAMPLES samples = {0, 0, 0};
+    const char *method = mode >= 0 ? "shellspawn" : baselineNames[baseline];
+    const char *modeName = mode >= 0 ? modeNames[mode] : "-";
+    char name[128];
+    unsigned long long start;
+    double cpu;
+    int i;
+    int rc;
+
+    snprintf(name, sizeof(name), "%s %s %s", command, method, modeName);
+    BenchRecordInit(record, name);
+    BenchJsonAdd(record->params, sizeof(record->params), "command", "%s", command);
+    BenchJsonAdd(record->params, sizeof(record->params), "method", "%s", method);
+    BenchJsonAdd(record->params, sizeof(record->params), "mode", "%s", modeName);
+
+    // Warm up
+    for (i = 0; i < 10; i++) {
+        if (mode >= 0) SpawnOnce(command, mode);
+        else BaselineOnce(command, baseline);
+    }
+
+    cpu = BenchCpuSeconds(RUSAGE_SELF);
+    for (i = 0; i < iterations; i++) {
+        start = BenchNow();
+        if (mode >= 0) rc = SpawnOnce(command, mode);
+        else rc = BaselineOnce(command, baseline);
+        if (rc) record->failures++;
+        else BenchAddSample(&samples, BenchNow() - start);
+    }
+    cpu = BenchCpuSeconds(RUSAGE_SELF) - cpu;
+
+    record->runs = samples.count;
+    BenchSummarise(&samples, &record->latency);
+    BenchFreeSamples(&samples);
+    record->cpu = cpu * 1e6 / (double)iterations;
+    record->cpuUnit = "us/spawn";
+    record->rssKB = BenchMaxRssKB();
+
+    printf("%-16s %-12s %-9s %7lu %5lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+           command, method, modeName,
+           (unsigned long)record->runs, (unsigned long)record->failures,
+           record->latency.mean / 1000.0, record->latency.p50 / 1000.0, record->latency.p99 / 1000.0,
+           record->latency.p999 / 1000.0, record->latency.max / 1000.0, record->cpu);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    const char *commands[2] = {"/bin/true", "./testclient"};
+    const char *jsonFile = "spawnbench.json";
+    BENCHRECORD record;
+    BENCHJSON json;
+    char params[256] = "";
+    int iterations = 1000;
+    int c, m, b, i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) iterations = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) commands[1] = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) jsonFile = argv[++i];
+        else {
+            fprintf(stderr, "Usage: spawnbench [-n iterations] [-t testclient] [-j jsonfile]\n");
+            return 1;
+        }
+    }
+    if (iterations < 1) iterations = 1;
+
+    inputFile = fopen("input.txt", "r");
+    nullFile = fopen("/dev/null", "w");
+    if (!inputFile || !nullFile) {
+        fprintf(stderr, "Error opening input.txt or /dev/null - run from the build directory\n");
+        return 1;
+    }
+
+    BenchJsonAdd(params, sizeof(params), "iterations", "%d", iterations);
+    BenchJsonOpen(&json, jsonFile, "spawnbench", params);
+
+    printf("Spawn-to-exit latency (us), %d iterations\n", iterations);
+    printf("%-16s %-12s %-9s %7s %5s %9s %9s %9s %9s %9s %9s\n",
+           "command", "method", "mode", "runs", "fail", "mean", "p50", "p99", "p999", "max", "CPU us");
+
+    for (c = 0; c < 2; c++) {
+        for (m = 0; m < MODES; m++) {
+            Run(&record, commands[c], m, 0, iterations);
+            BenchJsonResult(&json, &record);
+        }
+        for (b = 0; b < BASELINES; b++) {
+            Run(&record, commands[c], -1, b, iterations);
+            BenchJsonResult(&json, &record);
+        }
+    }
+
+    BenchJsonClose(&json, jsonFile);
+
+    fclose(inputFile);
+    fclose(nullFile);
+    return 0;
+}
@@ -37,10 +37,36 @@
 // E-mail      : adrian@sutherlandonline.org
 // *************************************************************************
 
+// Usage: testclient [args ...]
+//  - Runs a fixed dialogue (prints its arguments, asks for a name - repeating
+//    while the answer is "repeat" - and exits with 123)
+//
+// Usage: testclient --load [options]
+//  - Load generator for the benchmarks and stress tests (Linux / OSX only at
+//    the moment). The steps are done in this order:
+//  -g n      Start n grandchildren that hold stdout and stderr open (and
+//            sleep for the -G time)
+//  -o bytes  Write bytes to stdout (interleaved with -e in chunk sized writes)
+//  -e bytes  Write bytes to stderr
+//            (bytes can have a K, M or G suffix, or an L suffix for lines)
+//  -L length Line length including the newline (default 80)
+//  -c chunk  Bytes per write() (default 4096)
+//  -r rate   Target output rate in bytes per second (default unlimited)
+//  -b        Write binary data (all byte values including NULs) not lines
+//  -i mode   Stdin - "echo" to stdout, or "consume" (default ignored)
+//  -I rate   Target stdin read rate in bytes per second (default unlimited)
+//  -s ms     Sleep before exiting
+//  -G ms     Grandchild sleep time (default 1000)
+//  -x code   Exit code (default 0)
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <time.h>
+#endif
 
 static char * readline(void) {
     char * line = malloc(100), * linep = line;
@@ -78,10 +104,195 @@ static char * readline(void) {
     return linep;
 }
 
+#ifndef _WIN32
+// Load generator settings
+typedef struct loadoptions {
+    unsigned long long outBytes;
+    unsigned long long errBytes;
+    size_t line;
+    size_t chunk;
+    unsigned long long rate;
+    int binary;
+    int echo;
+    int consume;
+    unsigned long long inRate;
+    long sleepMs;
+    int grandchildren;
+    long grandchildMs;
+    int exitCode;
+} LOADOPTIONS;
+
+// Monotonic time in ns
+static unsigned long long Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static void SleepNs(unsigned long long ns) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)(ns / 1000000000ULL);
+    ts.tv_nsec = (long)(ns % 1000000000ULL);
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+// Sleeps until done bytes are due at rate bytes/s since start
+static void Throttle(unsigned long long start, unsigned long long done, unsigned long long rate) {
+    unsigned long long due;
+    unsigned long long now;
+
+    if (!rate) return;
+    due = start + (unsigned long long)((double)done * 1e9 / (double)rate);
+    now = Now();
+    if (due > now) SleepNs(due - now);
+}
+
+// Parses a byte count with an optional K, M or G suffix, or a line count
+// with an L suffix
+static unsigned long long ParseBytes(const char *text, size_t line) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': return value * 1024ULL;
+        case 'm': case 'M': return value * 1024ULL * 1024ULL;
+        case 'g': case 'G': return value * 1024ULL * 1024ULL * 1024ULL;
+        case 'l': case 'L': return value * line;
+        default: return value;
+    }
+}
+
+// Writes all of length bytes to fd
+static int WriteAll(int fd, const char *data, size_t length) {
+    ssize_t written;
+
+    while (length) {
+        written = write(fd, data, length);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+static int Load(int argc, char **argv) {
+    LOADOPTIONS options;
+    const char *outArg = 0;
+    const char *errArg = 0;
+    char *pattern;
+    char *buffer;
+    size_t patternLength;
+    size_t length;
+    ssize_t got;
+    unsigned long long outDone = 0;
+    unsigned long long errDone = 0;
+    unsigned long long inDone = 0;
+    unsigned long long start;
+    int i;
+
+    memset(&options, 0, sizeof(options));
+    options.line = 80;
+    options.chunk = 4096;
+    options.grandchildMs = 1000;
+
+    for (i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0) options.binary = 1;
+        else if (i + 1 >= argc) break;
+        else if (strcmp(argv[i], "-o") == 0) outArg = argv[++i];
+        else if (strcmp(argv[i], "-e") == 0) errArg = argv[++i];
+        else if (strcmp(argv[i], "-L") == 0) options.line = (size_t)atol(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0) options.chunk = (size_t)ParseBytes(argv[++i], 1);
+        else if (strcmp(argv[i], "-r") == 0) options.rate = ParseBytes(argv[++i], 1);
+        else if (strcmp(argv[i], "-i") == 0) {
+            i++;
+            if (strcmp(argv[i], "echo") == 0) options.echo = 1;
+            else if (strcmp(argv[i], "consume") == 0) options.consume = 1;
+            else break;
+        }
+        else if (strcmp(argv[i], "-I") == 0) options.inRate = ParseBytes(argv[++i], 1);
+        else if (strcmp(argv[i], "-s") == 0) options.sleepMs = atol(argv[++i]);
+        else if (strcmp(argv[i], "-g") == 0) options.grandchildren = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-G") == 0) options.grandchildMs = atol(argv[++i]);
+        else if (strcmp(argv[i], "-x") == 0) options.exitCode = atoi(argv[++i]);
+        else break;
+    }
+    if (i < argc) {
+        fprintf(stderr, "testclient: invalid load option %s\n", argv[i]);
+        return 2;
+    }
+    if (options.line < 1) options.line = 1;
+    if (options.chunk < 1) options.chunk = 1;
+    if (outArg) options.outBytes = ParseBytes(outArg, options.line);
+    if (errArg) options.errBytes = ParseBytes(errArg, options.line);
+
+    // Grandchildren - these keep the pipes open after we exit
+    for (i = 0; i < options.grandchildren; i++) {
+        if (fork() == 0) {
+            SleepNs((unsigned long long)options.grandchildMs * 1000000ULL);
+            _exit(0);
+        }
+    }
+
+    // Pattern long enough that a chunk can start at any offset within a line
+    // (or within the 256 byte values)
+    patternLength = options.binary ? 256 : options.line;
+    pattern = malloc(options.chunk + patternLength);
+    buffer = malloc(options.chunk);
+    if (!pattern || !buffer) return 2;
+    for (length = 0; length < options.chunk + patternLength; length++) {
+        if (options.binary) pattern[length] = (char)(length % 256);
+        else pattern[length] = (length % options.line == options.line - 1) ? '\n' : (char)('a' + length % 26);
+    }
+
+    // Output
+    start = Now();
+    while (outDone < options.outBytes || errDone < options.errBytes) {
+        if (outDone < options.outBytes) {
+            length = options.outBytes - outDone < options.chunk ? (size_t)(options.outBytes - outDone) : options.chunk;
+            if (WriteAll(1, pattern + outDone % patternLength, length)) return 2;
+            outDone += length;
+        }
+        if (errDone < options.errBytes) {
+            length = options.errBytes - errDone < options.chunk ? (size_t)(options.errBytes - errDone) : options.chunk;
+            if (WriteAll(2, pattern + errDone % patternLength, length)) return 2;
+            errDone += length;
+        }
+        Throttle(start, outDone + errDone, options.rate);
+    }
+
+    // Input
+    if (options.echo || options.consume) {
+        start = Now();
+        while ((got = read(0, buffer, options.chunk)) != 0) {
+            if (got == -1) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (options.echo && WriteAll(1, buffer, (size_t)got)) break;
+            inDone += (unsigned long long)got;
+            Throttle(start, inDone, options.inRate);
+        }
+    }
+
+    free(pattern);
+    free(buffer);
+
+    if (options.sleepMs) SleepNs((unsigned long long)options.sleepMs * 1000000ULL);
+    return options.exitCode;
+}
+#endif
+
 int main(int argc, char **argv)
 {
     int i;
 
+#ifndef _WIN32
+    /* Load Generator */
+    if (argc > 1 && strcmp(argv[1], "--load") == 0) return Load(argc, argv);
+#endif
+
     /* Hello */
     printf("Test Client for AVShell\n");
     fflush(stdout);
@@ -0,0 +1,450 @@
+// *************************************************************************
+// A B O U T   T H I S   W O R K  -   S H E L L S P A W N
+// *************************************************************************
+// Work Name   : ShellSpawn
+// Description : This provides a simple interface to spawn a process
+//             : with redirected input and output
+// Copyright   : Copyright (C) 2008,2021 Adrian Sutherland
+// *************************************************************************
+// A B O U T   T H I S   F I L E
+// *************************************************************************
+// File Name   : throughputbench.c
+// Description : Output capture throughput benchmark for each shellspawn()
+//             : output sink
+// *************************************************************************
+// L I C E N S E
+// *************************************************************************
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of version 3 of the GNU General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//
+// For the avoidance of doubt:
+// - Version 3 of the license (i.e. not earlier nor later versions) apply.
+// - a copy of the license text should be in the "license" directory of the
+//   source distribution.
+// - Requests for use under other licenses will be treated sympathetically,
+//   please see contact details.
+// *************************************************************************
+// C O N T A C T   D E T A I L S
+// *************************************************************************
+// E-mail      : adrian@sutherlandonline.org
+// *************************************************************************
+
+// Usage: throughputbench [-m] [-s size] [-c chunk] [-l line] [-r repeats] [-j jsonfile]
+//  - size, chunk and line are in bytes and can have a K, M or G suffix
+//  - The child writes size bytes of lines of line bytes (including the
+//    newline) to stdout in write()s of chunk bytes
+//  - Run from the build directory (the child is testclient --load)
+//  - -m selects memory mode. Each sink captures 1M, 10M, 100M ... up to size
+//    bytes in a separate process, and the peak RSS and heap use (from an
+//    interposed malloc() - glibc only) are reported
+//  - Note: the string and vector sinks are slow for large outputs, which is
+//    what this measures, so start small
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "shellspawn.h"
+#include "bench.h"
+
+// Output sinks
+#define SINK_STRING   0
+#define SINK_VECTOR   1
+#define SINK_CALLBACK 2
+#define SINK_DATA     3
+#define SINK_LINES    4
+#define SINK_FILE     5
+#define SINK_DISCARD  6
+#define SINKS         7
+static const char *sinkNames[SINKS] = {"string", "vector", "callback", "data", "lines", "FILE*", "discard"};
+
+// Result of a memory mode run
+typedef struct memoryresult {
+    const char *sink;
+    unsigned long long size;
+    unsigned long long lines;
+    int failed;
+    long baseRssKB;         // Max RSS before the capture
+    long peakRssKB;         // Max RSS after the capture
+    unsigned long long allocations; // malloc(), calloc() and realloc() calls
+    unsigned long long allocatedBytes;
+    unsigned long long peakHeapBytes; // Most heap in use (growth from the start)
+} MEMORYRESULT;
+
+static FILE *nullFile = NULL;
+static unsigned long long callbackBytes = 0;
+
+#ifdef __GLIBC__
+// Interposed allocator - counts the allocations made by this process,
+// including by shellspawn(), while counting is switched on
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static int counting = 0;
+static unsigned long long allocations = 0;
+static unsigned long long allocatedBytes = 0;
+static long long heapBytes = 0;
+static long long peakHeapBytes = 0;
+
+static void CountAllocation(void *ptr, size_t oldSize) {
+    long long heap;
+    long long peak;
+
+    if (!counting || !ptr) return;
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&allocatedBytes, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    heap = __atomic_add_fetch(&heapBytes, (long long)malloc_usable_size(ptr) - (long long)oldSize, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&peakHeapBytes, __ATOMIC_RELAXED);
+    while (heap > peak &&
+           !__atomic_compare_exchange_n(&peakHeapBytes, &peak, heap, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void *malloc(size_t size) {
+    void *ptr = __libc_malloc(size);
+    CountAllocation(ptr, 0);
+    return ptr;
+}
+
+void *calloc(size_t count, size_t size) {
+    void *ptr = __libc_calloc(count, size);
+    CountAllocation(ptr, 0);
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    size_t oldSize = (counting && ptr) ? malloc_usable_size(ptr) : 0;
+    void *newPtr = __libc_realloc(ptr, size);
+    if (newPtr) CountAllocation(newPtr, oldSize);
+    return newPtr;
+}
+
+void free(void *ptr) {
+    if (counting && ptr) __atomic_sub_fetch(&heapBytes, (long long)malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    __libc_free(ptr);
+}
+#endif
+
+// Parses a size with an optional K, M or G suffix
+static unsigned long long ParseSize(const char *text) {
+    char *end;
+    unsigned long long size = strtoull(text, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': return size * 1024ULL;
+        case 'm': case 'M': return size * 1024ULL * 1024ULL;
+        case 'g': case 'G': return size * 1024ULL * 1024ULL * 1024ULL;
+        default: return size;
+    }
+}
+
+static void OutHandler(char *data, void *context) {
+    callbackBytes += strlen(data);
+}
+
+static void DataHandler(const char *data, size_t length, void *context) {
+    callbackBytes += length;
+}
+
+// Runs the generator once with the given output sink
+static int CaptureOnce(const char *command, int sink) {
+    SHELLSPAWN_ATTR attr;
+    STRINGARRAY *out = 0;
+    char *sOut = 0;
+    char *errorText = 0;
+    int rc = 0;
+    int result;
+
+    switch (sink) {
+        case SINK_STRING:
+            result = shellspawn(command, NULL, NULL, NULL, NULL,
+                                NULL, &sOut, NULL, NULL,
+                                NULL, NULL, NULL, NULL, &rc, &errorText, NULL);
+            if (sOut) free(sOut);
+            break;
+
+        case SINK_VECTOR:
+            result = shellspawn(command, NULL, NULL, NULL, NULL,
+                                &out, NULL, NULL, NULL,
+                                NULL, NULL, NULL, NULL, &rc, &errorText, NULL);
+            if (out) freeTextArray(out);
+            break;
+
+        case SINK_CALLBACK:
+            result = shellspawn(command, NULL, NULL, NULL, NULL,
+                                NULL, NULL, OutHandler, NULL,
+                                NULL, NULL, NULL, NULL, &rc, &errorText, NULL);
+            break;
+
+        case SINK_DATA:
+            shellspawn_attr_init(&attr);
+            attr.dOut = DataHandler;
+            result = shellspawn_ex(command, &attr, &rc, &errorText, NULL);
+            break;
+
+        case SINK_LINES:
+            shellspawn_attr_init(&attr);
+            attr.dOut = DataHandler;
+            attr.lines.enabled = 1;
+            result = shellspawn_ex(command, &attr, &rc, &errorText, NULL);
+            break;
+
+        case SINK_FILE:
+            result = shellspawn(command, NULL, NULL, NULL, NULL,
+                                NULL, NULL, NULL, nullFile,
+                                NULL, NULL, NULL, NULL, &rc, &errorText, NULL);
+            break;
+
+        default:
+            result = shellspawn(command, NULL, NULL, NULL, NULL,
+                                NULL, NULL, NULL, NULL,
+                                NULL, NULL, NULL, NULL, &rc, &errorText, NULL);
+    }
+
+    if (result) {
+        fprintf(stderr, "shellspawn(%s) failed. SpawnRC=%d. Error Text=%s\n",
+                command, result, errorText ? errorText : "");
+        if (errorText) free(errorText);
+    }
+    else if (rc) result = -1;
+    return result;
+}
+
+static void Run(BENCHRECORD *record, const char *command, int sink,
+                unsigned long long size, int repeats) {
+    SHELLSPAWN_STATS *stats = calloc(1, sizeof(SHELLSPAWN_STATS));
+    BENCHSAMPLES samples = {0, 0, 0};
+    unsigned long long start;
+    unsigned long long elapsed = 0;
+    double cpu, childCpu;
+    double libraryUsPerMB;
+    double gb;
+    int i;
+
+    BenchRecordInit(record, sinkNames[sink]);
+    BenchJsonAdd(record->params, sizeof(record->params), "sink", "%s", sinkNames[sink]);
+
+    shellspawn_setstats(stats);
+    cpu = BenchCpuSeconds(RUSAGE_SELF);
+    childCpu = BenchCpuSeconds(RUSAGE_CHILDREN);
+    for (i = 0; i < repeats; i++) {
+        start = BenchNow();
+        if (CaptureOnce(command, sink)) record->failures++;
+        else {
+            record->runs++;
+            BenchAddSample(&samples, BenchNow() - start);
+        }
+        elapsed += BenchNow() - start;
+    }
+    cpu = BenchCpuSeconds(RUSAGE_SELF) - cpu;
+    childCpu = BenchCpuSeconds(RUSAGE_CHILDREN) - childCpu;
+    shellspawn_setstats(NULL);
+
+    gb = (double)size * (double)repeats / 1e9;
+    BenchSummarise(&samples, &record->latency);
+    BenchFreeSamples(&samples);
+    record->throughput = elapsed ? (double)size * (double)repeats / 1e6 / ((double)elapsed / 1e9) : 0;
+    record->throughputUnit = "MB/s";
+    record->cpu = cpu / gb;
+    record->cpuUnit = "s/GB";
+    record->rssKB = BenchMaxRssKB();
+    shellspawn_overhead(stats, NULL, &libraryUsPerMB);
+    BenchJsonAdd(record->metrics, sizeof(record->metrics), "child_cpu_s_per_gb", "%.4f", childCpu / gb);
+    BenchJsonAdd(record->metrics, sizeof(record->metrics), "library_us_per_mb", "%.3f", libraryUsPerMB);
+    free(stats);
+
+    printf("%-9s %5lu %5lu %10.1f %12.3f %12.3f %12.1f\n",
+           record->name, (unsigned long)record->runs, (unsigned long)record->failures,
+           record->throughput, record->cpu, childCpu / gb, libraryUsPerMB);
+    fflush(stdout);
+}
+
+// Heap bytes per line beyond the captured bytes (clamped at 0) - only the
+// string and vector sinks capture the output to the heap, so returns 0 (and
+// leaves overhead unset) for the others
+static int OverheadPerLine(const MEMORYRESULT *result, double *overhead) {
+    if (strcmp(result->sink, sinkNames[SINK_STRING]) && strcmp(result->sink, sinkNames[SINK_VECTOR])) return 0;
+    *overhead = ((double)result->peakHeapBytes - (double)result->size) / (double)result->lines;
+    if (*overhead < 0) *overhead = 0;
+    return 1;
+}
+
+// Memory mode - captures size bytes with the sink in a new process so that
+// its peak RSS is not affected by earlier runs
+static void MemoryRun(BENCHRECORD *record, int sink, unsigned long long size,
+                      size_t chunk, size_t line) {
+    MEMORYRESULT memoryResult;
+    MEMORYRESULT *result = &memoryResult;
+    char command[256];
+    char name[64];
+    char overhead[32];
+    double overheadPerLine;
+    int captured;
+    struct rusage usage;
+    int resultPipe[2];
+    pid_t pid;
+    int status;
+
+    snprintf(name, sizeof(name), "%s %llu", sinkNames[sink], size);
+    BenchRecordInit(record, name);
+    BenchJsonAdd(record->params, sizeof(record->params), "sink", "%s", sinkNames[sink]);
+    BenchJsonAdd(record->params, sizeof(record->params), "size", "%llu", size);
+    memset(result, 0, sizeof(MEMORYRESULT));
+    result->sink = sinkNames[sink];
+    result->size = size;
+    result->lines = (size + line - 1) / line;
+    snprintf(command, sizeof(command), "./testclient --load -o %llu -c %lu -L %lu",
+             size, (unsigned long)chunk, (unsigned long)line);
+
+    fflush(stdout);
+    if (pipe(resultPipe) || (pid = fork()) == -1) {
+        perror("Error starting memory measurement process");
+        record->failures = 1;
+        return;
+    }
+
+    if (pid == 0) {
+        // Measurement process
+        close(resultPipe[0]);
+        getrusage(RUSAGE_SELF, &usage);
+        result->baseRssKB = usage.ru_maxrss;
+#ifdef __GLIBC__
+        counting = 1;
+#endif
+        result->failed = CaptureOnce(command, sink) ? 1 : 0;
+#ifdef __GLIBC__
+        counting = 0;
+        result->allocations = allocations;
+        result->allocatedBytes = allocatedBytes;
+        result->peakHeapBytes = (unsigned long long)peakHeapBytes;
+#endif
+        getrusage(RUSAGE_SELF, &usage);
+        result->peakRssKB = usage.ru_maxrss;
+        if (write(resultPipe[1], result, sizeof(MEMORYRESULT)) != sizeof(MEMORYRESULT)) _exit(1);
+        _exit(0);
+    }
+
+    close(resultPipe[1]);
+    if (read(resultPipe[0], result, sizeof(MEMORYRESULT)) != sizeof(MEMORYRESULT)) result->failed = 1;
+    result->sink = sinkNames[sink];
+    close(resultPipe[0]);
+    waitpid(pid, &status, 0);
+
+    captured = OverheadPerLine(result, &overheadPerLine);
+    if (captured) snprintf(overhead, sizeof(overhead), "%.1f", overheadPerLine);
+    else strcpy(overhead, "n/a");
+    printf("%-9s %12llu %10llu %4s %10.1f %10llu %11.1f %10.1f %9.3f %11s\n",
+           result->sink, result->size, result->lines, result->failed ? "FAIL" : "ok",
+           (double)(result->peakRssKB - result->baseRssKB) / 1024.0,
+           result->allocations, (double)result->allocatedBytes / 1048576.0,
+           (double)result->peakHeapBytes / 1048576.0,
+           (double)result->peakHeapBytes / (double)result->size, overhead);
+    fflush(stdout);
+
+    record->runs = result->failed ? 0 : 1;
+    record->failures = result->failed ? 1 : 0;
+    record->rssKB = result->peakRssKB - result->baseRssKB;
+    BenchJsonAdd(record->metrics, sizeof(record->metrics), "lines", "%llu", result->lines);
+    BenchJsonAdd(record->metrics, sizeof(record->metrics), "allocations", "%llu", result->allocations);
+    BenchJsonAdd(record->metrics, sizeof(record->metrics), "allocated_bytes", "%llu", result->allocatedBytes);
+    BenchJsonAdd(record->metrics, sizeof(record->metrics), "peak_heap_bytes", "%llu", result->peakHeapBytes);
+    BenchJsonAdd(record->metrics, sizeof(record->metrics), "heap_bytes_per_byte", "%.4f",
+                 (double)result->peakHeapBytes / (double)result->size);
+    if (captured)
+        BenchJsonAdd(record->metrics, sizeof(record->metrics), "overhead_bytes_per_line", "%.3f", overheadPerLine);
+    else BenchJsonAdd(record->metrics, sizeof(record->metrics), "overhead_bytes_per_line", "null");
+}
+
+int main(int argc, char **argv) {
+    unsigned long long size = 4 * 1024 * 1024;
+    size_t chunk = 4096;
+    size_t line = 80;
+    int repeats = 3;
+    const char *jsonFile = "throughputbench.json";
+    char command[256];
+    char params[256] = "";
+    BENCHRECORD record;
+    BENCHJSON json;
+    unsigned long long memorySize;
+    int memoryMode = 0;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0) memoryMode = 1;
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) size = ParseSize(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) chunk = (size_t)ParseSize(argv[++i]);
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) line = (size_t)ParseSize(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) repeats = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) jsonFile = argv[++i];
+        else {
+            fprintf(stderr, "Usage: throughputbench [-m] [-s size] [-c chunk] [-l line] [-r repeats] [-j jsonfile]\n");
+            return 1;
+        }
+    }
+    if (chunk < 1) chunk = 1;
+    if (line < 1) line = 1;
+    if (repeats < 1) repeats = 1;
+
+    nullFile = fopen("/dev/null", "w");
+    BenchJsonAdd(params, sizeof(params), "chunk", "%lu", (unsigned long)chunk);
+    BenchJsonAdd(params, sizeof(params), "line", "%lu", (unsigned long)line);
+
+    if (memoryMode) {
+        if (strcmp(jsonFile, "throughputbench.json") == 0) jsonFile = "throughputbench-memory.json";
+        BenchJsonAdd(params, sizeof(params), "max_size", "%llu", size);
+        BenchJsonOpen(&json, jsonFile, "throughputbench-memory", params);
+        printf("Capture memory use: %lu byte writes, %lu byte lines%s\n", (unsigned long)chunk, (unsigned long)line,
+#ifdef __GLIBC__
+               "");
+#else
+               " (heap use not available)");
+#endif
+        printf("%-9s %12s %10s %4s %10s %10s %11s %10s %9s %11s\n",
+               "sink", "bytes", "lines", "", "RSS MB", "allocs", "alloc MB", "heap MB", "heap B/B", "overhead/ln");
+        for (memorySize = 1024 * 1024; memorySize <= size; memorySize *= 10) {
+            for (i = 0; i < SINKS; i++) {
+                MemoryRun(&record, i, memorySize, chunk, line);
+                BenchJsonResult(&json, &record);
+            }
+        }
+        BenchJsonClose(&json, jsonFile);
+        fclose(nullFile);
+        return 0;
+    }
+
+    snprintf(command, sizeof(command), "./testclient --load -o %llu -c %lu -L %lu",
+             size, (unsigned long)chunk, (unsigned long)line);
+
+    BenchJsonAdd(params, sizeof(params), "size", "%llu", size);
+    BenchJsonAdd(params, sizeof(params), "repeats", "%d", repeats);
+    BenchJsonOpen(&json, jsonFile, "throughputbench", params);
+
+    printf("Capture throughput: %llu bytes, %lu byte writes, %lu byte lines, %d repeats\n",
+           size, (unsigned long)chunk, (unsigned long)line, repeats);
+    printf("%-9s %5s %5s %10s %12s %12s %12s\n",
+           "sink", "runs", "fail", "MB/s", "CPU s/GB", "child s/GB", "lib us/MB");
+
+    for (i = 0; i < SINKS; i++) {
+        Run(&record, command, i, size, repeats);
+        BenchJsonResult(&json, &record);
+    }
+    BenchJsonClose(&json, jsonFile);
+
+    fclose(nullFile);
+    return 0;
+}